@@ -38,6 +38,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -71,23 +72,48 @@ static int		 ndirs;
 int			 insecure;
 
 /* Known shlibs on the standard system search path.  Persistent,
-   common to all applications */
+   common to all applications, and kept for the whole process as long
+   as neither the hints file nor the directories it lists change */
 static struct shlib_list *shlibs = NULL;
+static time_t		 hints_mtime;
+static time_t		 dirs_mtime[MAXDIRS];
+
+/* Directories found in the RPATH or RUNPATH of some binary, with the
+   shlibs they contained when last scanned.  Persistent as well. */
+struct rpath_dir {
+	UT_hash_handle		 hh;
+	struct rpath_dir	*next;
+	time_t			 mtime;
+	struct shlib_list	*shlibs;
+	char			 path[];
+};
+static struct rpath_dir *rpath_dirs = NULL;
 
-/* Known shlibs on the specific RPATH or RUNPATH of one binary.
-   Evanescent. */
-static struct shlib_list *rpath = NULL;
+/* Directories replaced after a change while other threads may still
+   be looking into them, freed with the rest of the cache */
+static struct rpath_dir *rpath_retired = NULL;
+static pthread_mutex_t	 rpath_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void
-shlib_list_init(void)
+/* The RPATH or RUNPATH directories of one binary, in search order.
+   Evanescent, and private to each thread analysing binaries. */
+static __thread struct rpath_dir *rpath[MAXDIRS];
+static __thread int	 nrpath = 0;
+
+static time_t
+dir_mtime(const char *dir)
 {
-	assert(HASH_COUNT(shlibs) == 0);
+	struct stat	st;
+
+	if (stat(dir, &st) != 0)
+		return (0);
+
+	return (st.st_mtime);
 }
 
 void
 rpath_list_init(void)
 {
-	assert(HASH_COUNT(rpath) == 0);
+	assert(nrpath == 0);
 }
 
 static int
@@ -128,11 +154,16 @@ shlib_list_find_by_name(const char *shlib_file)
 {
 	struct shlib_list *sl;
 
+	int i;
+
 	assert(HASH_COUNT(shlibs) != 0);
 
-	HASH_FIND_STR(rpath, __DECONST(char *, shlib_file), sl);
-	if (sl != NULL)
-		return (sl->path);
+	for (i = 0; i < nrpath; i++) {
+		HASH_FIND_STR(rpath[i]->shlibs, __DECONST(char *, shlib_file),
+		    sl);
+		if (sl != NULL)
+			return (sl->path);
+	}
 
 	HASH_FIND_STR(shlibs, __DECONST(char *, shlib_file), sl);
 	if (sl != NULL)
@@ -141,28 +172,44 @@ shlib_list_find_by_name(const char *shlib_file)
 	return (NULL);
 }
 
-void
-shlib_list_free(void)
+static void
+shlib_hash_free(struct shlib_list **shlib_list)
 {
 	struct shlib_list	*sl1, *sl2;
 
-	HASH_ITER(hh, shlibs, sl1, sl2) {
-		HASH_DEL(shlibs, sl1);
+	HASH_ITER(hh, *shlib_list, sl1, sl2) {
+		HASH_DEL(*shlib_list, sl1);
 		free(sl1);
 	}
-	shlibs = NULL;
+	*shlib_list = NULL;
 }
 
+/* Drop everything cached so far, called from pkg_shutdown() */
 void
-rpath_list_free(void)
+shlib_list_free(void)
 {
-	struct shlib_list	*sl1, *sl2;
+	struct rpath_dir	*rd1, *rd2;
 
-	HASH_ITER(hh, rpath, sl1, sl2) {
-		HASH_DEL(rpath, sl1);
-		free(sl1);
+	shlib_hash_free(&shlibs);
+
+	HASH_ITER(hh, rpath_dirs, rd1, rd2) {
+		HASH_DEL(rpath_dirs, rd1);
+		shlib_hash_free(&rd1->shlibs);
+		free(rd1);
 	}
-	rpath = NULL;
+	rpath_dirs = NULL;
+	while ((rd1 = rpath_retired) != NULL) {
+		rpath_retired = rd1->next;
+		shlib_hash_free(&rd1->shlibs);
+		free(rd1);
+	}
+	nrpath = 0;
+}
+
+void
+rpath_list_free(void)
+{
+	nrpath = 0;
 }
 
 static void
@@ -308,19 +355,89 @@ int shlib_list_from_rpath(const char *rpath_str, const char *dirpath)
 
 	assert(i <= numdirs);
 
-	ret = scan_dirs_for_shlibs(&rpath, i, dirlist, false);
+	ret = EPKG_OK;
+	pthread_mutex_lock(&rpath_lock);
+	for (numdirs = i, i = 0; i < numdirs && nrpath < MAXDIRS; i++) {
+		struct rpath_dir	*rd;
+		time_t			 mtime;
+		size_t			 len;
+
+		mtime = dir_mtime(dirlist[i]);
+
+		HASH_FIND_STR(rpath_dirs, __DECONST(char *, dirlist[i]), rd);
+		if (rd != NULL && rd->mtime != mtime) {
+			HASH_DEL(rpath_dirs, rd);
+			rd->next = rpath_retired;
+			rpath_retired = rd;
+			rd = NULL;
+		}
+		if (rd == NULL) {
+			len = strlen(dirlist[i]) + 1;
+			if ((rd = calloc(1, sizeof(struct rpath_dir) + len))
+			    == NULL) {
+				warnx("Out of memory");
+				ret = EPKG_FATAL;
+				break;
+			}
+			strlcpy(rd->path, dirlist[i], len);
+			rd->mtime = -1;
+			HASH_ADD_STR(rpath_dirs, path, rd);
+		}
+
+		if (rd->mtime != mtime) {
+			rd->mtime = mtime;
+			ret = scan_dirs_for_shlibs(&rd->shlibs, 1, &dirlist[i],
+			    false);
+			if (ret != EPKG_OK)
+				break;
+		}
+
+		rpath[nrpath++] = rd;
+	}
+	pthread_mutex_unlock(&rpath_lock);
 
 	free(dirlist);
 
 	return (ret);
 }
 
+static bool
+elf_hints_changed(const char *hintsfile)
+{
+	int	i;
+
+	if (dir_mtime(hintsfile) != hints_mtime)
+		return (true);
+
+	for (i = 0; i < ndirs; i++)
+		if (dir_mtime(dirs[i]) != dirs_mtime[i])
+			return (true);
+
+	return (false);
+}
+
 int 
 shlib_list_from_elf_hints(const char *hintsfile)
 {
+	int	i, ret;
+
+	if (shlibs != NULL && !elf_hints_changed(hintsfile))
+		return (EPKG_OK);
+
+	shlib_hash_free(&shlibs);
+	ndirs = 0;
+	hints_mtime = dir_mtime(hintsfile);
 	read_elf_hints(hintsfile, 1);
 
-	return (scan_dirs_for_shlibs(&shlibs, ndirs, dirs, true));
+	/* record the mtimes first: a change during the scan means rescan */
+	for (i = 0; i < ndirs; i++)
+		dirs_mtime[i] = dir_mtime(dirs[i]);
+
+	if ((ret = scan_dirs_for_shlibs(&shlibs, ndirs, dirs, true))
+	    != EPKG_OK)
+		shlib_hash_free(&shlibs);
+
+	return (ret);
 }
 
 void
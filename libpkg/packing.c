@@ -27,28 +27,280 @@
 
 #include <sys/cdefs.h>
 #include <sys/stat.h>
+#include <sys/sysctl.h>
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <errno.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <fts.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <limits.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include "pkg.h"
 #include "private/event.h"
 #include "private/pkg.h"
 
 static const char *packing_set_format(struct archive *a, pkg_formats format);
+static void packing_set_options(struct archive *a, const char *ext);
+
+/*
+ * Seekable packages (STGZ) are plain .tgz files made of one gzip member
+ * per frame: every metadata entry gets a frame of its own and the files
+ * are grouped in frames of about PACKING_FRAME_SIZE bytes of tar.  Each
+ * frame starts on an entry header, so decompression can start at any of
+ * them.
+ *
+ * The tar stream is followed by two empty gzip members, which
+ * decompressors ignore: the first carries the index of the frames in its
+ * comment, one "<offset in file> <offset in tar> <first entry>" line per
+ * frame, and the last, of fixed size, the offset of the first one in a
+ * "PK" extra field.
+ */
+#define PACKING_FRAME_SIZE	(1024 * 1024)
+#define PACKING_INDEX_MAGIC	"pkg-index 1\n"
+#define PACKING_LOCATOR_LEN	34
+/* far more than the index of any real package needs */
+#define PACKING_INDEX_MAX	(4 * 1024 * 1024)
+
+struct packing_frames {
+	int		 fd;
+	z_stream	 zs;
+	off_t		 coff;
+	off_t		 uoff;
+	off_t		 ulen;
+	bool		 open;
+	bool		 meta;
+	struct sbuf	*index;
+	unsigned char	 out[BUFSIZ];
+};
 
 struct packing {
 	struct archive *aread;
 	struct archive *awrite;
 	struct archive_entry_linkresolver *resolver;
+	struct packing_frames *frames;
+};
+
+static const unsigned char gzip_empty[] = {
+	0x03, 0x00,			/* empty deflate block */
+	0, 0, 0, 0, 0, 0, 0, 0		/* CRC32 and ISIZE */
 };
 
+static int
+frames_output(struct packing_frames *f, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t w;
+
+	while (len > 0) {
+		if ((w = write(f->fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			pkg_emit_errno("write", "package");
+			return (EPKG_FATAL);
+		}
+		p += w;
+		len -= w;
+		f->coff += w;
+	}
+
+	return (EPKG_OK);
+}
+
+static int
+frames_deflate(struct packing_frames *f, int flush)
+{
+	int ret;
+
+	do {
+		f->zs.next_out = f->out;
+		f->zs.avail_out = sizeof(f->out);
+		ret = deflate(&f->zs, flush);
+		if (ret == Z_STREAM_ERROR) {
+			pkg_emit_error("deflate: %s", f->zs.msg);
+			return (EPKG_FATAL);
+		}
+		if (frames_output(f, f->out, sizeof(f->out) -
+		    f->zs.avail_out) != EPKG_OK)
+			return (EPKG_FATAL);
+	} while (f->zs.avail_out == 0 ||
+	    (flush == Z_FINISH && ret != Z_STREAM_END));
+
+	return (EPKG_OK);
+}
+
+static int
+frames_end(struct packing_frames *f)
+{
+	if (f->uoff == 0 && !f->open)
+		return (EPKG_OK);
+	if (frames_deflate(f, Z_FINISH) != EPKG_OK)
+		return (EPKG_FATAL);
+	deflateReset(&f->zs);
+
+	return (EPKG_OK);
+}
+
+static ssize_t
+packing_frames_write(__unused struct archive *a, void *data, const void *buf,
+    size_t len)
+{
+	struct packing_frames *f = data;
+
+	f->zs.next_in = __DECONST(Bytef *, buf);
+	f->zs.avail_in = len;
+	if (frames_deflate(f, Z_NO_FLUSH) != EPKG_OK)
+		return (-1);
+	f->uoff += len;
+	f->ulen += len;
+
+	return (len);
+}
+
+static int
+packing_frames_close(__unused struct archive *a, void *data)
+{
+	struct packing_frames *f = data;
+	unsigned char head[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0,
+	    0xff };
+	unsigned char extra[16] = { 12, 0, 'P', 'K', 8, 0 };
+	off_t idx;
+	int ret = ARCHIVE_FATAL;
+	int i;
+
+	if (frames_end(f) != EPKG_OK)
+		goto cleanup;
+
+	idx = f->coff;
+	sbuf_finish(f->index);
+	head[3] = 0x10;		/* FCOMMENT */
+	if (frames_output(f, head, sizeof(head)) != EPKG_OK ||
+	    frames_output(f, PACKING_INDEX_MAGIC,
+	    strlen(PACKING_INDEX_MAGIC)) != EPKG_OK ||
+	    frames_output(f, sbuf_data(f->index),
+	    sbuf_len(f->index) + 1) != EPKG_OK ||
+	    frames_output(f, gzip_empty, sizeof(gzip_empty)) != EPKG_OK)
+		goto cleanup;
+
+	head[3] = 0x04;		/* FEXTRA */
+	for (i = 0; i < 8; i++)
+		extra[6 + i] = (idx >> (i * 8)) & 0xff;
+	if (frames_output(f, head, sizeof(head)) != EPKG_OK ||
+	    frames_output(f, extra, 14) != EPKG_OK ||
+	    frames_output(f, gzip_empty, sizeof(gzip_empty)) != EPKG_OK)
+		goto cleanup;
+
+	ret = ARCHIVE_OK;
+
+cleanup:
+	deflateEnd(&f->zs);
+	if (close(f->fd) != 0) {
+		pkg_emit_errno("close", "package");
+		ret = ARCHIVE_FATAL;
+	}
+	f->fd = -1;
+	sbuf_delete(f->index);
+	f->index = NULL;
+
+	return (ret);
+}
+
+/* f itself is freed here, whether libarchive closed it or not */
+static void
+packing_frames_free(struct packing_frames *f)
+{
+	if (f == NULL)
+		return;
+
+	if (f->index != NULL) {
+		deflateEnd(&f->zs);
+		close(f->fd);
+		sbuf_delete(f->index);
+	}
+	free(f);
+}
+
+/*
+ * Called before the header of each entry is written: start a new frame
+ * when needed and record it in the index.
+ */
+static void
+packing_frame_next(struct packing *pack, const char *name)
+{
+	struct packing_frames *f = pack->frames;
+	bool meta;
+
+	if (f == NULL)
+		return;
+
+	meta = (name[0] == '+');
+	if (f->open && !meta && !f->meta && f->ulen < PACKING_FRAME_SIZE)
+		return;
+
+	/* the padding of the previous entry belongs to its frame */
+	archive_write_finish_entry(pack->awrite);
+	if (f->open && frames_end(f) != EPKG_OK)
+		return;
+
+	sbuf_printf(f->index, "%jd %jd %s\n", (intmax_t)f->coff,
+	    (intmax_t)f->uoff, strchr(name, '\n') != NULL ? "-" : name);
+	f->open = true;
+	f->meta = meta;
+	f->ulen = 0;
+}
+
+static int
+packing_frames_init(struct packing *pack, const char *path)
+{
+	struct packing_frames *f;
+	int64_t level = 0;
+
+	if ((f = calloc(1, sizeof(struct packing_frames))) == NULL) {
+		pkg_emit_errno("calloc", "packing_frames");
+		return (EPKG_FATAL);
+	}
+
+	pkg_config_int64(PKG_CONFIG_COMPRESSION_LEVEL, &level);
+	if (level <= 0 || level > 9)
+		level = Z_DEFAULT_COMPRESSION;
+	if (deflateInit2(&f->zs, level, Z_DEFLATED, 15 + 16, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK) {
+		pkg_emit_error("deflateInit2: %s", f->zs.msg);
+		free(f);
+		return (EPKG_FATAL);
+	}
+
+	if ((f->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		pkg_emit_errno("open", path);
+		deflateEnd(&f->zs);
+		free(f);
+		return (EPKG_FATAL);
+	}
+	f->index = sbuf_new_auto();
+
+	/* let each write reach us unbuffered, so frames end where asked */
+	archive_write_add_filter_none(pack->awrite);
+	archive_write_set_bytes_per_block(pack->awrite, 0);
+	if (archive_write_open(pack->awrite, f, NULL, packing_frames_write,
+	    packing_frames_close) != ARCHIVE_OK) {
+		pkg_emit_error("archive_write_open(%s): %s", path,
+		    archive_error_string(pack->awrite));
+		packing_frames_free(f);
+		return (EPKG_FATAL);
+	}
+	pack->frames = f;
+
+	return (EPKG_OK);
+}
+
 int
 packing_init(struct packing **pack, const char *path, pkg_formats format)
 {
@@ -66,7 +318,18 @@ packing_init(struct packing **pack, const char *path, pkg_formats format)
 	archive_read_disk_set_standard_lookup((*pack)->aread);
 	archive_read_disk_set_symlink_physical((*pack)->aread);
 
-	if (!is_dir(path)) {
+	if (!is_dir(path) && format == STGZ) {
+		(*pack)->awrite = archive_write_new();
+		archive_write_set_format_pax_restricted((*pack)->awrite);
+		snprintf(archive_path, sizeof(archive_path), "%s.tgz", path);
+		if (packing_frames_init(*pack, archive_path) != EPKG_OK) {
+			archive_read_free((*pack)->aread);
+			archive_write_free((*pack)->awrite);
+			free(*pack);
+			*pack = NULL;
+			return (EPKG_FATAL);
+		}
+	} else if (!is_dir(path)) {
 		(*pack)->awrite = archive_write_new();
 		archive_write_set_format_pax_restricted((*pack)->awrite);
 		ext = packing_set_format((*pack)->awrite, format);
@@ -76,6 +339,7 @@ packing_init(struct packing **pack, const char *path, pkg_formats format)
 			*pack = NULL;
 			return EPKG_FATAL; /* error set by _set_format() */
 		}
+		packing_set_options((*pack)->awrite, ext);
 		snprintf(archive_path, sizeof(archive_path), "%s.%s", path,
 		    ext);
 
@@ -115,6 +379,7 @@ packing_append_buffer(struct packing *pack, const char *buffer,
 	archive_entry_set_uname(entry, "root");
 	archive_entry_set_pathname(entry, path);
 	archive_entry_set_size(entry, size);
+	packing_frame_next(pack, path);
 	if (archive_write_header(pack->awrite, entry) == -1) {
 		pkg_emit_errno("archive_write_header", path);
 		ret = EPKG_FATAL;
@@ -200,6 +465,7 @@ packing_append_file_attr(struct packing *pack, const char *filepath,
 	if (sparse_entry != NULL && entry == NULL)
 		entry = sparse_entry;
 
+	packing_frame_next(pack, archive_entry_pathname(entry));
 	archive_write_header(pack->awrite, entry);
 
 	if (archive_entry_size(entry) > 0) {
@@ -311,6 +577,7 @@ packing_finish(struct packing *pack)
 
 	archive_write_close(pack->awrite);
 	archive_write_free(pack->awrite);
+	packing_frames_free(pack->frames);
 
 	free(pack);
 
@@ -323,6 +590,12 @@ packing_set_format(struct archive *a, pkg_formats format)
 	const char *notsupp_fmt = "%s is not supported, trying %s";
 
 	switch (format) {
+	case TZST:
+#if ARCHIVE_VERSION_NUMBER >= 3003003
+		if (archive_write_add_filter_zstd(a) == ARCHIVE_OK)
+			return ("tzst");
+#endif
+		pkg_emit_error(notsupp_fmt, "zstd", "xz");
 	case TXZ:
 		if (archive_write_add_filter_xz(a) == ARCHIVE_OK)
 			return ("txz");
@@ -339,25 +612,214 @@ packing_set_format(struct archive *a, pkg_formats format)
 		else
 			pkg_emit_error(notsupp_fmt, "gzip", "plain tar");
 	case TAR:
+	case STGZ:
 		archive_write_add_filter_none(a);
 		return ("tar");
 	}
 	return (NULL);
 }
 
+/*
+ * Apply COMPRESSION_LEVEL and COMPRESSION_THREADS to the filter chosen
+ * by packing_set_format().  Only xz and zstd know how to use several
+ * threads.
+ */
+static void
+packing_set_options(struct archive *a, const char *ext)
+{
+	int64_t level = 0, threads = 1;
+	int64_t maxlevel;
+	int ncpu;
+	size_t len;
+	char val[32];
+
+	if (strcmp(ext, "tar") == 0)
+		return;
+
+	pkg_config_int64(PKG_CONFIG_COMPRESSION_LEVEL, &level);
+	maxlevel = strcmp(ext, "tzst") == 0 ? 22 : 9;
+	if (level > 0) {
+		if (level > maxlevel)
+			level = maxlevel;
+		snprintf(val, sizeof(val), "%d", (int)level);
+		if (archive_write_set_filter_option(a, NULL,
+		    "compression-level", val) != ARCHIVE_OK)
+			pkg_emit_error("unable to set the compression level "
+			    "to %s: %s", val, archive_error_string(a));
+	}
+
+	pkg_config_int64(PKG_CONFIG_COMPRESSION_THREADS, &threads);
+	if (threads < 0) {
+		pkg_emit_error("invalid COMPRESSION_THREADS %" PRId64
+		    ", compressing with one thread", threads);
+		return;
+	}
+	if (threads == 1 ||
+	    (strcmp(ext, "txz") != 0 && strcmp(ext, "tzst") != 0))
+		return;
+
+	if (threads == 0) {
+		len = sizeof(ncpu);
+		if (sysctlbyname("hw.ncpu", &ncpu, &len, NULL, 0) == -1)
+			ncpu = 1;
+		threads = ncpu;
+	}
+	snprintf(val, sizeof(val), "%d", (int)threads);
+	/* libarchive older than 3.2 for xz, 3.6 for zstd, only uses one
+	   thread */
+	if (archive_write_set_filter_option(a, NULL, "threads", val)
+	    != ARCHIVE_OK)
+		pkg_emit_error("unable to compress with %s threads: %s", val,
+		    archive_error_string(a));
+}
+
 pkg_formats
 packing_format_from_string(const char *str)
 {
 	if (str == NULL)
 		return TXZ;
+	if (strcmp(str, "tzst") == 0)
+		return TZST;
 	if (strcmp(str, "txz") == 0)
 		return TXZ;
 	if (strcmp(str, "tbz") == 0)
 		return TBZ;
 	if (strcmp(str, "tgz") == 0)
 		return TGZ;
+	if (strcmp(str, "stgz") == 0)
+		return STGZ;
 	if (strcmp(str, "tar") == 0)
 		return TAR;
 	pkg_emit_error("unknown format %s, using txz", str);
 	return TXZ;
 }
+
+/*
+ * Return the offset of the frame of a seekable package starting with the
+ * entry name, -1 if there is none or the package is not seekable.
+ */
+static off_t
+packing_frame_offset(int fd, const char *name)
+{
+	unsigned char loc[PACKING_LOCATOR_LEN];
+	struct stat st;
+	char *buf = NULL, *p, *line, *end;
+	off_t idx, found = -1;
+	size_t len;
+	int i;
+
+	if (fstat(fd, &st) != 0 || st.st_size < PACKING_LOCATOR_LEN)
+		return (-1);
+	if (pread(fd, loc, sizeof(loc), st.st_size - sizeof(loc)) !=
+	    sizeof(loc))
+		return (-1);
+	if (loc[0] != 0x1f || loc[1] != 0x8b || loc[3] != 0x04 ||
+	    loc[10] != 12 || loc[12] != 'P' || loc[13] != 'K')
+		return (-1);
+
+	idx = 0;
+	for (i = 7; i >= 0; i--)
+		idx = (idx << 8) | loc[16 + i];
+	if (idx < 0 || idx >= st.st_size - PACKING_LOCATOR_LEN)
+		return (-1);
+
+	len = st.st_size - PACKING_LOCATOR_LEN - idx;
+	if (len > PACKING_INDEX_MAX || (buf = malloc(len + 1)) == NULL)
+		return (-1);
+	if (pread(fd, buf, len, idx) != (ssize_t)len)
+		goto cleanup;
+	buf[len] = '\0';
+
+	if (len < 10 || (unsigned char)buf[0] != 0x1f || buf[3] != 0x10 ||
+	    strncmp(buf + 10, PACKING_INDEX_MAGIC,
+	    strlen(PACKING_INDEX_MAGIC)) != 0)
+		goto cleanup;
+
+	p = buf + 10 + strlen(PACKING_INDEX_MAGIC);
+	while ((line = strsep(&p, "\n")) != NULL && *line != '\0') {
+		idx = strtoll(line, &end, 10);
+		if (*end != ' ' || (end = strchr(end + 1, ' ')) == NULL)
+			break;
+		if (strcmp(end + 1, name) == 0) {
+			found = idx;
+			break;
+		}
+	}
+
+cleanup:
+	free(buf);
+	return (found);
+}
+
+struct packing_reader {
+	int		 fd;
+	char		 buf[BUFSIZ * 4];
+};
+
+static ssize_t
+packing_reader_read(__unused struct archive *a, void *data,
+    const void **buf)
+{
+	struct packing_reader *r = data;
+
+	*buf = r->buf;
+	return (read(r->fd, r->buf, sizeof(r->buf)));
+}
+
+static int64_t
+packing_reader_skip(__unused struct archive *a, void *data, int64_t request)
+{
+	struct packing_reader *r = data;
+
+	if (lseek(r->fd, request, SEEK_CUR) == -1)
+		return (0);
+	return (request);
+}
+
+static int
+packing_reader_close(__unused struct archive *a, void *data)
+{
+	struct packing_reader *r = data;
+
+	close(r->fd);
+	free(r);
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Open a for reading at the frame of the seekable package path that
+ * starts with the entry name.  Returns EPKG_END, leaving a untouched, if
+ * path is not seekable or has no such frame.
+ */
+int
+packing_open_frame(struct archive *a, const char *path, const char *name)
+{
+	struct packing_reader *r;
+	off_t off;
+
+	if ((r = malloc(sizeof(struct packing_reader))) == NULL) {
+		pkg_emit_errno("malloc", "packing_reader");
+		return (EPKG_FATAL);
+	}
+
+	if ((r->fd = open(path, O_RDONLY)) < 0) {
+		free(r);
+		return (EPKG_END);
+	}
+
+	if ((off = packing_frame_offset(r->fd, name)) < 0 ||
+	    lseek(r->fd, off, SEEK_SET) != off) {
+		close(r->fd);
+		free(r);
+		return (EPKG_END);
+	}
+
+	if (archive_read_open2(a, r, NULL, packing_reader_read,
+	    packing_reader_skip, packing_reader_close) != ARCHIVE_OK) {
+		pkg_emit_error("archive_read_open(%s): %s", path,
+		    archive_error_string(a));
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
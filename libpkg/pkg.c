@@ -29,12 +29,14 @@
 #include <archive.h>
 #include <archive_entry.h>
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "pkg.h"
 #include "private/event.h"
 #include "private/pkg.h"
+#include "private/pkgdb.h"
 #include "private/utils.h"
 
 static struct _fields {
@@ -89,6 +91,7 @@ pkg_reset(struct pkg *pkg, pkg_t type)
 
 	for (i = 0; i < PKG_NUM_FIELDS; i++)
 		sbuf_reset(pkg->fields[i]);
+	sbuf_reset(pkg->vkey);
 
 	for (i = 0; i < PKG_NUM_SCRIPTS; i++)
 		sbuf_reset(pkg->scripts[i]);
@@ -127,6 +130,7 @@ pkg_free(struct pkg *pkg)
 
 	for (int i = 0; i < PKG_NUM_FIELDS; i++)
 		sbuf_free(pkg->fields[i]);
+	sbuf_free(pkg->vkey);
 
 	for (int i = 0; i < PKG_NUM_SCRIPTS; i++)
 		sbuf_free(pkg->scripts[i]);
@@ -273,60 +277,134 @@ pkg_set_repourl(struct pkg *pkg, const char *str)
 		pkg_set(pkg, PKG_REPOURL, pkg_repo_url(r));
 }
 
-static int
-pkg_vset(struct pkg *pkg, va_list ap)
+void
+pkg_set_s(struct pkg *pkg, pkg_attr attr, const char *str)
 {
-	int attr;
+	struct sbuf **sbuf;
 
-	while ((attr = va_arg(ap, int)) > 0) {
-		if (attr < PKG_NUM_FIELDS) {
-			struct sbuf **sbuf;
-			const char *str = va_arg(ap, const char *);
+	assert(attr < PKG_NUM_FIELDS);
 
-			if (str == NULL) {
-				pkg->fields[attr] = NULL;
-				continue;
-			}
+	if (attr == PKG_VERSION)
+		sbuf_reset(pkg->vkey);
 
-			sbuf = &pkg->fields[attr];
+	if (str == NULL) {
+		pkg->fields[attr] = NULL;
+		return;
+	}
 
-			if (attr == PKG_MTREE && !STARTS_WITH(str, "#mtree")) {
-				sbuf_set(sbuf, "#mtree\n");
-				sbuf_cat(*sbuf, str);
-				sbuf_finish(*sbuf);
-				continue;
-			}
+	sbuf = &pkg->fields[attr];
+
+	if (attr == PKG_MTREE && !STARTS_WITH(str, "#mtree")) {
+		sbuf_set(sbuf, "#mtree\n");
+		sbuf_cat(*sbuf, str);
+		sbuf_finish(*sbuf);
+		return;
+	}
+
+	if (attr == PKG_REPOURL)
+		pkg_set_repourl(pkg, str);
+
+	sbuf_set(sbuf, str);
+}
+
+void
+pkg_set_i(struct pkg *pkg, pkg_attr attr, int64_t val)
+{
+	switch (attr) {
+	case PKG_AUTOMATIC:
+		pkg->automatic = (int)val;
+		break;
+	case PKG_LOCKED:
+		pkg->locked = (bool)val;
+		break;
+	case PKG_LICENSE_LOGIC:
+		pkg->licenselogic = (lic_t)val;
+		break;
+	case PKG_FLATSIZE:
+		pkg->flatsize = val;
+		break;
+	case PKG_OLD_FLATSIZE:
+		pkg->old_flatsize = val;
+		break;
+	case PKG_PKGSIZE:
+		pkg->pkgsize = val;
+		break;
+	case PKG_TIME:
+		pkg->time = val;
+		break;
+	case PKG_ROWID:
+		pkg->rowid = val;
+		break;
+	default:
+		/* XXX emit an error? */
+		break;
+	}
+}
 
-			if (attr == PKG_REPOURL)
-				pkg_set_repourl(pkg, str);
+/*
+ * The sortable key of the version comes from the vkey column when the
+ * package is read from a database, and is otherwise built from the
+ * version the first time it is compared.
+ */
+void
+pkg_set_vkey(struct pkg *pkg, const void *key, size_t len)
+{
+	sbuf_init(&pkg->vkey);
+	sbuf_bcat(pkg->vkey, key, len);
+	sbuf_finish(pkg->vkey);
+}
+
+static struct sbuf *
+pkg_vkey(struct pkg *pkg)
+{
+	if (pkg->vkey != NULL && sbuf_len(pkg->vkey) > 0)
+		return (pkg->vkey);
+
+	sbuf_init(&pkg->vkey);
+	if (pkg_version_key(pkg_version(pkg), pkg->vkey) != EPKG_OK)
+		return (NULL);
+	sbuf_finish(pkg->vkey);
+
+	return (pkg->vkey);
+}
+
+/*
+ * Same as pkg_version_cmp() on the versions of p1 and p2, without parsing
+ * them again on every call.
+ */
+int
+pkg_vkey_cmp(struct pkg *p1, struct pkg *p2)
+{
+	struct sbuf	*k1, *k2;
+
+	k1 = pkg_vkey(p1);
+	k2 = pkg_vkey(p2);
+	assert(k1 != NULL && k2 != NULL);
+
+	return (pkg_version_keycmp(sbuf_data(k1), sbuf_len(k1),
+	    sbuf_data(k2), sbuf_len(k2)));
+}
 
-			sbuf_set(sbuf, str);
+static int
+pkg_vset(struct pkg *pkg, va_list ap)
+{
+	int attr;
+
+	while ((attr = va_arg(ap, int)) > 0) {
+		if (attr < PKG_NUM_FIELDS) {
+			pkg_set_s(pkg, attr, va_arg(ap, const char *));
 			continue;
 		}
 		switch (attr) {
 		case PKG_AUTOMATIC:
-			pkg->automatic = (int)va_arg(ap, int64_t);
-			break;
 		case PKG_LOCKED:
-			pkg->locked = (bool)va_arg(ap, int64_t);
-			break;
 		case PKG_LICENSE_LOGIC:
-			pkg->licenselogic = (lic_t)va_arg(ap, int64_t);
-			break;
 		case PKG_FLATSIZE:
-			pkg->flatsize = va_arg(ap, int64_t);
-			break;
 		case PKG_OLD_FLATSIZE:
-			pkg->old_flatsize = va_arg(ap, int64_t);
-			break;
 		case PKG_PKGSIZE:
-			pkg->pkgsize = va_arg(ap, int64_t);
-			break;
 		case PKG_TIME:
-			pkg->time = va_arg(ap, int64_t);
-			break;
 		case PKG_ROWID:
-			pkg->rowid = va_arg(ap, int64_t);
+			pkg_set_i(pkg, attr, va_arg(ap, int64_t));
 			break;
 		default:
 			/* XXX emit an error? */
@@ -1080,7 +1158,20 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae,
 	archive_read_support_filter_all(*a);
 	archive_read_support_format_tar(*a);
 
-	if (archive_read_open_filename(*a, path, 4096) != ARCHIVE_OK) {
+	/*
+	 * Seekable packages let us start right at the manifest needed, the
+	 * loop below stops once it is parsed when nothing else is wanted.
+	 */
+	ret = packing_open_frame(*a, path,
+	    (flags & PKG_OPEN_MANIFEST_COMPACT) ? "+COMPACT_MANIFEST" :
+	    "+MANIFEST");
+	if (ret == EPKG_FATAL) {
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	if (ret == EPKG_END &&
+	    archive_read_open_filename(*a, path, 4096) != ARCHIVE_OK) {
 		pkg_emit_error("archive_read_open_filename(%s): %s", path,
 				   archive_error_string(*a));
 		retcode = EPKG_FATAL;
@@ -1209,79 +1300,230 @@ pkg_copy_tree(struct pkg *pkg, const char *src, const char *dest)
 	return (packing_finish(pack));
 }
 
-int
-pkg_test_filesum(struct pkg *pkg)
+/*
+ * Hashing of the files of several packages at once for pkg_check_files().
+ * The workers only stat and read the files, each writing to its own job;
+ * the events and the database updates are left to the calling thread.
+ */
+struct filesum_job {
+	struct pkg	*pkg;
+	struct pkg_file	*file;
+	struct stat	 st;
+	bool		 hash;		/* read the file */
+	bool		 stat;		/* lstat the file */
+	bool		 fast;		/* trust the recorded checksum */
+	bool		 found;		/* lstat succeeded */
+	int		 ret;		/* of the hashing */
+	int		 error;		/* errno of the failure */
+	const char	*errfunc;
+	char		 sha256[SHA256_DIGEST_LENGTH * 2 + 1];
+	struct pkg_file_stat meta;
+};
+
+static void
+filesum_job_run(struct filesum_job *job)
 {
-	struct pkg_file *f = NULL;
-	const char *path;
-	const char *sum;
-	char sha256[SHA256_DIGEST_LENGTH * 2 + 1];
-	int rc = EPKG_OK;
+	const char *path = pkg_file_path(job->file);
+
+	job->sha256[0] = '\0';
+	memset(&job->meta, 0, sizeof(job->meta));
+	job->ret = EPKG_OK;
+	job->found = (job->stat && lstat(path, &job->st) == 0);
+
+	if (job->found && !S_ISLNK(job->st.st_mode)) {
+		file_stat_get(&job->st, &job->meta);
+		/* unchanged since its checksum was recorded */
+		if (job->fast && memcmp(&job->meta, &job->file->meta,
+		    sizeof(job->meta)) == 0) {
+			strlcpy(job->sha256, job->file->sum,
+			    sizeof(job->sha256));
+			return;
+		}
+	}
 
-	assert(pkg != NULL);
+	/* nothing to recompute for missing files, symlinks have no checksum */
+	if (job->stat && !job->hash &&
+	    (!job->found || S_ISLNK(job->st.st_mode)))
+		return;
 
-	while (pkg_files(pkg, &f) == EPKG_OK) {
-		path = pkg_file_path(f);
-		sum = pkg_file_cksum(f);
-		if (*sum != '\0') {
-			sha256_file(path, sha256);
-			if (strcmp(sha256, sum) != 0) {
-				pkg_emit_file_mismatch(pkg, f, sum);
-				rc = EPKG_FATAL;
-			}
+	if (sha256_file_r(path, job->sha256, &job->errfunc) != EPKG_OK) {
+		job->error = errno;
+		job->ret = EPKG_FATAL;
+	}
+}
+
+static void
+filesum_worker(void *arg, int i)
+{
+	struct filesum_job *jobs = arg;
+
+	filesum_job_run(&jobs[i]);
+}
+
+/* Report the checksum mismatches of the jobs of one package */
+static int
+filesum_test(struct filesum_job *jobs, int njobs)
+{
+	struct filesum_job	*job;
+	const char		*sum;
+	int			 rc = EPKG_OK;
+	int			 i;
+
+	for (i = 0; i < njobs; i++) {
+		job = &jobs[i];
+		sum = pkg_file_cksum(job->file);
+		if (!job->hash || *sum == '\0')
+			continue;
+		if (job->ret == EPKG_FATAL) {
+			errno = job->error;
+			pkg_emit_errno(job->errfunc, pkg_file_path(job->file));
+		}
+		if (strcmp(job->sha256, sum) != 0) {
+			pkg_emit_file_mismatch(job->pkg, job->file, sum);
+			rc = EPKG_FATAL;
 		}
 	}
 
 	return (rc);
 }
 
-int
-pkg_recompute(struct pkgdb *db, struct pkg *pkg)
+/* Store the checksums and flat size of the jobs of one package */
+static int
+filesum_recompute(struct pkgdb *db, struct pkg *pkg, struct filesum_job *jobs,
+    int njobs)
 {
-	struct pkg_file *f = NULL;
-	const char *path;
-	struct hardlinks *hl = NULL;
-	int64_t flatsize = 0;
-	int64_t oldflatsize;
-	struct stat st;
-	bool regular = false;
-	const char *sum;
-	char sha256[SHA256_DIGEST_LENGTH * 2 + 1];
-	int rc = EPKG_OK;
-
-	while (pkg_files(pkg, &f) == EPKG_OK) {
-		path = pkg_file_path(f);
-		sum = pkg_file_cksum(f);
-		if (lstat(path, &st) == 0) {
-			regular = true;
-			if (S_ISLNK(st.st_mode)) {
-				regular = false;
-				*sha256 = '\0';
-			} else {
-				if (sha256_file(path, sha256) != EPKG_OK) {
-					rc = EPKG_FATAL;
-					break;
-				}
-			}
-
-			/* special case for hardlinks */
-			if (st.st_nlink > 1)
-				regular = is_hardlink(hl, &st);
+	struct filesum_job	*job;
+	struct hardlinks	*hl = NULL;
+	int64_t			 flatsize = 0;
+	int64_t			 oldflatsize;
+	const char		*sha256;
+	bool			 regular;
+	int			 i;
+
+	for (i = 0; i < njobs; i++) {
+		job = &jobs[i];
+		if (!job->found)
+			continue;
 
-			if (regular)
-				flatsize += st.st_size;
+		regular = !S_ISLNK(job->st.st_mode);
+		if (regular && job->ret == EPKG_FATAL) {
+			errno = job->error;
+			pkg_emit_errno(job->errfunc, pkg_file_path(job->file));
+			HASH_FREE(hl, hardlinks, free);
+			return (EPKG_FATAL);
 		}
-		if (strcmp(sha256, sum) != 0)
-			pkgdb_file_set_cksum(db, f, sha256);
+		sha256 = regular ? job->sha256 : "";
+
+		/* special case for hardlinks */
+		if (job->st.st_nlink > 1)
+			regular = is_hardlink(&hl, &job->st);
+
+		if (regular)
+			flatsize += job->st.st_size;
+
+		if (strcmp(sha256, pkg_file_cksum(job->file)) != 0 ||
+		    memcmp(&job->meta, &job->file->meta,
+		    sizeof(job->meta)) != 0)
+			pkgdb_file_set_sum(db, job->file, sha256,
+			    S_ISLNK(job->st.st_mode) ? NULL : &job->st);
 	}
+	HASH_FREE(hl, hardlinks, free);
 
 	pkg_get(pkg, PKG_FLATSIZE, &oldflatsize);
 	if (flatsize != oldflatsize)
 		pkgdb_set(db, pkg, PKG_SET_FLATSIZE, flatsize);
 
+	return (EPKG_OK);
+}
+
+int
+pkg_check_files(struct pkgdb *db, struct pkg **pkgs, int npkgs,
+    unsigned int flags)
+{
+	struct filesum_job	*jobs = NULL, *job;
+	struct pkg_file		*f;
+	int64_t			 threads = 0;
+	bool			 test = (flags & PKG_CHECK_FILESUM);
+	bool			 recompute = (flags & PKG_CHECK_RECOMPUTE);
+	bool			 full = (flags & PKG_CHECK_FULL);
+	int			 rc = EPKG_OK;
+	int			 njobs, i, first, last;
+
+	assert(db != NULL || !recompute);
+
+	njobs = 0;
+	for (i = 0; i < npkgs; i++) {
+		f = NULL;
+		while (pkg_files(pkgs[i], &f) == EPKG_OK)
+			njobs++;
+	}
+	if (njobs > 0 && (jobs = calloc(njobs, sizeof(*jobs))) == NULL) {
+		pkg_emit_errno("calloc", "filesum_job");
+		return (EPKG_FATAL);
+	}
+
+	njobs = 0;
+	for (i = 0; i < npkgs; i++) {
+		f = NULL;
+		while (pkg_files(pkgs[i], &f) == EPKG_OK) {
+			if (!recompute && *pkg_file_cksum(f) == '\0')
+				continue;
+			job = &jobs[njobs++];
+			job->pkg = pkgs[i];
+			job->file = f;
+			job->hash = test && *pkg_file_cksum(f) != '\0';
+			job->fast = !full && *pkg_file_cksum(f) != '\0' &&
+			    f->meta.ino != 0;
+			job->stat = recompute || job->fast;
+		}
+	}
+
+	pkg_config_int64(PKG_CONFIG_CHECK_THREADS, &threads);
+	parallel_for(njobs, threads, filesum_worker, jobs);
+
+	/* one transaction for all the updates */
+	if (recompute &&
+	    pkgdb_transaction_begin(db->sqlite, "recompute") != EPKG_OK) {
+		rc = EPKG_FATAL;
+		recompute = false;
+	}
+
+	/* the jobs of each package are contiguous */
+	for (i = 0, first = 0; i < npkgs; i++, first = last) {
+		for (last = first; last < njobs && jobs[last].pkg == pkgs[i];
+		    last++)
+			;
+		if (test && filesum_test(&jobs[first], last - first)
+		    != EPKG_OK)
+			rc = EPKG_FATAL;
+		if (recompute && filesum_recompute(db, pkgs[i],
+		    &jobs[first], last - first) != EPKG_OK)
+			rc = EPKG_FATAL;
+	}
+
+	if (recompute &&
+	    pkgdb_transaction_commit(db->sqlite, "recompute") != EPKG_OK)
+		rc = EPKG_FATAL;
+
+	free(jobs);
+
 	return (rc);
 }
 
+int
+pkg_test_filesum(struct pkg *pkg)
+{
+	assert(pkg != NULL);
+
+	return (pkg_check_files(NULL, &pkg, 1, PKG_CHECK_FILESUM));
+}
+
+int
+pkg_recompute(struct pkgdb *db, struct pkg *pkg)
+{
+	return (pkg_check_files(db, &pkg, 1, PKG_CHECK_RECOMPUTE));
+}
+
 int
 pkg_try_installed(struct pkgdb *db, const char *origin,
 		struct pkg **pkg, unsigned flags) {
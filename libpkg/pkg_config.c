@@ -47,6 +47,7 @@
 #include "pkg.h"
 #include "private/pkg.h"
 #include "private/event.h"
+#include "private/ldconfig.h"
 
 #define ABI_VAR_STRING "${ABI}"
 #define REPO_NAME_PREFIX "repo-"
@@ -267,7 +268,43 @@ static struct config_entry c[] = {
 		"ENV",
 		NULL,
 		"Environement variable pkg will use",
-	}
+	},
+	[PKG_CONFIG_DB_WAL] = {
+		PKG_CONFIG_BOOL,
+		"PKG_DB_WAL",
+		"NO",
+		"Use write-ahead logging for the local package database",
+	},
+	[PKG_CONFIG_SERVE_SOCKET] = {
+		PKG_CONFIG_STRING,
+		"SERVE_SOCKET",
+		"/var/run/pkg.sock",
+		"Unix socket used by pkg serve",
+	},
+	[PKG_CONFIG_COMPRESSION_THREADS] = {
+		PKG_CONFIG_INTEGER,
+		"COMPRESSION_THREADS",
+		"1",
+		"Number of threads used to compress archives, 0 for one per CPU",
+	},
+	[PKG_CONFIG_COMPRESSION_LEVEL] = {
+		PKG_CONFIG_INTEGER,
+		"COMPRESSION_LEVEL",
+		"0",
+		"Compression level of archives, 0 for the default of the format",
+	},
+	[PKG_CONFIG_PORTS_JOBS] = {
+		PKG_CONFIG_INTEGER,
+		"PORTS_JOBS",
+		"0",
+		"Number of make processes run at once to query the ports tree, 0 for one per CPU",
+	},
+	[PKG_CONFIG_CHECK_THREADS] = {
+		PKG_CONFIG_INTEGER,
+		"CHECK_THREADS",
+		"0",
+		"Number of threads hashing files in pkg check and clean, 0 for one per CPU",
+	},
 };
 
 static bool parsed = false;
@@ -1170,6 +1207,8 @@ pkg_shutdown(void)
 
 	HASH_FREE(config, pkg_config, pkg_config_free);
 	HASH_FREE(repos, pkg_repo, pkg_repo_free);
+	shlib_list_free();
+	pkg_elf_cache_free();
 
 	config_by_key = NULL;
 
@@ -26,13 +26,16 @@
  */
 
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <regex.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -40,6 +43,47 @@
 
 static int pkg_create_from_dir(struct pkg *, const char *, struct packing *);
 
+/*
+ * Map a file whose checksum the manifest does not provide, to compute it
+ * and to hand the same mapping to the ELF analyser, whose cache
+ * pkg_register_shlibs() then uses instead of reading the file again.
+ * Files that already have a checksum are only read by the analyser.
+ */
+static int
+pkg_create_scan_file(const char *fpath, struct pkg_file *file)
+{
+	struct stat	 st;
+	char		*map;
+	int		 fd;
+
+	if (lstat(fpath, &st) != 0 || S_ISLNK(st.st_mode))
+		return (EPKG_OK);
+
+	if (!S_ISREG(st.st_mode) || st.st_size == 0 ||
+	    st.st_size > SSIZE_MAX)
+		return (sha256_file(fpath, file->sum));
+
+	if ((fd = open(fpath, O_RDONLY)) < 0) {
+		pkg_emit_errno("open", fpath);
+		return (EPKG_FATAL);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		pkg_emit_errno("mmap", fpath);
+		return (EPKG_FATAL);
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	sha256_buf(map, st.st_size, file->sum);
+	pkg_elf_cache_prime(fpath, &st, map, st.st_size);
+
+	munmap(map, st.st_size);
+
+	return (EPKG_OK);
+}
+
 static int
 pkg_create_from_dir(struct pkg *pkg, const char *root,
     struct packing *pkg_archive)
@@ -70,15 +114,17 @@ pkg_create_from_dir(struct pkg *pkg, const char *root,
 		else
 			strlcpy(fpath, pkg_path, sizeof(fpath));
 
+		if (pkg->type != PKG_OLD_FILE) {
+			if (file->sum[0] == '\0' &&
+			    pkg_create_scan_file(fpath, file) != EPKG_OK)
+				return (EPKG_FATAL);
+			continue;
+		}
+
 		if ((pkg_sum == NULL || pkg_sum[0] == '\0') &&
 		    lstat(fpath, &st) == 0 && !S_ISLNK(st.st_mode)) {
-			if (pkg->type == PKG_OLD_FILE) {
-				if (md5_file(fpath, sha256) != EPKG_OK)
-					return (EPKG_FATAL);
-			} else {
-				if (sha256_file(fpath, sha256) != EPKG_OK)
-					return (EPKG_FATAL);
-			}
+			if (md5_file(fpath, sha256) != EPKG_OK)
+				return (EPKG_FATAL);
 			strlcpy(file->sum, sha256, sizeof(file->sum));
 		}
 	}
@@ -103,7 +149,7 @@ pkg_create_from_dir(struct pkg *pkg, const char *root,
 		 */
 		struct sbuf *b = sbuf_new_auto();
 
-		pkg_register_shlibs(pkg);
+		pkg_register_shlibs(pkg, root);
 
 		pkg_emit_manifest_sbuf(pkg, b, PKG_MANIFEST_EMIT_COMPACT, NULL);
 		packing_append_buffer(pkg_archive, sbuf_data(b), "+COMPACT_MANIFEST", sbuf_len(b));
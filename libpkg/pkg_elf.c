@@ -44,7 +44,10 @@
 #include <link.h>
 #endif
 #include <paths.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -53,14 +56,43 @@
 #include "private/event.h"
 #include "private/elf_tables.h"
 #include "private/ldconfig.h"
+#include "private/utils.h"
 
 /* FFR: when we support installing a 32bit package on a 64bit host */
 #define _PATH_ELF32_HINTS       "/var/run/ld-elf32.so.hints"
 
+static int analyse_fpath(struct pkg *, const char *);
+
 #define roundup2(x, y)	(((x)+((y)-1))&(~((y)-1))) /* if y is powers of two */
 
+/*
+ * One NEEDED entry of an ELF object, resolved against the shared library
+ * index: status is EPKG_OK for a library out of the base system, EPKG_END
+ * for a base system library, EPKG_FATAL if it could not be found.
+ */
+struct elf_needed {
+	char	*name;
+	char	*path;
+	int	 status;
+};
+
+/* Everything analyse_elf() learns about one file */
+struct elf_result {
+	const char		*fpath;
+	char			*rootpath;	/* fpath under the root, if any */
+	int			 ret;
+	bool			 is_elf;
+	bool			 is_shlib;
+	char			*error;
+	int			 nneeded;
+	struct elf_needed	*needed;
+};
+
+typedef int (*elf_action)(void *, struct pkg *, const char *,
+    struct elf_needed *, bool);
+
 static int
-filter_system_shlibs(const char *name, char *path, size_t pathlen)
+filter_system_shlibs(const char *name, char **path)
 {
 	const char *shlib_path;
 
@@ -75,8 +107,7 @@ filter_system_shlibs(const char *name, char *path, size_t pathlen)
 	    strncmp(shlib_path, "/usr/lib", 7) == 0)
 		return (EPKG_END); /* ignore libs from base */
 
-	if (path != NULL)
-		strncpy(path, shlib_path, pathlen);
+	*path = strdup(shlib_path);
 
 	return (EPKG_OK);
 } 
@@ -84,11 +115,11 @@ filter_system_shlibs(const char *name, char *path, size_t pathlen)
 /* ARGSUSED */
 static int
 add_shlibs_to_pkg(__unused void *actdata, struct pkg *pkg, const char *fpath,
-		  const char *name, bool is_shlib)
+		  struct elf_needed *needed, bool is_shlib)
 {
-	switch(filter_system_shlibs(name, NULL, 0)) {
+	switch(needed->status) {
 	case EPKG_OK:		/* A non-system library */
-		pkg_addshlib_required(pkg, name);
+		pkg_addshlib_required(pkg, needed->name);
 		return (EPKG_OK);
 	case EPKG_END:		/* A system library */
 		return (EPKG_OK);
@@ -99,14 +130,14 @@ add_shlibs_to_pkg(__unused void *actdata, struct pkg *pkg, const char *fpath,
 			return (EPKG_OK);
 
 		warnx("(%s-%s) %s - shared library %s not found",
-		      pkg_name(pkg), pkg_version(pkg), fpath, name);
+		      pkg_name(pkg), pkg_version(pkg), fpath, needed->name);
 		return (EPKG_FATAL);
 	}
 }
 
 static int
 test_depends(void *actdata, struct pkg *pkg, const char *fpath,
-	     const char *name, bool is_shlib)
+	     struct elf_needed *needed, bool is_shlib)
 {
 	struct pkgdb *db = actdata;
 	struct pkg_dep *dep = NULL;
@@ -114,12 +145,11 @@ test_depends(void *actdata, struct pkg *pkg, const char *fpath,
 	struct pkg *d;
 	const char *deporigin, *depname, *depversion;
 	bool deplocked;
-	char pathbuf[MAXPATHLEN];
 	bool found;
 
 	assert(db != NULL);
 
-	switch(filter_system_shlibs(name, pathbuf, sizeof(pathbuf))) {
+	switch(needed->status) {
 	case EPKG_OK:		/* A non-system library */
 		break;
 	case EPKG_END:		/* A system library */
@@ -131,13 +161,13 @@ test_depends(void *actdata, struct pkg *pkg, const char *fpath,
 			return (EPKG_OK);
 
 		warnx("(%s-%s) %s - shared library %s not found",
-		      pkg_name(pkg), pkg_version(pkg), fpath, name);
+		      pkg_name(pkg), pkg_version(pkg), fpath, needed->name);
 		return (EPKG_FATAL);
 	}
 
-	pkg_addshlib_required(pkg, name);
+	pkg_addshlib_required(pkg, needed->name);
 
-	if ((it = pkgdb_query_which(db, pathbuf, false)) == NULL)
+	if ((it = pkgdb_query_which(db, needed->path, false)) == NULL)
 		return (EPKG_OK);
 
 	d = NULL;
@@ -157,7 +187,7 @@ test_depends(void *actdata, struct pkg *pkg, const char *fpath,
 		}
 		if (!found) {
 			pkg_emit_error("adding forgotten depends (%s): %s-%s",
-			    pathbuf, depname, depversion);
+			    needed->path, depname, depversion);
 			pkg_adddep(pkg, depname, deporigin, depversion,
 			    deplocked);
 		}
@@ -212,10 +242,82 @@ warn_about_name_format(struct pkg *pkg, const char *fpath, const char *shlib)
 	}
 }
 
-static int
-analyse_elf(struct pkg *pkg, const char *fpath,
-	int (action)(void *, struct pkg *, const char *, const char *, bool),
-	void *actdata)
+static void
+elf_result_free(struct elf_result *res)
+{
+	int	i;
+
+	for (i = 0; i < res->nneeded; i++) {
+		free(res->needed[i].name);
+		free(res->needed[i].path);
+	}
+	free(res->needed);
+	free(res->error);
+	free(res->rootpath);
+}
+
+/*
+ * What an ELF object says about itself, independently of where it is
+ * installed and of the libraries present on the system.  Kept across
+ * packages, keyed on the identity of the file, so that hard links and
+ * files analysed again are only parsed once.  Other files are not worth
+ * remembering, and the cache is flushed between two packages once it
+ * holds more than ELF_CACHE_MAX objects.
+ */
+struct elf_key {
+	dev_t	 dev;
+	ino_t	 ino;
+	time_t	 mtime;
+};
+
+struct elf_cache {
+	UT_hash_handle	 hh;
+	struct elf_key	 key;
+	int		 ret;
+	bool		 is_elf;
+	bool		 is_shlib;
+	char		*rpath;
+	int		 nneeded;
+	char		**needed;
+};
+
+#define ELF_CACHE_MAX	4096
+
+static struct elf_cache	*elf_cache = NULL;
+static pthread_mutex_t	 elf_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+elf_cache_entry_free(struct elf_cache *ec)
+{
+	int	i;
+
+	for (i = 0; i < ec->nneeded; i++)
+		free(ec->needed[i]);
+	free(ec->needed);
+	free(ec->rpath);
+	free(ec);
+}
+
+void
+pkg_elf_cache_free(void)
+{
+	struct elf_cache	*ec1, *ec2;
+
+	HASH_ITER(hh, elf_cache, ec1, ec2) {
+		HASH_DEL(elf_cache, ec1);
+		elf_cache_entry_free(ec1);
+	}
+	elf_cache = NULL;
+}
+
+/*
+ * Read the facts about the file open on fd, or mapped at map when it is
+ * not NULL.  Returns NULL and sets *error on failure; those are not
+ * cached.
+ */
+static struct elf_cache *
+parse_elf(const char *fpath, int fd, const char *map, size_t len,
+    char **error)
 {
 	Elf *e = NULL;
 	GElf_Ehdr elfhdr;
@@ -225,60 +327,64 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 	GElf_Shdr shdr;
 	Elf_Data *data;
 	GElf_Dyn *dyn, dyn_mem;
-	struct stat sb;
-	int ret = EPKG_OK;
+	struct elf_cache *ec;
+	unsigned char magic[4];
 
 	size_t numdyn = 0;
 	size_t sh_link = 0;
 	size_t dynidx;
 	const char *osname;
-	const char *shlib;
-
-	bool developer = false;
-	bool is_shlib = false;
 
-	pkg_config_bool(PKG_CONFIG_DEVELOPER_MODE, &developer);
-
-	int fd;
-
-	if (lstat(fpath, &sb) != 0)
-		pkg_emit_errno("fstat() failed for %s", fpath);
-	/* ignore empty files and non regular files */
-	if (sb.st_size == 0 || !S_ISREG(sb.st_mode))
-		return (EPKG_END); /* Empty file or sym-link: no results */
+	if ((ec = calloc(1, sizeof(struct elf_cache))) == NULL)
+		return (NULL);
+	ec->ret = EPKG_OK;
 
-	if ((fd = open(fpath, O_RDONLY, 0)) < 0) {
-		return (EPKG_FATAL);
+	/* Most files of a package are not ELF objects: don't bother
+	   libelf with them */
+	if (map != NULL) {
+		if (len < sizeof(magic)) {
+			ec->ret = EPKG_END;
+			return (ec);
+		}
+		memcpy(magic, map, sizeof(magic));
+	} else if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+		ec->ret = EPKG_END;
+		return (ec);
+	}
+	if (magic[0] != ELFMAG0 || magic[1] != ELFMAG1 ||
+	    magic[2] != ELFMAG2 || magic[3] != ELFMAG3) {
+		ec->ret = EPKG_END;
+		return (ec);
 	}
 
-	if ((e = elf_begin(fd, ELF_C_READ, NULL)) == NULL) {
-		ret = EPKG_FATAL;
-		pkg_emit_error("elf_begin() for %s failed: %s", fpath,
+	if (map != NULL)
+		e = elf_memory(__DECONST(char *, map), len);
+	else
+		e = elf_begin(fd, ELF_C_READ, NULL);
+	if (e == NULL) {
+		asprintf(error, "elf_begin() for %s failed: %s", fpath,
 		    elf_errmsg(-1));
-		goto cleanup;
+		goto fatal;
 	}
 
 	if (elf_kind(e) != ELF_K_ELF) {
 		/* Not an elf file: no results */
-		ret = EPKG_END;
+		ec->ret = EPKG_END;
 		goto cleanup;
 	}
 
-	if (developer)
-		pkg->flags |= PKG_CONTAINS_ELF_OBJECTS;
+	ec->is_elf = true;
 
 	if (gelf_getehdr(e, &elfhdr) == NULL) {
-		ret = EPKG_FATAL;
-		pkg_emit_error("getehdr() failed: %s.", elf_errmsg(-1));
-		goto cleanup;
+		asprintf(error, "getehdr() failed: %s.", elf_errmsg(-1));
+		goto fatal;
 	}
 
 	while ((scn = elf_nextscn(e, scn)) != NULL) {
 		if (gelf_getshdr(scn, &shdr) != &shdr) {
-			ret = EPKG_FATAL;
-			pkg_emit_error("getshdr() for %s failed: %s", fpath,
+			asprintf(error, "getshdr() for %s failed: %s", fpath,
 			    elf_errmsg(-1));
-			goto cleanup;
+			goto fatal;
 		}
 		switch (shdr.sh_type) {
 		case SHT_NOTE:
@@ -300,7 +406,7 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 	 * dynamic == NULL means not a dynamically linked elf
 	 */
 	if (dynamic == NULL) {
-		ret = EPKG_END;
+		ec->ret = EPKG_END;
 		goto cleanup; /* not a dynamically linked elf: no results */
 	}
 
@@ -309,89 +415,326 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 		osname = (const char *) data->d_buf + sizeof(Elf_Note);
 		if (strncasecmp(osname, "freebsd", sizeof("freebsd")) != 0 &&
 		    strncasecmp(osname, "dragonfly", sizeof("dragonfly")) != 0) {
-			ret = EPKG_END;	/* Foreign (probably linux) ELF object */
+			ec->ret = EPKG_END; /* Foreign (probably linux) ELF object */
 			goto cleanup;
 		}
 	} else {
 		if (elfhdr.e_ident[EI_OSABI] != ELFOSABI_FREEBSD) {
-			ret = EPKG_END;
+			ec->ret = EPKG_END;
 			goto cleanup;
 		}
 	}
 
 	data = elf_getdata(dynamic, NULL);
 
-	/* First, scan through the data from the .dynamic section to
-	   find any RPATH or RUNPATH settings.  These are colon
-	   separated paths to prepend to the ld.so search paths from
-	   the ELF hints file.  These always seem to come right after
-	   the NEEDED shared library entries.
+	if ((ec->needed = calloc(numdyn, sizeof(char *))) == NULL)
+		goto fatal;
 
-	   NEEDED entries should resolve to a filename for installed
-	   executables, but need not resolve for installed shared
-	   libraries -- additional info from the apps that link
-	   against them would be required.  Shared libraries are
-	   distinguished by a DT_SONAME tag */
+	/* Record the SONAME, the RPATH or RUNPATH and the NEEDED shared
+	   libraries, in order.  Shared libraries are distinguished by a
+	   DT_SONAME tag */
 
-	rpath_list_init();
 	for (dynidx = 0; dynidx < numdyn; dynidx++) {
 		if ((dyn = gelf_getdyn(data, dynidx, &dyn_mem)) == NULL) {
-			ret = EPKG_FATAL;
-			pkg_emit_error("getdyn() failed for %s: %s", fpath,
+			asprintf(error, "getdyn() failed for %s: %s", fpath,
 			    elf_errmsg(-1));
-			goto cleanup;
+			goto fatal;
 		}
 
-		if (dyn->d_tag == DT_SONAME) {
-			is_shlib = true;
+		switch (dyn->d_tag) {
+		case DT_SONAME:
+			ec->is_shlib = true;
+			break;
+		case DT_RPATH:
+		case DT_RUNPATH:
+			if (ec->rpath == NULL)
+				ec->rpath = strdup(elf_strptr(e, sh_link,
+				    dyn->d_un.d_val));
+			break;
+		case DT_NEEDED:
+			ec->needed[ec->nneeded++] = strdup(elf_strptr(e,
+			    sh_link, dyn->d_un.d_val));
+			break;
+		}
+	}
 
-			/* The file being scanned is a shared library
-			   *provided* by the package. Record this if
-			   appropriate */
+cleanup:
+	elf_end(e);
+	return (ec);
 
-			pkg_addshlib_provided(pkg, basename(fpath));
-		}
+fatal:
+	if (e != NULL)
+		elf_end(e);
+	elf_cache_entry_free(ec);
+	return (NULL);
+}
 
-		if (dyn->d_tag != DT_RPATH && dyn->d_tag != DT_RUNPATH)
-			continue;
-		
-		shlib_list_from_rpath(elf_strptr(e, sh_link, dyn->d_un.d_val), 
-				      dirname(fpath));
-		break;
+static void
+elf_cache_key(struct elf_key *key, const struct stat *sb)
+{
+	memset(key, 0, sizeof(*key));
+	key->dev = sb->st_dev;
+	key->ino = sb->st_ino;
+	key->mtime = sb->st_mtime;
+}
+
+/*
+ * Insert ec unless another thread already parsed the same file (through
+ * a hard link for instance) meanwhile; returns the entry to use.
+ */
+static struct elf_cache *
+elf_cache_add(struct elf_cache *ec, const struct elf_key *key)
+{
+	struct elf_cache *other;
+
+	ec->key = *key;
+
+	pthread_mutex_lock(&elf_cache_lock);
+	HASH_FIND(hh, elf_cache, key, sizeof(*key), other);
+	if (other == NULL)
+		HASH_ADD(hh, elf_cache, key, sizeof(*key), ec);
+	pthread_mutex_unlock(&elf_cache_lock);
+
+	if (other != NULL) {
+		elf_cache_entry_free(ec);
+		ec = other;
 	}
 
-	/* Now find all of the NEEDED shared libraries. */
+	return (ec);
+}
 
-	for (dynidx = 0; dynidx < numdyn; dynidx++) {
-		if ((dyn = gelf_getdyn(data, dynidx, &dyn_mem)) == NULL) {
-			ret = EPKG_FATAL;
-			pkg_emit_error("getdyn() failed for %s: %s", fpath,
-			    elf_errmsg(-1));
-			goto cleanup;
+/*
+ * Parse a file the caller has already mapped, so that a later
+ * pkg_register_shlibs() or pkg_analyse_files() finds it in the cache
+ * instead of reading it again.
+ */
+void
+pkg_elf_cache_prime(const char *fpath, const struct stat *sb, const char *map,
+    size_t len)
+{
+	struct elf_cache *ec;
+	struct elf_key key;
+	char *error = NULL;
+
+	if (elf_version(EV_CURRENT) == EV_NONE)
+		return;
+
+	elf_cache_key(&key, sb);
+
+	pthread_mutex_lock(&elf_cache_lock);
+	HASH_FIND(hh, elf_cache, &key, sizeof(key), ec);
+	pthread_mutex_unlock(&elf_cache_lock);
+	if (ec != NULL)
+		return;
+
+	/* errors are reported when the file is analysed for good */
+	if ((ec = parse_elf(fpath, -1, map, len, &error)) == NULL) {
+		free(error);
+		return;
+	}
+	if (!ec->is_elf) {
+		elf_cache_entry_free(ec);
+		return;
+	}
+	elf_cache_add(ec, &key);
+}
+
+/*
+ * Collect the SONAME and the NEEDED entries of one file into res.  This
+ * runs in the worker threads of analyse_elf_files(): it does not touch
+ * the package nor emit events, errors are kept in res->error for the
+ * caller to report.
+ */
+static void
+analyse_elf(struct elf_result *res)
+{
+	struct elf_cache *ec;
+	struct elf_key key;
+	struct stat sb;
+	struct elf_needed *needed;
+	char dirpath[MAXPATHLEN];
+	char *slash;
+	const char *fpath = res->rootpath != NULL ? res->rootpath : res->fpath;
+	int fd;
+	int i;
+
+	res->ret = EPKG_OK;
+
+	/* ignore empty files and non regular files */
+	if (lstat(fpath, &sb) != 0 || sb.st_size == 0 || !S_ISREG(sb.st_mode)) {
+		res->ret = EPKG_END; /* Empty file or sym-link: no results */
+		return;
+	}
+
+	elf_cache_key(&key, &sb);
+
+	pthread_mutex_lock(&elf_cache_lock);
+	HASH_FIND(hh, elf_cache, &key, sizeof(key), ec);
+	pthread_mutex_unlock(&elf_cache_lock);
+
+	if (ec == NULL) {
+		if ((fd = open(fpath, O_RDONLY, 0)) < 0) {
+			res->ret = EPKG_FATAL;
+			return;
+		}
+		ec = parse_elf(fpath, fd, NULL, 0, &res->error);
+		close(fd);
+		if (ec == NULL) {
+			res->ret = EPKG_FATAL;
+			return;
+		}
+		if (!ec->is_elf) {
+			res->ret = ec->ret;
+			elf_cache_entry_free(ec);
+			return;
 		}
+		ec = elf_cache_add(ec, &key);
+	}
 
-		if (dyn->d_tag != DT_NEEDED)
-			continue;
+	res->ret = ec->ret;
+	res->is_elf = ec->is_elf;
+	res->is_shlib = ec->is_shlib;
+	if (ec->ret != EPKG_OK || ec->nneeded == 0)
+		return;
 
-		shlib = elf_strptr(e, sh_link, dyn->d_un.d_val);
+	/* RPATH and RUNPATH are colon separated paths to prepend to the
+	   ld.so search paths from the ELF hints file, relative to the
+	   directory of this very file if they use $ORIGIN.
 
-		/* When running in DEVELOPER_MODE check that shlib
-		   names conform to the correct pattern.  Only issue a
-		   warning on mismatch -- shlibs may belong to a
-		   different package. */
+	   NEEDED entries should resolve to a filename for installed
+	   executables, but need not resolve for installed shared
+	   libraries -- additional info from the apps that link
+	   against them would be required. */
 
-		if (developer)
-			warn_about_name_format(pkg, fpath, shlib);
+	rpath_list_init();
+	if (ec->rpath != NULL) {
+		/* dirname(3) is not reentrant */
+		strlcpy(dirpath, fpath, sizeof(dirpath));
+		if ((slash = strrchr(dirpath, '/')) != NULL)
+			*slash = '\0';
+		else
+			strlcpy(dirpath, ".", sizeof(dirpath));
+
+		shlib_list_from_rpath(ec->rpath, dirpath);
+	}
 
-		action(actdata, pkg, fpath, shlib, is_shlib);
+	if ((res->needed = calloc(ec->nneeded, sizeof(struct elf_needed)))
+	    == NULL) {
+		res->ret = EPKG_FATAL;
+		rpath_list_free();
+		return;
+	}
+
+	for (i = 0; i < ec->nneeded; i++) {
+		needed = &res->needed[res->nneeded++];
+		needed->name = strdup(ec->needed[i]);
+		needed->status = filter_system_shlibs(needed->name,
+		    &needed->path);
 	}
 
-cleanup:
 	rpath_list_free();
+}
 
-	if (e != NULL)
-		elf_end(e);
-	close(fd);
+static void
+analyse_elf_worker(void *arg, int i)
+{
+	analyse_elf(&((struct elf_result *)arg)[i]);
+}
+
+/*
+ * Analyse all the files of pkg on as many threads as there are CPUs, then
+ * apply the results to the package in the order of its files, so that the
+ * outcome does not depend on the scheduling of the workers.  The actions
+ * run here, in the calling thread, as test_depends() uses the database.
+ * In developer mode check_fpath also looks for static libraries, headers
+ * and libtool archives, and stops at the first file that fails.  The files
+ * are read under root when it is not NULL.
+ */
+static int
+analyse_elf_files(struct pkg *pkg, const char *root, elf_action action,
+    void *actdata, bool developer, bool check_fpath)
+{
+	struct pkg_file		*file = NULL;
+	struct elf_result	*results;
+	struct elf_result	*res;
+	int			 nfiles = 0;
+	int			 ret = EPKG_OK;
+	int			 i, j;
+
+	while (pkg_files(pkg, &file) == EPKG_OK)
+		nfiles++;
+
+	if (nfiles == 0)
+		return (EPKG_OK);
+
+	if ((results = calloc(nfiles, sizeof(struct elf_result))) == NULL) {
+		pkg_emit_errno("calloc", "elf_result");
+		return (EPKG_FATAL);
+	}
+
+	i = 0;
+	while (pkg_files(pkg, &file) == EPKG_OK) {
+		res = &results[i++];
+		res->fpath = pkg_file_path(file);
+		if (root != NULL &&
+		    asprintf(&res->rootpath, "%s%s", root, res->fpath) == -1) {
+			pkg_emit_errno("asprintf", res->fpath);
+			res->rootpath = NULL;
+			for (j = 0; j < i; j++)
+				elf_result_free(&results[j]);
+			free(results);
+			return (EPKG_FATAL);
+		}
+	}
+
+	parallel_for(nfiles, 0, analyse_elf_worker, results);
+
+	for (i = 0; i < nfiles; i++) {
+		res = &results[i];
+
+		if (res->error != NULL)
+			pkg_emit_error("%s", res->error);
+
+		if (developer && check_fpath && res->ret != EPKG_OK &&
+		    res->ret != EPKG_END) {
+			ret = res->ret;
+			break;
+		}
+
+		if (developer && res->is_elf)
+			pkg->flags |= PKG_CONTAINS_ELF_OBJECTS;
+
+		if (res->is_shlib) {
+			/* The file being scanned is a shared library
+			   *provided* by the package. Record this if
+			   appropriate */
+			pkg_addshlib_provided(pkg, basename(res->fpath));
+		}
+
+		for (j = 0; j < res->nneeded; j++) {
+			/* When running in DEVELOPER_MODE check that shlib
+			   names conform to the correct pattern.  Only issue
+			   a warning on mismatch -- shlibs may belong to a
+			   different package. */
+			if (developer)
+				warn_about_name_format(pkg, res->fpath,
+				    res->needed[j].name);
+
+			action(actdata, pkg, res->fpath, &res->needed[j],
+			    res->is_shlib);
+		}
+
+		if (developer && check_fpath)
+			analyse_fpath(pkg, res->fpath);
+	}
+
+	for (i = 0; i < nfiles; i++)
+		elf_result_free(&results[i]);
+	free(results);
+
+	/* no worker is running any more, nothing points into the cache */
+	if (HASH_COUNT(elf_cache) > ELF_CACHE_MAX)
+		pkg_elf_cache_free();
 
 	return (ret);
 }
@@ -419,12 +762,10 @@ analyse_fpath(struct pkg *pkg, const char *fpath)
 int
 pkg_analyse_files(struct pkgdb *db, struct pkg *pkg)
 {
-	struct pkg_file *file = NULL;
 	int ret = EPKG_OK;
-	const char *fpath;
 	bool autodeps = false;
 	bool developer = false;
-	int (*action)(void *, struct pkg *, const char *, const char *, bool);
+	elf_action action;
 
 	pkg_config_bool(PKG_CONFIG_AUTODEPS, &autodeps);
 	pkg_config_bool(PKG_CONFIG_DEVELOPER_MODE, &developer);
@@ -437,11 +778,9 @@ pkg_analyse_files(struct pkgdb *db, struct pkg *pkg)
 	else
 		action = add_shlibs_to_pkg;
 
-	shlib_list_init();
-
 	ret = shlib_list_from_elf_hints(_PATH_ELF_HINTS);
 	if (ret != EPKG_OK)
-		goto cleanup;
+		return (ret);
 
 	/* Assume no architecture dependence, for contradiction */
 	if (developer)
@@ -449,44 +788,27 @@ pkg_analyse_files(struct pkgdb *db, struct pkg *pkg)
 				PKG_CONTAINS_STATIC_LIBS |
 				PKG_CONTAINS_H_OR_LA);
 
-	while (pkg_files(pkg, &file) == EPKG_OK) {
-		fpath = pkg_file_path(file);
-		ret = analyse_elf(pkg, fpath, action, db);
-		if (developer) {
-			if (ret != EPKG_OK && ret != EPKG_END)
-				goto cleanup;
-			analyse_fpath(pkg, fpath);
-		}
-	}
-
-	ret = EPKG_OK;
-
-cleanup:
-	shlib_list_free();
-
-	return (ret);
+	return (analyse_elf_files(pkg, NULL, action, db, developer, true));
 }
 
 int
-pkg_register_shlibs(struct pkg *pkg)
+pkg_register_shlibs(struct pkg *pkg, const char *root)
 {
-	struct pkg_file        *file = NULL;
+	bool developer = false;
 
 	pkg_list_free(pkg, PKG_SHLIBS_REQUIRED);
 
 	if (elf_version(EV_CURRENT) == EV_NONE)
 		return (EPKG_FATAL);
 
-	shlib_list_init();
-	if (shlib_list_from_elf_hints(_PATH_ELF_HINTS) != EPKG_OK) {
-		shlib_list_free();
+	pkg_config_bool(PKG_CONFIG_DEVELOPER_MODE, &developer);
+
+	if (shlib_list_from_elf_hints(_PATH_ELF_HINTS) != EPKG_OK)
 		return (EPKG_FATAL);
-	}
 
-	while(pkg_files(pkg, &file) == EPKG_OK)
-		analyse_elf(pkg, pkg_file_path(file), add_shlibs_to_pkg, NULL);
+	analyse_elf_files(pkg, root, add_shlibs_to_pkg, NULL, developer,
+	    false);
 
-	shlib_list_free();
 	return (EPKG_OK);
 }
 
@@ -61,6 +61,8 @@ pipeevent(struct pkg_event *ev)
 	const char *message;
 	const char *name, *version, *newversion;
 	struct pkg_event_conflict *cur_conflict;
+	int i;
+
 	if (eventpipe < 0)
 		return;
 
@@ -359,6 +361,27 @@ pipeevent(struct pkg_event *ev)
 			ev->e_incremental_update.added,
 			ev->e_incremental_update.processed);
 		break;
+	case PKG_EVENT_VULNERABLE:
+		sbuf_printf(msg, "{ \"type\": \"INFO_VULNERABLE\", "
+		    "\"data\": { "
+		    "\"pkgname\": \"%s\", "
+		    "\"pkgversion\": \"%s\", ",
+		    ev->e_vulnerable->pkg_name,
+		    ev->e_vulnerable->pkg_version);
+		sbuf_printf(msg, "\"id\": \"%s\", ",
+		    sbuf_json_escape(buf, ev->e_vulnerable->id != NULL ?
+		    ev->e_vulnerable->id : ""));
+		sbuf_printf(msg, "\"desc\": \"%s\", ",
+		    sbuf_json_escape(buf, ev->e_vulnerable->desc != NULL ?
+		    ev->e_vulnerable->desc : ""));
+		sbuf_printf(msg, "\"url\": \"%s\", \"cves\": [",
+		    sbuf_json_escape(buf, ev->e_vulnerable->url != NULL ?
+		    ev->e_vulnerable->url : ""));
+		for (i = 0; i < ev->e_vulnerable->ncves; i++)
+			sbuf_printf(msg, "%s\"%s\"", i > 0 ? ", " : "",
+			    sbuf_json_escape(buf, ev->e_vulnerable->cves[i]));
+		sbuf_cat(msg, "]}}");
+		break;
 	default:
 		break;
 	}
@@ -751,3 +774,28 @@ pkg_emit_incremental_update(int updated, int removed, int added, int processed)
 
 	pkg_emit_event(&ev);
 }
+
+void
+pkg_emit_vulnerable(struct pkg_vulnerability *v)
+{
+	struct pkg_event ev;
+
+	ev.type = PKG_EVENT_VULNERABLE;
+	ev.e_vulnerable = v;
+
+	pkg_emit_event(&ev);
+}
+
+int
+pkg_audit_report(struct pkg_vulnerability *v)
+{
+	if (v == NULL || v->pkg_name == NULL || v->pkg_version == NULL) {
+		pkg_emit_error("%s: vulnerable package name or version missing",
+		    __func__);
+		return (EPKG_FATAL);
+	}
+
+	pkg_emit_vulnerable(v);
+
+	return (EPKG_OK);
+}
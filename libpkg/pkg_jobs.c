@@ -528,7 +528,6 @@ get_remote_pkg(struct pkg_jobs *j, const char *pattern, match_t m, bool root)
 	struct pkg *p1;
 	struct pkgdb_it *it;
 	char *origin;
-	const char *buf1, *buf2;
 	bool force = false;
 	int rc = EPKG_FATAL;
 	unsigned flags = PKG_LOAD_BASIC|PKG_LOAD_OPTIONS|PKG_LOAD_SHLIBS_REQUIRED;
@@ -561,10 +560,8 @@ get_remote_pkg(struct pkg_jobs *j, const char *pattern, match_t m, bool root)
 			HASH_FIND_STR(j->seen, origin, p1);
 
 		if (p1 != NULL) {
-			pkg_get(p1, PKG_VERSION, &buf1);
-			pkg_get(p, PKG_VERSION, &buf2);
 			p->direct = root;
-			if (pkg_version_cmp(buf1, buf2) != 1)
+			if (pkg_vkey_cmp(p1, p) != 1)
 				continue;
 			HASH_DEL(j->bulk, p1);
 			pkg_free(p1);
@@ -624,7 +621,7 @@ get_local_pkg(struct pkg_jobs *j, const char *origin, unsigned flag)
 static bool
 newer_than_local_pkg(struct pkg_jobs *j, struct pkg *rp, bool force)
 {
-	char *origin, *newversion, *oldversion;
+	char *origin, *oldversion;
 	int64_t oldsize;
 	struct pkg *lp;
 	struct pkg_option *lo = NULL, *ro = NULL;
@@ -652,7 +649,6 @@ newer_than_local_pkg(struct pkg_jobs *j, struct pkg *rp, bool force)
 		return (false);
 	}
 
-	pkg_get(rp, PKG_VERSION, &newversion);
 	pkg_set(rp, PKG_OLD_VERSION, oldversion,
 	    PKG_OLD_FLATSIZE, oldsize,
 	    PKG_AUTOMATIC, (int64_t)automatic);
@@ -663,7 +659,7 @@ newer_than_local_pkg(struct pkg_jobs *j, struct pkg *rp, bool force)
 	}
 
 	/* compare versions */
-	cmp = pkg_version_cmp(newversion, oldversion);
+	cmp = pkg_vkey_cmp(rp, lp);
 
 	if (cmp == 1) {
 		pkg_free(lp);
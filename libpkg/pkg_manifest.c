@@ -268,6 +268,9 @@ pkg_set_from_node(struct pkg *pkg, yaml_node_t *val,
 		val->data.scalar.length--;
 	}
 
+	if (attr == PKG_VERSION)
+		sbuf_reset(pkg->vkey);
+
 	ret = urldecode(val->data.scalar.value, &pkg->fields[attr]);
 
 	return (ret);
@@ -1157,12 +1160,7 @@ emit_manifest(struct pkg *pkg, yaml_emitter_t *emitter, short flags)
 static void
 pkg_emit_manifest_digest(const unsigned char *digest, size_t len, char *hexdigest)
 {
-	unsigned int i;
-
-	for (i = 0; i < len; i ++)
-		sprintf(hexdigest + (i * 2), "%02x", digest[i]);
-
-	hexdigest[len * 2] = '\0';
+	hex_encode(digest, len, hexdigest);
 }
 
 int
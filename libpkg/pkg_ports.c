@@ -290,6 +290,7 @@ file(struct plist *p, char *line, struct file_attr *a)
 	bool regular = false;
 	bool developer;
 	char sha256[SHA256_DIGEST_LENGTH * 2 + 1];
+	struct pkg_file *f;
 	int ret = EPKG_OK;
 
 	len = strlen(line);
@@ -327,7 +328,7 @@ file(struct plist *p, char *line, struct file_attr *a)
 
 		/* special case for hardlinks */
 		if (st.st_nlink > 1)
-			regular = is_hardlink(p->hardlinks, &st);
+			regular = is_hardlink(&p->hardlinks, &st);
 
 		if (regular) {
 			p->flatsize += st.st_size;
@@ -345,6 +346,18 @@ file(struct plist *p, char *line, struct file_attr *a)
 		else
 			ret = pkg_addfile_attr(p->pkg, path, buf, p->uname,
 			    p->gname, p->perm, true);
+
+		/*
+		 * The checksum of an installed file was computed just now:
+		 * keep the metadata it was computed from, see
+		 * pkgdb_register_file_stats().
+		 */
+		if (ret == EPKG_OK && regular && p->stage == NULL &&
+		    pkg_type(p->pkg) != PKG_OLD_FILE) {
+			HASH_FIND_STR(p->pkg->files, path, f);
+			if (f != NULL)
+				file_stat_get(&st, &f->meta);
+		}
 	}
 
 	free_file_attr(a);
@@ -334,3 +334,142 @@ pkg_version_cmp(const char * const pkg1, const char * const pkg2)
 	}
 	return result;
 }
+
+/*
+ * Version keys
+ *
+ * pkg_version_key(version, key) appends to key a byte string such that
+ * comparing two keys with memcmp() (the shorter key sorting first when one
+ * is a prefix of the other) gives the same result as pkg_version_cmp() on
+ * the versions they were built from.  Keys are meant to be computed once
+ * and stored, e.g. in the vkey column of the packages tables, where SQLite
+ * compares them as BLOBs.
+ *
+ * pkg_version_cmp() walks both versions in step, segment by segment (the
+ * parts separated by '+') and component by component, a missing component
+ * being equal to 0.  The key therefore only records the components which
+ * differ from 0, each one as a token holding its position in the version,
+ * so that a component can be compared to the zero the other version has
+ * in the same place.  Tokens of components below 0 sort before the end of
+ * the version, the others after it:
+ *
+ *   epoch, { NEG pos component | POS -pos component }, END, revision
+ *
+ * A component smaller than 0 makes the version smaller the earlier it
+ * comes, hence the position sorts ascending for NEG tokens and descending
+ * for POS ones.  Numbers are written with a length prefix so that their
+ * encodings sort like their values and never are a prefix of one another.
+ */
+
+#define VKEY_NEG	0x01
+#define VKEY_END	0x02
+#define VKEY_POS	0x03
+
+static void
+vkey_uint(struct sbuf *key, uint64_t v)
+{
+	unsigned char	 buf[9];
+	int		 i, n = 0;
+
+	while (n < 8 && v >> (8 * n) != 0)
+		n++;
+	buf[0] = 0x80 + n;
+	for (i = 1; i <= n; i++)
+		buf[i] = (v >> (8 * (n - i))) & 0xff;
+	sbuf_bcat(key, buf, n + 1);
+}
+
+static void
+vkey_int(struct sbuf *key, int64_t v)
+{
+	unsigned char	 buf[9];
+	uint64_t	 w;
+	int		 i, n = 0;
+
+	if (v >= 0) {
+		vkey_uint(key, v);
+		return;
+	}
+
+	/* the more bytes the magnitude takes, the smaller the value */
+	w = ~(uint64_t)v;
+	while (n < 8 && w >> (8 * n) != 0)
+		n++;
+	buf[0] = 0x7f - n;
+	for (i = 1; i <= n; i++)
+		buf[i] = ~(w >> (8 * (n - i))) & 0xff;
+	sbuf_bcat(key, buf, n + 1);
+}
+
+int
+pkg_version_key(const char *version, struct sbuf *key)
+{
+	const char *v, *ve;
+	unsigned long epoch, revision;
+	version_component vc;
+	int64_t seg = 0, idx = 0;
+	int sign;
+
+	assert(key != NULL);
+
+	if ((v = split_version(version, &ve, &epoch, &revision)) == NULL)
+		return (EPKG_FATAL);
+
+	vkey_uint(key, epoch);
+
+	while (v < ve) {
+		if (*v == '+') {
+			/* next segment */
+			v++;
+			seg++;
+			idx = 0;
+			continue;
+		}
+		v = get_component(v, &vc);
+		assert(v != NULL);
+
+		if (vc.n != 0)
+			sign = vc.n < 0 ? -1 : 1;
+		else if (vc.a != 0)
+			sign = vc.a < 0 ? -1 : 1;
+		else
+			sign = vc.pl < 0 ? -1 : (vc.pl > 0);
+
+		if (sign < 0) {
+			sbuf_putc(key, VKEY_NEG);
+			vkey_int(key, seg);
+			vkey_int(key, idx);
+		} else if (sign > 0) {
+			sbuf_putc(key, VKEY_POS);
+			vkey_int(key, -seg);
+			vkey_int(key, -idx);
+		}
+		if (sign != 0) {
+			vkey_int(key, vc.n);
+			vkey_int(key, vc.a);
+			vkey_int(key, vc.pl);
+		}
+		idx++;
+	}
+
+	sbuf_putc(key, VKEY_END);
+	vkey_uint(key, revision);
+
+	return (EPKG_OK);
+}
+
+/*
+ * pkg_version_keycmp(k1, len1, k2, len2) compares two keys built by
+ * pkg_version_key() and returns -1, 0 or 1 like pkg_version_cmp().
+ */
+int
+pkg_version_keycmp(const void *k1, size_t len1, const void *k2, size_t len2)
+{
+	int	 ret;
+
+	ret = memcmp(k1, k2, len1 < len2 ? len1 : len2);
+	if (ret == 0)
+		ret = (len1 > len2) - (len1 < len2);
+
+	return (ret < 0 ? -1 : ret > 0);
+}
@@ -32,10 +32,14 @@
  */
 
 #include <sys/param.h>
+#include <sys/file.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <regex.h>
 #include <grp.h>
 #include <libutil.h>
@@ -71,7 +75,7 @@
 */
 
 #define DB_SCHEMA_MAJOR	0
-#define DB_SCHEMA_MINOR	18
+#define DB_SCHEMA_MINOR	21
 
 #define DBVERSION (DB_SCHEMA_MAJOR * 1000 + DB_SCHEMA_MINOR)
 
@@ -85,10 +89,15 @@ static void pkgdb_pkglt(sqlite3_context *, int, sqlite3_value **);
 static void pkgdb_pkggt(sqlite3_context *, int, sqlite3_value **);
 static void pkgdb_pkgle(sqlite3_context *, int, sqlite3_value **);
 static void pkgdb_pkgge(sqlite3_context *, int, sqlite3_value **);
+static void pkgdb_fts_rank(sqlite3_context *, int, sqlite3_value **);
 static int pkgdb_upgrade(struct pkgdb *);
-static void populate_pkg(sqlite3_stmt *stmt, struct pkg *pkg);
+static int populate_pkg(struct pkgdb_it *it, struct pkg *pkg);
 static void pkgdb_detach_remotes(sqlite3 *);
+static void pkgdb_setup_journal(struct pkgdb *);
 static bool is_attached(sqlite3 *, const char *);
+static int pkgdb_attach_repo(struct pkgdb *, struct pkg_repo *);
+static int pkgdb_attach_repos(struct pkgdb *);
+static bool pkgdb_catalog_usable(struct pkgdb *);
 static int sqlcmd_init(sqlite3 *db, __unused const char **err,
     __unused const void *noused);
 static int prstmt_initialize(struct pkgdb *db);
@@ -100,6 +109,9 @@ extern int sqlite3_shell(int, char**);
 /*
  * Keep entries sorted by name!
  */
+/* the vkey column is not an attribute, see pkg_set_vkey() */
+#define COLUMN_VKEY	(-2)
+
 static struct column_mapping {
 	const char * const name;
 	pkg_attr type;
@@ -128,6 +140,7 @@ static struct column_mapping {
 	{ "rowid",	PKG_ROWID },
 	{ "time",	PKG_TIME },
 	{ "version",	PKG_VERSION },
+	{ "vkey",	COLUMN_VKEY },
 	{ "weight",	-1 },
 	{ "www",	PKG_WWW },
 	{ NULL,		-1 }
@@ -216,13 +229,15 @@ pkgdb_get_reponame(struct pkgdb *db, const char *repo)
 
 	if (repo != NULL) {
 		r = pkg_repo_find_ident(repo);
-		reponame = pkg_repo_name(r);
 
-		if (!is_attached(db->sqlite, reponame)) {
+		if (r == NULL || !pkg_repo_enabled(r) ||
+		    pkgdb_attach_repo(db, r) != EPKG_OK) {
 			pkg_emit_error("repository '%s' does not exist", repo);
 			return (NULL);
 		}
-	}
+		reponame = pkg_repo_name(r);
+	} else
+		pkgdb_attach_repos(db);
 
 	return (reponame);
 }
@@ -237,51 +252,81 @@ compare_column_func(const void *pkey, const void *pcolumn)
 	return strcmp(key, column->name);
 }
 
-static void
-populate_pkg(sqlite3_stmt *stmt, struct pkg *pkg) {
-	int		 icol = 0;
-	const char	*colname;
+/*
+ * Resolve the result columns of the iterator's statement to package
+ * attributes once, so that rows can be populated without name lookups.
+ * Unknown columns are reported here and ignored afterwards.
+ */
+static int
+pkgdb_it_colmap(struct pkgdb_it *it)
+{
+	struct column_mapping	*column;
+	const char		*colname;
+	int			 icol;
+
+	it->ncols = sqlite3_column_count(it->stmt);
+	if ((it->colmap = calloc(it->ncols + 1, sizeof(int))) == NULL) {
+		pkg_emit_errno("calloc", "pkgdb_it colmap");
+		return (EPKG_FATAL);
+	}
+
+	for (icol = 0; icol < it->ncols; icol++) {
+		colname = sqlite3_column_name(it->stmt, icol);
+		column = bsearch(colname, columns,
+		    sizeof(columns) / sizeof(columns[0]) - 1,
+		    sizeof(columns[0]), compare_column_func);
+		if (column == NULL) {
+			pkg_emit_error("Unknown column %s", colname);
+			it->colmap[icol] = -1;
+		} else
+			it->colmap[icol] = column->type;
+	}
+
+	return (EPKG_OK);
+}
+
+static int
+populate_pkg(struct pkgdb_it *it, struct pkg *pkg) {
+	sqlite3_stmt	*stmt = it->stmt;
+	int		 icol, attr;
 
 	assert(stmt != NULL);
 
-	for (icol = 0; icol < sqlite3_column_count(stmt); icol++) {
-		colname = sqlite3_column_name(stmt, icol);
-		struct column_mapping *column;
+	if (it->colmap == NULL && pkgdb_it_colmap(it) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	for (icol = 0; icol < it->ncols; icol++) {
+		attr = it->colmap[icol];
+		if (attr == COLUMN_VKEY &&
+		    sqlite3_column_type(stmt, icol) == SQLITE_BLOB) {
+			pkg_set_vkey(pkg, sqlite3_column_blob(stmt, icol),
+			    sqlite3_column_bytes(stmt, icol));
+			continue;
+		}
+		if (attr < 0)
+			continue;
 		switch (sqlite3_column_type(stmt, icol)) {
 		case SQLITE_TEXT:
-			column = bsearch(colname, columns,
-					sizeof(columns) / sizeof(columns[0]) - 1,
-					sizeof(columns[0]), compare_column_func);
-			if (column == NULL)
-				pkg_emit_error("Unknown column %s",
-				    colname);
-			else
-				pkg_set(pkg, column->type,
-						sqlite3_column_text(stmt,
-						icol));
-			break;
 		case SQLITE_INTEGER:
-			column = bsearch(colname, columns,
-					sizeof(columns) / sizeof(columns[0]) - 1,
-					sizeof(columns[0]), compare_column_func);
-			if (column == NULL)
-				pkg_emit_error("Unknown column %s",
-						colname);
+			if (attr < PKG_NUM_FIELDS)
+				pkg_set_s(pkg, attr, (const char *)
+				    sqlite3_column_text(stmt, icol));
 			else
-				pkg_set(pkg, column->type,
-						sqlite3_column_int64(stmt,
-						icol));
+				pkg_set_i(pkg, attr,
+				    sqlite3_column_int64(stmt, icol));
 			break;
 		case SQLITE_BLOB:
 		case SQLITE_FLOAT:
 			pkg_emit_error("Wrong type for column: %s",
-			    colname);
+			    sqlite3_column_name(stmt, icol));
 			/* just ignore currently */
 			break;
 		case SQLITE_NULL:
 			break;
 		}
 	}
+
+	return (EPKG_OK);
 }
 
 static void
@@ -435,6 +480,132 @@ pkgdb_pkgge(sqlite3_context * ctx, int argc, sqlite3_value **argv)
 	pkgdb_pkgcmp(ctx, argc, argv, PKGGT|PKGEQ);
 }
 
+static void
+pkgdb_vercmp(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const unsigned char	*version1 = NULL;
+	const unsigned char	*version2 = NULL;
+
+	if (argc != 2 || (version1 = sqlite3_value_text(argv[0])) == NULL
+		      || (version2 = sqlite3_value_text(argv[1])) == NULL) {
+		sqlite3_result_error(ctx, "Invalid comparison\n", -1);
+		return;
+	}
+
+	sqlite3_result_int(ctx, pkg_version_cmp(version1, version2));
+}
+
+/*
+ * version_key(version) returns the key of pkg_version_key() as a BLOB, so
+ * that versions stored alongside their key can be sorted and compared by
+ * SQLite, and through an index, without calling back into pkg.
+ */
+static void
+pkgdb_version_key(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const unsigned char	*version = NULL;
+	struct sbuf		*key;
+
+	if (argc != 1) {
+		sqlite3_result_error(ctx, "Invalid usage of version_key\n", -1);
+		return;
+	}
+
+	if ((version = sqlite3_value_text(argv[0])) == NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+
+	key = sbuf_new_auto();
+	pkg_version_key(version, key);
+	sbuf_finish(key);
+	sqlite3_result_blob(ctx, sbuf_data(key), sbuf_len(key),
+	    SQLITE_TRANSIENT);
+	sbuf_delete(key);
+}
+
+/* COLLATE VERSION: sort text columns holding versions by version order */
+static int
+pkgdb_version_collate(__unused void *arg, int len1, const void *s1,
+    int len2, const void *s2)
+{
+	char	*version1, *version2;
+	int	 ret;
+
+	version1 = strndup(s1, len1);
+	version2 = strndup(s2, len2);
+	if (version1 == NULL || version2 == NULL)
+		ret = 0;
+	else
+		ret = pkg_version_cmp(version1, version2);
+	free(version1);
+	free(version2);
+
+	return (ret);
+}
+
+/*
+ * Register the version functions: version_key(), vercmp() and the VERSION
+ * collation.  Also used on the connections to the repository catalogues
+ * which do not go through pkgdb_open().
+ */
+void
+pkgdb_version_sql_init(sqlite3 *s)
+{
+	sqlite3_create_function(s, "version_key", 1, SQLITE_ANY, NULL,
+	    pkgdb_version_key, NULL, NULL);
+	sqlite3_create_function(s, "vercmp", 2, SQLITE_ANY, NULL,
+	    pkgdb_vercmp, NULL, NULL);
+	sqlite3_create_collation(s, "VERSION", SQLITE_UTF8, NULL,
+	    pkgdb_version_collate);
+}
+
+/*
+ * Rank a full-text match from matchinfo(pkg_search, 'pcx'): for every
+ * phrase and column, the hits in this row relative to the hits in all
+ * rows, weighted so that matching the name counts more than matching
+ * the origin, the comment and then the description.
+ */
+static void
+pkgdb_fts_rank(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	static const double	 weights[] = { 8.0, 4.0, 2.0, 1.0 };
+	const unsigned int	*info;
+	const unsigned int	*hits;
+	unsigned int		 nphrase, ncol, i, j;
+	double			 score = 0.0, w;
+
+	if (argc != 1 || sqlite3_value_type(argv[0]) != SQLITE_BLOB ||
+	    sqlite3_value_bytes(argv[0]) < (int)(2 * sizeof(*info))) {
+		sqlite3_result_error(ctx, "SQL function fts_rank() called "
+		    "with invalid arguments.\n", -1);
+		return;
+	}
+
+	info = sqlite3_value_blob(argv[0]);
+	nphrase = info[0];
+	ncol = info[1];
+	if ((size_t)sqlite3_value_bytes(argv[0]) <
+	    (2 + 3 * (size_t)nphrase * ncol) * sizeof(*info)) {
+		sqlite3_result_error(ctx, "SQL function fts_rank() called "
+		    "with invalid arguments.\n", -1);
+		return;
+	}
+
+	for (i = 0; i < nphrase; i++) {
+		for (j = 0; j < ncol; j++) {
+			hits = &info[2 + 3 * (i * ncol + j)];
+			if (hits[0] == 0)
+				continue;
+			w = j < sizeof(weights) / sizeof(weights[0]) ?
+			    weights[j] : 1.0;
+			score += w * hits[0] / hits[1];
+		}
+	}
+
+	sqlite3_result_double(ctx, score);
+}
+
 static int
 pkgdb_upgrade(struct pkgdb *db)
 {
@@ -557,7 +728,8 @@ pkgdb_init(sqlite3 *sdb)
 		"infos TEXT, "
 		"time INTEGER, "
 		"manifestdigest TEXT NULL, "
-		"pkg_format_version INTEGER"
+		"pkg_format_version INTEGER, "
+		"vkey BLOB"
 	");"
 	"CREATE TABLE mtree ("
 		"id INTEGER PRIMARY KEY,"
@@ -588,9 +760,30 @@ pkgdb_init(sqlite3 *sdb)
 	"CREATE TABLE files ("
 		"path TEXT PRIMARY KEY,"
 		"sha256 TEXT,"
+		"stat TEXT,"
 		"package_id INTEGER REFERENCES packages(id) ON DELETE CASCADE"
 			" ON UPDATE CASCADE"
 	");"
+	/* basename of every file, maintained by triggers on files */
+	"CREATE TABLE file_names ("
+		"path TEXT PRIMARY KEY,"
+		"name TEXT NOT NULL"
+	");"
+	"CREATE TRIGGER file_names_insert AFTER INSERT ON files "
+	"FOR EACH ROW BEGIN "
+		"INSERT OR REPLACE INTO file_names (path, name) "
+		"VALUES (new.path, " FILE_BASENAME("new.path") "); "
+	"END;"
+	"CREATE TRIGGER file_names_update AFTER UPDATE OF path ON files "
+	"FOR EACH ROW BEGIN "
+		"DELETE FROM file_names WHERE path = old.path; "
+		"INSERT OR REPLACE INTO file_names (path, name) "
+		"VALUES (new.path, " FILE_BASENAME("new.path") "); "
+	"END;"
+	"CREATE TRIGGER file_names_delete AFTER DELETE ON files "
+	"FOR EACH ROW BEGIN "
+		"DELETE FROM file_names WHERE path = old.path; "
+	"END;"
 	"CREATE TABLE directories ("
 		"id INTEGER PRIMARY KEY,"
 		"path TEXT NOT NULL UNIQUE"
@@ -696,6 +889,7 @@ pkgdb_init(sqlite3 *sdb)
 	"CREATE INDEX pkg_directories_directory_id ON pkg_directories (directory_id);"
 	"CREATE INDEX pkg_annotation_package_id ON pkg_annotation(package_id);"
 	"CREATE INDEX pkg_digest_id ON packages(origin, manifestdigest);"
+	"CREATE INDEX file_names_name ON file_names(name);"
 
 	"CREATE VIEW pkg_shlibs AS SELECT * FROM pkg_shlibs_required;"
 	"CREATE TRIGGER pkg_shlibs_update "
@@ -757,58 +951,293 @@ pkgdb_remote_init(struct pkgdb *db, const char *repo)
 	return (ret);
 }
 
+static bool
+pkgdb_repo_check_cached(struct pkg_repo *r, struct stat *st)
+{
+	return (r->checked && r->check_dev == st->st_dev &&
+	    r->check_ino == st->st_ino && r->check_mtime == st->st_mtime &&
+	    r->check_size == st->st_size);
+}
+
+/*
+ * The schema checks that passed are also recorded in PKG_DBDIR/repos.checked,
+ * one "name, dev, ino, mtime, size" line per catalogue, so that they are not
+ * done again by every invocation.  Only the processes that can write to
+ * PKG_DBDIR update it, the others just read it.
+ */
+static void
+pkgdb_repo_checks_load(const char *dbdir)
+{
+	static bool	 loaded = false;
+	struct pkg_repo	*r;
+	FILE		*fp;
+	char		 path[MAXPATHLEN + 1];
+	char		 line[BUFSIZ], name[MAXPATHLEN + 1];
+	uintmax_t	 dev, ino;
+	intmax_t	 mtime, size;
+
+	if (loaded)
+		return;
+	loaded = true;
+
+	snprintf(path, sizeof(path), "%s/repos.checked", dbdir);
+	if ((fp = fopen(path, "r")) == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%1024[^\t]\t%ju\t%ju\t%jd\t%jd", name,
+		    &dev, &ino, &mtime, &size) != 5)
+			continue;
+		if ((r = pkg_repo_find_name(name)) == NULL || r->checked)
+			continue;
+		r->checked = true;
+		r->check_result = EPKG_OK;
+		r->check_dev = dev;
+		r->check_ino = ino;
+		r->check_mtime = mtime;
+		r->check_size = size;
+	}
+
+	fclose(fp);
+}
+
+static void
+pkgdb_repo_checks_save(const char *dbdir)
+{
+	struct pkg_repo	*r = NULL;
+	FILE		*fp;
+	char		 path[MAXPATHLEN + 1], tmppath[MAXPATHLEN + 1];
+	int		 fd;
+
+	if (eaccess(dbdir, W_OK) != 0)
+		return;
+
+	snprintf(path, sizeof(path), "%s/repos.checked", dbdir);
+	snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmppath)) == -1)
+		return;
+	if (fchmod(fd, 0644) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmppath);
+		return;
+	}
+
+	while (pkg_repos(&r) == EPKG_OK) {
+		if (!r->checked || r->check_result != EPKG_OK)
+			continue;
+		fprintf(fp, "%s\t%ju\t%ju\t%jd\t%jd\n", pkg_repo_name(r),
+		    (uintmax_t)r->check_dev, (uintmax_t)r->check_ino,
+		    (intmax_t)r->check_mtime, (intmax_t)r->check_size);
+	}
+
+	if (ferror(fp) | (fclose(fp) != 0) || rename(tmppath, path) != 0)
+		unlink(tmppath);
+}
+
+/*
+ * Attach the catalogue of a repository the first time it is needed.  The
+ * outcome of the schema check is remembered in the repository, and the
+ * successful ones in repos.checked, as long as its catalogue file stays
+ * the same, so that reopening the database does not check it again.
+ */
 static int
-pkgdb_open_multirepos(const char *dbdir, struct pkgdb *db)
+pkgdb_attach_repo(struct pkgdb *db, struct pkg_repo *r)
 {
-	int		 ret;
+	const char	*dbdir = NULL;
 	char		 remotepath[MAXPATHLEN + 1];
+	struct stat	 st;
+	bool		 cached;
+	int		 ret;
+
+	if (is_attached(db->sqlite, pkg_repo_name(r)))
+		return (EPKG_OK);
+
+	/* the merged catalogue is attached under that name */
+	if (strcmp(pkg_repo_name(r), "catalog") == 0) {
+		pkg_emit_error("repository name 'catalog' is reserved, "
+		    "ignoring it");
+		return (EPKG_ENODB);
+	}
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	snprintf(remotepath, sizeof(remotepath), "%s/%s.sqlite",
+		 dbdir, pkg_repo_name(r));
+
+	pkgdb_repo_checks_load(dbdir);
+
+	if (access(remotepath, R_OK) != 0 || stat(remotepath, &st) != 0) {
+		pkg_emit_noremotedb(pkg_repo_ident(r));
+		return (EPKG_ENODB);
+	}
+
+	cached = pkgdb_repo_check_cached(r, &st);
+	if (cached && r->check_result != EPKG_OK)
+		return (r->check_result);
+
+	ret = sql_exec(db->sqlite, "ATTACH '%s' AS '%s';",
+	          remotepath, pkg_repo_name(r));
+	if (ret != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (cached)
+		return (EPKG_OK);
+
+	ret = pkgdb_repo_check_version(db, pkg_repo_name(r));
+	if (ret != EPKG_OK) {
+		sql_exec(db->sqlite, "DETACH DATABASE '%s'", pkg_repo_name(r));
+		if (ret != EPKG_REPOSCHEMA)
+			return (EPKG_FATAL);
+	}
+
+	/* the check may have upgraded the schema: look at the file again */
+	if (stat(remotepath, &st) == 0) {
+		r->checked = true;
+		r->check_result = ret;
+		r->check_dev = st.st_dev;
+		r->check_ino = st.st_ino;
+		r->check_mtime = st.st_mtime;
+		r->check_size = st.st_size;
+		if (ret == EPKG_OK)
+			pkgdb_repo_checks_save(dbdir);
+	}
+
+	return (ret);
+}
+
+static int
+pkgdb_attach_repos(struct pkgdb *db)
+{
 	struct pkg_repo	 *r = NULL;
 
+	if (db->type != PKGDB_REMOTE || db->repos_attached)
+		return (EPKG_OK);
+
 	while (pkg_repos(&r) == EPKG_OK) {
 		if (!pkg_repo_enabled(r))
 			continue;
 
-		/* is it already attached? */
-		if (is_attached(db->sqlite, pkg_repo_name(r))) {
-			pkg_emit_error("repository '%s' is already "
-			    "listed, ignoring", pkg_repo_ident(r));
-			continue;
-		}
+		if (pkgdb_attach_repo(db, r) == EPKG_FATAL)
+			return (EPKG_FATAL);
+	}
 
-		snprintf(remotepath, sizeof(remotepath), "%s/%s.sqlite",
-			 dbdir, pkg_repo_name(r));
+	db->repos_attached = true;
 
-		if (access(remotepath, R_OK) != 0) {
-			pkg_emit_noremotedb(pkg_repo_ident(r));
-			pkgdb_close(db);
-			return (EPKG_ENODB);
-		}
+	return (EPKG_OK);
+}
 
-		ret = sql_exec(db->sqlite, "ATTACH '%s' AS '%s';",
-		          remotepath, pkg_repo_name(r));
-		if (ret != EPKG_OK) {
-			pkgdb_close(db);
-			return (EPKG_FATAL);
-		}
+/*
+ * Switch the journal mode of a writable database to the configured one.
+ */
+static void
+pkgdb_setup_wal(struct pkgdb *db)
+{
+	char	*mode = NULL;
+	bool	 wal = false;
+	int	 persist = 1;
 
-		switch (pkgdb_repo_check_version(db, pkg_repo_name(r))) {
-		case EPKG_FATAL:
-			pkgdb_close(db);
-			return (EPKG_FATAL);
-			break;
-		case EPKG_REPOSCHEMA:
-			ret = sql_exec(db->sqlite, "DETACH DATABASE '%s'",
-				  pkg_repo_name(r));
-			if (ret != EPKG_OK) {
-				pkgdb_close(db);
-				return (EPKG_FATAL);
-			}
-			break;
-		default:
-			break;
-		}
+	pkg_config_bool(PKG_CONFIG_DB_WAL, &wal);
+
+	/*
+	 * When disabled, a database left in WAL mode is converted back to a
+	 * rollback journal, so that readers linked against an older sqlite
+	 * can open it again.  This only fails if another process still
+	 * holds the database open in WAL mode.
+	 */
+	if (wal != db->wal) {
+		if (get_sql_string(db->sqlite, wal ?
+		    "PRAGMA main.journal_mode=WAL;" :
+		    "PRAGMA main.journal_mode=DELETE;", &mode) == EPKG_OK)
+			db->wal = (mode != NULL && strcmp(mode, "wal") == 0);
+		free(mode);
+
+		if (wal && !db->wal)
+			pkg_emit_error("unable to switch the local database to "
+			    "WAL mode, keeping the rollback journal");
 	}
-	return (EPKG_OK);
+
+	if (!db->wal)
+		return;
+
+	/*
+	 * Keep the -wal and -shm files when the last connection closes:
+	 * readers that cannot write to PKG_DBDIR could not create them
+	 * again, see pkgdb_sqlite_open().
+	 */
+	sqlite3_file_control(db->sqlite, "main", SQLITE_FCNTL_PERSIST_WAL,
+	    &persist);
+}
+
+/*
+ * The journal mode is stored in the database file itself, so it has to
+ * be switched outside of any transaction, once the schema is up to date.
+ * Failing to change it is not fatal: db->wal always follows the mode that
+ * is actually in effect.
+ */
+static void
+pkgdb_setup_journal(struct pkgdb *db)
+{
+	char	*mode = NULL;
+
+	if (get_sql_string(db->sqlite, "PRAGMA main.journal_mode;",
+	    &mode) != EPKG_OK)
+		return;
+	db->wal = (mode != NULL && strcmp(mode, "wal") == 0);
+	free(mode);
+
+	/* only a writer may change the journal mode */
+	if (!sqlite3_db_readonly(db->sqlite, "main"))
+		pkgdb_setup_wal(db);
+
+	if (!db->wal)
+		return;
+
+	/*
+	 * With WAL, synchronous=NORMAL only syncs at checkpoints and stays
+	 * consistent on crash.  Give every connection, read-only ones
+	 * included, an 8MB page cache.
+	 */
+	sql_exec(db->sqlite,
+	    "PRAGMA main.synchronous=NORMAL;"
+	    "PRAGMA main.cache_size=-8192;");
+#if SQLITE_VERSION_NUMBER >= 3007017
+	/* map up to 64MB of the database instead of read(2)ing it */
+	sql_exec(db->sqlite, "PRAGMA main.mmap_size=67108864;");
+#endif
+}
+
+/*
+ * A database we cannot write to is opened read-only, mapping the -shm
+ * file of a WAL database read-only as well: sqlite otherwise opens it for
+ * writing, which fails for unprivileged readers.
+ */
+static int
+pkgdb_sqlite_open(const char *path, sqlite3 **sqlite)
+{
+	struct sbuf	*uri;
+	const char	*p;
+	int		 ret;
+
+	if (eaccess(path, W_OK) == 0 || errno == ENOENT)
+		return (sqlite3_open(path, sqlite));
+
+	uri = sbuf_new_auto();
+	sbuf_cat(uri, "file:");
+	for (p = path; *p != '\0'; p++) {
+		if (*p == '?' || *p == '#' || *p == '%')
+			sbuf_printf(uri, "%%%02X", (unsigned char)*p);
+		else
+			sbuf_putc(uri, *p);
+	}
+	sbuf_cat(uri, "?readonly_shm=1");
+	sbuf_finish(uri);
+
+	ret = sqlite3_open_v2(sbuf_data(uri), sqlite,
+	    SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL);
+	sbuf_delete(uri);
+
+	return (ret);
 }
 
 static int
@@ -1031,8 +1460,13 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 	db->type = type;
 	db->lock_count = 0;
 	db->prstmt_initialized = false;
+	db->repos_attached = false;
+	db->catalog = 0;
 
 	if (!reopen) {
+		db->lock_fd = -1;
+		db->wal = false;
+
 		snprintf(localpath, sizeof(localpath), "%s/local.sqlite", dbdir);
 
 		if (eaccess(localpath, R_OK) != 0) {
@@ -1072,7 +1506,7 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 				sqlite3_vfs_register(sqlite3_vfs_find("unix-dotfile"), 1);
 		}
 
-		if (sqlite3_open(localpath, &db->sqlite) != SQLITE_OK) {
+		if (pkgdb_sqlite_open(localpath, &db->sqlite) != SQLITE_OK) {
 			ERROR_SQLITE(db->sqlite);
 			pkgdb_close(db);
 			return (EPKG_FATAL);
@@ -1104,11 +1538,11 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 			pkgdb_close(db);
 			return (EPKG_FATAL);
 		}
-	}
 
-	if (type == PKGDB_REMOTE)
-		pkgdb_open_multirepos(dbdir, db);
+		pkgdb_setup_journal(db);
+	}
 
+	/* repositories are attached on first use, see pkgdb_attach_repo() */
 	*db_p = db;
 	return (EPKG_OK);
 }
@@ -1131,6 +1565,9 @@ pkgdb_close(struct pkgdb *db)
 		sqlite3_close(db->sqlite);
 	}
 
+	if (db->lock_fd != -1)
+		close(db->lock_fd);
+
 	sqlite3_shutdown();
 	free(db);
 }
@@ -1269,6 +1706,8 @@ pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type, short flags)
 	it->db = db;
 	it->sqlite = db->sqlite;
 	it->stmt = s;
+	it->colmap = NULL;
+	it->ncols = 0;
 	it->type = type;
 	it->flags = flags;
 	it->finished = 0;
@@ -1318,7 +1757,8 @@ pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, unsigned flags)
 			pkg_reset(*pkg_p, it->type);
 		pkg = *pkg_p;
 
-		populate_pkg(it->stmt, pkg);
+		if ((ret = populate_pkg(it, pkg)) != EPKG_OK)
+			return (ret);
 
 		for (i = 0; load_on_flag[i].load != NULL; i++) {
 			if (flags & load_on_flag[i].flag) {
@@ -1360,6 +1800,7 @@ pkgdb_it_free(struct pkgdb_it *it)
 		return;
 
 	sqlite3_finalize(it->stmt);
+	free(it->colmap);
 	free(it);
 }
 
@@ -1426,6 +1867,10 @@ pkgdb_get_pattern_query(const char *pattern, match_t match)
 	case MATCH_CONDITION:
 		comp = pattern;
 		break;
+	case MATCH_FTS:
+		/* Only supported by pkgdb_search() */
+		assert(0);
+		break;
 	}
 
 	return (comp);
@@ -1453,6 +1898,7 @@ pkgdb_get_match_how(match_t match)
 		how = "%s REGEXP ?1";
 		break;
 	case MATCH_CONDITION:
+	case MATCH_FTS:
 		/* Should not be called by pkgdb_get_match_how(). */
 		assert(0);
 		break;
@@ -1461,10 +1907,89 @@ pkgdb_get_match_how(match_t match)
 	return (how);
 }
 
+/*
+ * Columns of the packages tables, in the order they are selected.  The
+ * columns with no attribute are always selected: the relations are
+ * loaded through them.
+ */
+struct field_column {
+	pkg_attr	 attr;
+	const char	*column;
+};
+
+static const struct field_column local_fields[] = {
+	{ 0,			"id" },
+	{ 0,			"origin" },
+	{ 0,			"name" },
+	{ PKG_VERSION,		"version" },
+	{ PKG_VERSION,		"vkey" },
+	{ PKG_COMMENT,		"comment" },
+	{ PKG_DESC,		"desc" },
+	{ PKG_MESSAGE,		"message" },
+	{ PKG_ARCH,		"arch" },
+	{ PKG_MAINTAINER,	"maintainer" },
+	{ PKG_WWW,		"www" },
+	{ PKG_PREFIX,		"prefix" },
+	{ PKG_FLATSIZE,		"flatsize" },
+	{ PKG_LICENSE_LOGIC,	"licenselogic" },
+	{ PKG_AUTOMATIC,	"automatic" },
+	{ PKG_LOCKED,		"locked" },
+	{ PKG_TIME,		"time" },
+	{ PKG_INFOS,		"infos" },
+	{ 0,			NULL }
+};
+
+static const struct field_column remote_fields[] = {
+	{ 0,			"id" },
+	{ 0,			"origin" },
+	{ 0,			"name" },
+	{ PKG_VERSION,		"version" },
+	{ PKG_VERSION,		"vkey" },
+	{ PKG_COMMENT,		"comment" },
+	{ PKG_PREFIX,		"prefix" },
+	{ PKG_DESC,		"desc" },
+	{ PKG_ARCH,		"arch" },
+	{ PKG_MAINTAINER,	"maintainer" },
+	{ PKG_WWW,		"www" },
+	{ PKG_LICENSE_LOGIC,	"licenselogic" },
+	{ PKG_FLATSIZE,		"flatsize" },
+	{ PKG_PKGSIZE,		"pkgsize" },
+	{ PKG_CKSUM,		"cksum" },
+	{ PKG_REPOPATH,		"path AS repopath" },
+	{ 0,			"'%1$s' AS dbname" },
+	{ 0,			NULL }
+};
+
+static void
+pkgdb_select_fields(struct sbuf *sql, const struct field_column *cols,
+    uint64_t fields)
+{
+	int i;
+	bool first = true;
+
+	for (i = 0; cols[i].column != NULL; i++) {
+		if (cols[i].attr != 0 &&
+		    (fields & PKG_FIELD(cols[i].attr)) == 0)
+			continue;
+		if (!first)
+			sbuf_cat(sql, ", ");
+		sbuf_cat(sql, cols[i].column);
+		first = false;
+	}
+}
+
 struct pkgdb_it *
 pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
+{
+	return (pkgdb_query_fields(db, pattern, match, PKG_FIELDS_ALL));
+}
+
+struct pkgdb_it *
+pkgdb_query_fields(struct pkgdb *db, const char *pattern, match_t match,
+    uint64_t fields)
 {
 	char		 sql[BUFSIZ];
+	struct sbuf	*select;
 	sqlite3_stmt	*stmt;
 	const char	*comp = NULL;
 
@@ -1473,13 +1998,15 @@ pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
 
 	comp = pkgdb_get_pattern_query(pattern, match);
 
+	select = sbuf_new_auto();
+	pkgdb_select_fields(select, local_fields, fields);
+	sbuf_finish(select);
+
 	sqlite3_snprintf(sizeof(sql), sql,
-			"SELECT id, origin, name, version, comment, desc, "
-				"message, arch, maintainer, www, "
-				"prefix, flatsize, licenselogic, automatic, "
-				"locked, time, infos "
+			"SELECT %s "
 			"FROM packages AS p%s "
-			"ORDER BY p.name;", comp);
+			"ORDER BY p.name;", sbuf_data(select), comp);
+	sbuf_delete(select);
 
 	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
 		ERROR_SQLITE(db->sqlite);
@@ -1492,28 +2019,86 @@ pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
 	return (pkgdb_it_new(db, stmt, PKG_INSTALLED, PKGDB_IT_FLAG_ONCE));
 }
 
+/*
+ * Compute the half-open range [lower, upper) covering every string that
+ * starts with the literal prefix of a glob pattern, so that the glob can
+ * be answered by an index range seek instead of a full scan.
+ * Returns false if the pattern has no usable literal prefix.
+ */
+static bool
+glob_prefix_range(const char *pattern, char **lower, char **upper)
+{
+	size_t	 len;
+
+	len = strcspn(pattern, "*?[");
+	if (len == 0 || (unsigned char)pattern[len - 1] == 0xff)
+		return (false);
+
+	*lower = strndup(pattern, len);
+	*upper = strndup(pattern, len);
+	if (*lower == NULL || *upper == NULL) {
+		free(*lower);
+		free(*upper);
+		return (false);
+	}
+	(*upper)[len - 1]++;
+
+	return (true);
+}
+
 struct pkgdb_it *
 pkgdb_query_which(struct pkgdb *db, const char *path, bool glob)
 {
 	sqlite3_stmt	*stmt;
 	char	sql[BUFSIZ];
-
+	char	*lower = NULL, *upper = NULL;
+	const char	*cond;
+	bool	 basename;
 
 	assert(db != NULL);
+
+	/*
+	 * The literal prefix of a glob bounds a range seek: on the basename
+	 * index for a glob without any slash, which could never match a full
+	 * path, on the files primary key otherwise.  A glob starting with a
+	 * wildcard is matched against the full path, as it always was.
+	 */
+	basename = false;
+	if (glob && glob_prefix_range(path, &lower, &upper)) {
+		basename = strchr(path, '/') == NULL;
+		cond = basename ?
+		    "n.name >= ?2 AND n.name < ?3 AND n.name GLOB ?1" :
+		    "f.path >= ?2 AND f.path < ?3 AND f.path GLOB ?1";
+	} else if (glob)
+		cond = "f.path GLOB ?1";
+	else
+		cond = "f.path = ?1";
+
 	sqlite3_snprintf(sizeof(sql), sql,
 			"SELECT p.id, p.origin, p.name, p.version, p.comment, p.desc, "
 			"p.message, p.arch, p.maintainer, p.www, "
 			"p.prefix, p.flatsize, p.time, p.infos "
 			"FROM packages AS p "
-			"LEFT JOIN files AS f ON p.id = f.package_id "
-			"WHERE f.path %s ?1 GROUP BY p.id;", glob ? "GLOB" : "=");
+			"JOIN files AS f ON p.id = f.package_id "
+			"%s"
+			"WHERE %s GROUP BY p.id;",
+			basename ? "JOIN file_names AS n ON n.path = f.path " : "",
+			cond);
 
 	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
 		ERROR_SQLITE(db->sqlite);
+		free(lower);
+		free(upper);
 		return (NULL);
 	}
 
 	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
+	if (lower != NULL) {
+		sqlite3_bind_text(stmt, 2, lower, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(stmt, 3, upper, -1, SQLITE_TRANSIENT);
+	}
+	free(lower);
+	free(upper);
 
 	return (pkgdb_it_new(db, stmt, PKG_INSTALLED, PKGDB_IT_FLAG_ONCE));
 }
@@ -1719,9 +2304,11 @@ int
 pkgdb_load_files(struct pkgdb *db, struct pkg *pkg)
 {
 	sqlite3_stmt	*stmt = NULL;
+	struct pkg_file	*f;
+	const char	*path, *key;
 	int		 ret;
 	const char	 sql[] = ""
-		"SELECT path, sha256 "
+		"SELECT path, sha256, stat "
 		"FROM files "
 		"WHERE package_id = ?1 "
 		"ORDER BY PATH ASC";
@@ -1740,8 +2327,13 @@ pkgdb_load_files(struct pkgdb *db, struct pkg *pkg)
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
 	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
-		pkg_addfile(pkg, sqlite3_column_text(stmt, 0),
-		    sqlite3_column_text(stmt, 1), false);
+		path = sqlite3_column_text(stmt, 0);
+		pkg_addfile(pkg, path, sqlite3_column_text(stmt, 1), false);
+		if ((key = sqlite3_column_text(stmt, 2)) != NULL) {
+			HASH_FIND_STR(pkg->files, __DECONST(char *, path), f);
+			if (f != NULL && !file_stat_parse(key, &f->meta))
+				memset(&f->meta, 0, sizeof(f->meta));
+		}
 	}
 	sqlite3_finalize(stmt);
 
@@ -2072,6 +2664,7 @@ typedef enum _sql_prstmt_index {
 	DEPS,
 	FILES,
 	FILES_REPLACE,
+	FILES_STAT,
 	DIRS1,
 	DIRS2,
 	CATEGORY1,
@@ -2106,9 +2699,10 @@ static sql_prstmt sql_prepared_statements[PRSTMT_LAST] = {
 		"INSERT OR REPLACE INTO packages( "
 			"origin, name, version, comment, desc, message, arch, "
 			"maintainer, www, prefix, flatsize, automatic, "
-			"licenselogic, mtree_id, infos, time) "
+			"licenselogic, mtree_id, infos, time, vkey) "
 		"VALUES( ?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, "
-		"?13, (SELECT id FROM mtree WHERE content = ?14), ?15, NOW())",
+		"?13, (SELECT id FROM mtree WHERE content = ?14), ?15, NOW(), "
+		"version_key(?3))",
 		"TTTTTTTTTTIIITT",
 	},
 	[DEPS_UPDATE] = {
@@ -2134,6 +2728,11 @@ static sql_prstmt sql_prepared_statements[PRSTMT_LAST] = {
 		"VALUES (?1, ?2, ?3)",
 		"TTI",
 	},
+	[FILES_STAT] = {
+		NULL,
+		"UPDATE files SET stat = ?1 WHERE path = ?2",
+		"TT",
+	},
 	[DIRS1] = {
 		NULL,
 		"INSERT OR IGNORE INTO directories(path) VALUES(?1)",
@@ -2911,6 +3510,8 @@ pkgdb_register_ports(struct pkgdb *db, struct pkg *pkg)
 	pkg_emit_install_begin(pkg);
 
 	ret = pkgdb_register_pkg(db, pkg, 0, 0);
+	if (ret == EPKG_OK)
+		ret = pkgdb_register_file_stats(db, pkg);
 	if (ret == EPKG_OK)
 		pkg_emit_install_finished(pkg);
 
@@ -3041,9 +3642,10 @@ is_attached(sqlite3 *s, const char *name)
 }
 
 static int
-sql_on_all_attached_db(sqlite3 *s, struct sbuf *sql, const char *multireposql,
-    const char *compound)
+sql_on_all_attached_db(struct pkgdb *db, struct sbuf *sql,
+    const char *multireposql, const char *compound)
 {
+	sqlite3		*s = db->sqlite;
 	sqlite3_stmt	*stmt;
 	const char	*dbname;
 	bool		 first = true;
@@ -3052,6 +3654,9 @@ sql_on_all_attached_db(sqlite3 *s, struct sbuf *sql, const char *multireposql,
 	assert(s != NULL);
 	assert(compound != NULL);
 
+	if (pkgdb_attach_repos(db) != EPKG_OK)
+		return (EPKG_FATAL);
+
 	ret = sqlite3_prepare_v2(s, "PRAGMA database_list;", -1, &stmt, NULL);
 	if (ret != SQLITE_OK) {
 		ERROR_SQLITE(s);
@@ -3061,7 +3666,8 @@ sql_on_all_attached_db(sqlite3 *s, struct sbuf *sql, const char *multireposql,
 	while (sqlite3_step(stmt) != SQLITE_DONE) {
 		dbname = sqlite3_column_text(stmt, 1);
 		if ((strcmp(dbname, "main") == 0) ||
-		    (strcmp(dbname, "temp") == 0))
+		    (strcmp(dbname, "temp") == 0) ||
+		    (strcmp(dbname, "catalog") == 0))
 			continue;
 
 		if (!first) {
@@ -3079,6 +3685,178 @@ sql_on_all_attached_db(sqlite3 *s, struct sbuf *sql, const char *multireposql,
 	return (EPKG_OK);
 }
 
+/*
+ * The merged catalogue written by pkg update is only trusted if it
+ * describes exactly the enabled repositories, as they are on disk now.
+ */
+static bool
+pkgdb_catalog_usable(struct pkgdb *db)
+{
+	sqlite3_stmt	*stmt = NULL;
+	struct pkg_repo	*r = NULL;
+	struct stat	 st;
+	const char	*dbdir = NULL;
+	char		 path[MAXPATHLEN + 1];
+	int64_t		 res;
+	int64_t		 nrepos = 0;
+	bool		 usable = false;
+
+	if (db->type != PKGDB_REMOTE)
+		return (false);
+	if (db->catalog != 0)
+		return (db->catalog > 0);
+	db->catalog = -1;
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK)
+		return (false);
+
+	snprintf(path, sizeof(path), "%s/catalog.sqlite", dbdir);
+	if (access(path, R_OK) != 0)
+		return (false);
+
+	if (sql_exec(db->sqlite, "ATTACH '%s' AS catalog;", path) != EPKG_OK)
+		return (false);
+
+	if (get_pragma(db->sqlite, "PRAGMA catalog.user_version;", &res)
+	    != EPKG_OK || res != CATALOG_VERSION)
+		goto cleanup;
+
+	if (sqlite3_prepare_v2(db->sqlite, "SELECT dev, ino, mtime, size "
+	    "FROM catalog.repos WHERE name = ?1;", -1, &stmt, NULL)
+	    != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+
+	while (pkg_repos(&r) == EPKG_OK) {
+		if (!pkg_repo_enabled(r))
+			continue;
+		nrepos++;
+
+		snprintf(path, sizeof(path), "%s/%s.sqlite", dbdir,
+		    pkg_repo_name(r));
+		if (stat(path, &st) != 0)
+			goto cleanup;
+
+		sqlite3_reset(stmt);
+		sqlite3_bind_text(stmt, 1, pkg_repo_name(r), -1,
+		    SQLITE_STATIC);
+		if (sqlite3_step(stmt) != SQLITE_ROW ||
+		    sqlite3_column_int64(stmt, 0) != (int64_t)st.st_dev ||
+		    sqlite3_column_int64(stmt, 1) != (int64_t)st.st_ino ||
+		    sqlite3_column_int64(stmt, 2) != (int64_t)st.st_mtime ||
+		    sqlite3_column_int64(stmt, 3) != (int64_t)st.st_size)
+			goto cleanup;
+	}
+
+	if (get_pragma(db->sqlite, "SELECT COUNT(*) FROM catalog.repos;",
+	    &res) != EPKG_OK || res != nrepos)
+		goto cleanup;
+
+	usable = true;
+
+cleanup:
+	if (stmt != NULL)
+		sqlite3_finalize(stmt);
+	if (usable)
+		db->catalog = 1;
+	else
+		sql_exec(db->sqlite, "DETACH DATABASE catalog;");
+
+	return (usable);
+}
+
+/*
+ * Same as sql_on_all_attached_db(), but restricted to the repositories
+ * which have packages matching cond according to the catalogue.  Each
+ * branch only fetches the rows whose id the catalogue selected, so cond
+ * is evaluated once, on the catalogue indexes.
+ */
+static int
+sql_on_catalog(struct pkgdb *db, struct sbuf *sql, const char *multireposql,
+    const char *cond, const char *pattern, const char *compound)
+{
+	sqlite3_stmt	*stmt;
+	struct sbuf	*reposql;
+	struct pkg_repo	*r;
+	struct pkg_repo	**repos = NULL, **tmp;
+	const char	*name;
+	bool		 first = true;
+	int		 nrepos = 0, sz = 0;
+	int		 ret, i;
+
+	reposql = sbuf_new_auto();
+	sbuf_printf(reposql, "SELECT DISTINCT repo FROM ("
+	    "SELECT repo, origin, name, version, comment "
+	    "FROM catalog.packages)%s;", cond);
+	sbuf_finish(reposql);
+
+	ret = sqlite3_prepare_v2(db->sqlite, sbuf_data(reposql), -1, &stmt,
+	    NULL);
+	sbuf_delete(reposql);
+	if (ret != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		return (EPKG_FATAL);
+	}
+	if (pattern != NULL)
+		sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_TRANSIENT);
+
+	/* the repositories can't be attached while stmt is running */
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if ((r = pkg_repo_find_name(sqlite3_column_text(stmt, 0)))
+		    == NULL)
+			continue;
+		if (nrepos == sz) {
+			sz = sz == 0 ? 8 : sz * 2;
+			if ((tmp = realloc(repos, sz * sizeof(*repos))) ==
+			    NULL) {
+				pkg_emit_errno("realloc", "repos");
+				sqlite3_finalize(stmt);
+				free(repos);
+				return (EPKG_FATAL);
+			}
+			repos = tmp;
+		}
+		repos[nrepos++] = r;
+	}
+	sqlite3_finalize(stmt);
+
+	for (i = 0; i < nrepos; i++) {
+		if (pkgdb_attach_repo(db, repos[i]) != EPKG_OK)
+			continue;
+
+		if (!first)
+			sbuf_cat(sql, compound);
+		first = false;
+
+		name = pkg_repo_name(repos[i]);
+		sbuf_printf(sql, multireposql, name);
+		sbuf_printf(sql, " WHERE id IN (SELECT id FROM ("
+		    "SELECT id, origin, name, version, comment "
+		    "FROM catalog.packages WHERE repo = '%s')%s)", name, cond);
+	}
+	free(repos);
+
+	if (!first)
+		return (EPKG_OK);
+
+	/*
+	 * Nothing matches: the statement still has to be valid and return
+	 * the columns of the caller, so run it on one repository with a
+	 * condition that never holds.
+	 */
+	r = NULL;
+	while (pkg_repos(&r) == EPKG_OK) {
+		if (!pkg_repo_enabled(r) || pkgdb_attach_repo(db, r) != EPKG_OK)
+			continue;
+		sbuf_printf(sql, multireposql, pkg_repo_name(r));
+		sbuf_cat(sql, " WHERE 0");
+		return (EPKG_OK);
+	}
+
+	return (EPKG_FATAL);
+}
+
 static void
 pkgdb_detach_remotes(sqlite3 *s)
 {
@@ -3208,26 +3986,50 @@ pkgdb_compact(struct pkgdb *db)
 struct pkgdb_it *
 pkgdb_rquery(struct pkgdb *db, const char *pattern, match_t match,
     const char *repo)
+{
+	return (pkgdb_rquery_fields(db, pattern, match, repo,
+	    PKG_FIELDS_ALL));
+}
+
+struct pkgdb_it *
+pkgdb_rquery_fields(struct pkgdb *db, const char *pattern, match_t match,
+    const char *repo, uint64_t fields)
 {
 	sqlite3_stmt	*stmt = NULL;
 	struct sbuf	*sql = NULL;
 	const char	*reponame = NULL;
 	const char	*comp = NULL;
 	int		 ret;
-	char		 basesql[BUFSIZ] = ""
-		"SELECT id, origin, name, version, comment, "
-		"prefix, desc, arch, maintainer, www, "
-		"licenselogic, flatsize, pkgsize, "
-		"cksum, path AS repopath, '%1$s' AS dbname "
-		"FROM '%1$s'.packages p";
+	char		 basesql[BUFSIZ];
 
 	assert(db != NULL);
 	assert(match == MATCH_ALL || (pattern != NULL && pattern[0] != '\0'));
 
-	reponame = pkgdb_get_reponame(db, repo);
-
 	sql = sbuf_new_auto();
+	sbuf_cat(sql, "SELECT ");
+	pkgdb_select_fields(sql, remote_fields, fields);
+	sbuf_cat(sql, " FROM '%1$s'.packages p");
+	sbuf_finish(sql);
+	strlcpy(basesql, sbuf_data(sql), sizeof(basesql));
+	sbuf_clear(sql);
+
 	comp = pkgdb_get_pattern_query(pattern, match);
+
+	/*
+	 * Only look into the repositories holding a match if the merged
+	 * catalogue can tell which ones those are
+	 */
+	if (repo == NULL && match != MATCH_ALL && match != MATCH_CONDITION &&
+	    pkgdb_catalog_usable(db)) {
+		ret = sql_on_catalog(db, sql, basesql, comp, pattern,
+		    " UNION ALL ");
+		if (ret == EPKG_OK)
+			goto prepare;
+		sbuf_clear(sql);
+	}
+
+	reponame = pkgdb_get_reponame(db, repo);
+
 	if (comp && comp[0])
 		strlcat(basesql, comp, sizeof(basesql));
 
@@ -3238,7 +4040,7 @@ pkgdb_rquery(struct pkgdb *db, const char *pattern, match_t match,
 		/* duplicate the query via UNION for all the attached
 		 * databases */
 
-		ret = sql_on_all_attached_db(db->sqlite, sql,
+		ret = sql_on_all_attached_db(db, sql,
 		    basesql, " UNION ALL ");
 		if (ret != EPKG_OK) {
 			sbuf_delete(sql);
@@ -3247,7 +4049,86 @@ pkgdb_rquery(struct pkgdb *db, const char *pattern, match_t match,
 	} else
 		sbuf_printf(sql, basesql, reponame, reponame);
 
-	sbuf_cat(sql, " ORDER BY name;");
+prepare:
+	/* the newest version of a package across the repositories first */
+	if (fields & PKG_FIELD(PKG_VERSION))
+		sbuf_cat(sql, " ORDER BY name, vkey DESC;");
+	else
+		sbuf_cat(sql, " ORDER BY name;");
+	sbuf_finish(sql);
+
+	ret = sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL);
+	if (ret != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		sbuf_delete(sql);
+		return (NULL);
+	}
+
+	sbuf_delete(sql);
+
+	if (match != MATCH_ALL && match != MATCH_CONDITION)
+		sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_TRANSIENT);
+
+	return (pkgdb_it_new(db, stmt, PKG_REMOTE, PKGDB_IT_FLAG_ONCE));
+}
+
+struct pkgdb_it *
+pkgdb_rquery_installed(struct pkgdb *db, const char *pattern, match_t match,
+    const char *repo)
+{
+	sqlite3_stmt	*stmt = NULL;
+	struct sbuf	*sql = NULL;
+	const char	*reponame = NULL;
+	const char	*comp = NULL;
+	bool		 catalog;
+	int		 ret;
+
+	assert(db != NULL);
+	assert(match == MATCH_ALL || (pattern != NULL && pattern[0] != '\0'));
+
+	if (repo != NULL && (reponame = pkgdb_get_reponame(db, repo)) == NULL)
+		return (NULL);
+
+	comp = pkgdb_get_pattern_query(pattern, match);
+	catalog = pkgdb_catalog_usable(db);
+
+	sql = sbuf_new_auto();
+	sbuf_printf(sql, "SELECT r.id, l.origin, l.name, "
+	    "l.version AS oldversion, r.version, r.vkey, %s AS dbname "
+	    "FROM (SELECT origin, name, version FROM main.packages%s) AS l ",
+	    catalog ? "r.repo" : "r.dbname", comp);
+
+	if (catalog) {
+		/* the newest version of each origin, on the catalogue index */
+		sbuf_cat(sql, "LEFT JOIN catalog.packages AS r "
+		    "ON r.origin = l.origin AND r.vkey = "
+		    "(SELECT max(vkey) FROM catalog.packages "
+		    "WHERE origin = l.origin");
+		if (reponame != NULL)
+			sbuf_printf(sql, " AND repo = '%s') AND r.repo = '%s'",
+			    reponame, reponame);
+		else
+			sbuf_cat(sql, ")");
+		sbuf_cat(sql, " GROUP BY l.origin");
+	} else {
+		/* one row per origin, the one with the highest key */
+		const char multireposql[] = ""
+		    "SELECT id, origin, version, vkey, '%1$s' AS dbname "
+		    "FROM '%1$s'.packages "
+		    "WHERE origin IN (SELECT origin FROM main.packages)";
+
+		sbuf_cat(sql, "LEFT JOIN (SELECT id, origin, version, "
+		    "max(vkey) AS vkey, dbname FROM (");
+		if (reponame != NULL)
+			sbuf_printf(sql, multireposql, reponame);
+		else if (sql_on_all_attached_db(db, sql, multireposql,
+		    " UNION ALL ") != EPKG_OK) {
+			sbuf_delete(sql);
+			return (NULL);
+		}
+		sbuf_cat(sql, ") GROUP BY origin) AS r ON r.origin = l.origin");
+	}
+	sbuf_cat(sql, " ORDER BY l.name;");
 	sbuf_finish(sql);
 
 	ret = sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL);
@@ -3326,12 +4207,145 @@ pkgdb_search_build_search_query(struct sbuf *sql, match_t match,
 	return (EPKG_OK);
 }
 
+/*
+ * Full-text search through the pkg_search index of the repositories,
+ * best matches first.  Every word of the pattern must start a word of
+ * the searched field.  The index ignores case, so a case sensitive
+ * search also requires each word to appear as is in the field.
+ */
+static struct pkgdb_it *
+pkgdb_search_fts(struct pkgdb *db, const char *pattern, pkgdb_field field,
+    const char *reponame)
+{
+	sqlite3_stmt	*stmt = NULL;
+	struct sbuf	*sql = NULL;
+	struct sbuf	*ftssql = NULL;
+	struct sbuf	*query = NULL;
+	const char	*rname;
+	const char	*column, *text;
+	const char	*p, *word;
+	size_t		 len;
+	int		 ret;
+
+	for (p = pattern; *p != '\0'; p++) {
+		if (*p != ' ' && !(isascii(*p) && isalnum(*p))) {
+			pkg_emit_error("Full-text search patterns are made of "
+			    "letters, digits and spaces: %s", pattern);
+			return (NULL);
+		}
+	}
+
+	switch (field) {
+	case FIELD_NAME:
+	case FIELD_NAMEVER:
+		column = "name";
+		text = "p.name";
+		break;
+	case FIELD_ORIGIN:
+		column = "origin";
+		text = "p.origin";
+		break;
+	case FIELD_COMMENT:
+		column = "comment";
+		text = "p.comment";
+		break;
+	case FIELD_DESC:
+		column = "\"desc\"";
+		text = "p.desc";
+		break;
+	default:
+		column = "pkg_search";
+		text = "p.name || ' ' || p.origin || ' ' || p.comment || ' ' || "
+		    "p.desc";
+		break;
+	}
+
+	ftssql = sbuf_new_auto();
+	sbuf_printf(ftssql, ""
+	    "SELECT p.id, p.origin, p.name, p.version, p.comment, "
+	    "p.prefix, p.desc, p.arch, p.maintainer, p.www, "
+	    "p.licenselogic, p.flatsize, p.pkgsize, "
+	    "p.cksum, p.path, '%%1$s' AS dbname, "
+	    "fts_rank(matchinfo(s.pkg_search, 'pcx')) AS rank "
+	    "FROM '%%1$s'.pkg_search AS s "
+	    "JOIN '%%1$s'.packages AS p ON p.id = s.docid "
+	    "WHERE s.%s MATCH ?1", column);
+
+	/* "text edit" is queried as "text* edit*" */
+	query = sbuf_new_auto();
+	for (p = pattern; *p != '\0'; p += len) {
+		if (*p == ' ') {
+			len = 1;
+			continue;
+		}
+		word = p;
+		len = strcspn(word, " ");
+		sbuf_printf(query, "%s%.*s*", sbuf_len(query) > 0 ? " " : "",
+		    (int)len, word);
+		/* words are alphanumeric, hence safe within the SQL */
+		if (pkgdb_case_sensitive())
+			sbuf_printf(ftssql, " AND %s GLOB '*%.*s*'", text,
+			    (int)len, word);
+	}
+	sbuf_finish(query);
+	sbuf_finish(ftssql);
+
+	if (sbuf_len(query) == 0) {
+		pkg_emit_error("Empty full-text search pattern");
+		goto err;
+	}
+
+	sql = sbuf_new_auto();
+	sbuf_cat(sql, ""
+	    "SELECT id, origin, name, version, comment, "
+	    "prefix, desc, arch, maintainer, www, "
+	    "licenselogic, flatsize, pkgsize, "
+	    "cksum, path AS repopath, dbname FROM (");
+
+	if (reponame != NULL) {
+		if ((rname = pkgdb_get_reponame(db, reponame)) != NULL)
+			sbuf_printf(sql, sbuf_data(ftssql), rname);
+		else {
+			pkg_emit_error("Repository %s can't be loaded",
+					reponame);
+			goto err;
+		}
+	} else if (sql_on_all_attached_db(db, sql, sbuf_data(ftssql),
+	    " UNION ALL ") != EPKG_OK)
+		goto err;
+
+	sbuf_cat(sql, ") ORDER BY rank DESC, name;");
+	sbuf_finish(sql);
+
+	ret = sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL);
+	if (ret != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		goto err;
+	}
+
+	sbuf_delete(ftssql);
+	sbuf_delete(sql);
+
+	sqlite3_bind_text(stmt, 1, sbuf_data(query), -1, SQLITE_TRANSIENT);
+	sbuf_delete(query);
+
+	return (pkgdb_it_new(db, stmt, PKG_REMOTE, PKGDB_IT_FLAG_ONCE));
+
+err:
+	sbuf_delete(ftssql);
+	if (sql != NULL)
+		sbuf_delete(sql);
+	sbuf_delete(query);
+	return (NULL);
+}
+
 struct pkgdb_it *
 pkgdb_search(struct pkgdb *db, const char *pattern, match_t match,
     pkgdb_field field, pkgdb_field sort, const char *reponame)
 {
 	sqlite3_stmt	*stmt = NULL;
 	struct sbuf	*sql = NULL;
+	struct sbuf	*cond = NULL;
 	int		 ret;
 	const char	*rname;
 	const char	*basesql = ""
@@ -3350,6 +4364,9 @@ pkgdb_search(struct pkgdb *db, const char *pattern, match_t match,
 	assert(pattern != NULL && pattern[0] != '\0');
 	assert(db->type == PKGDB_REMOTE);
 
+	if (match == MATCH_FTS)
+		return (pkgdb_search_fts(db, pattern, field, reponame));
+
 	sql = sbuf_new_auto();
 	sbuf_cat(sql, basesql);
 
@@ -3365,9 +4382,22 @@ pkgdb_search(struct pkgdb *db, const char *pattern, match_t match,
 			sbuf_delete(sql);
 			return (NULL);
 		}
+	} else if (field != FIELD_DESC && pkgdb_catalog_usable(db)) {
+		/* only the repositories with a match, see sql_on_catalog() */
+		cond = sbuf_new_auto();
+		sbuf_cat(cond, " WHERE ");
+		pkgdb_search_build_search_query(cond, match, field, FIELD_NONE);
+		sbuf_finish(cond);
+		ret = sql_on_catalog(db, sql, multireposql, sbuf_data(cond),
+		    pattern, " UNION ALL ");
+		sbuf_delete(cond);
+		if (ret != EPKG_OK) {
+			sbuf_delete(sql);
+			return (NULL);
+		}
 	} else {
 		/* test on all the attached databases */
-		if (sql_on_all_attached_db(db->sqlite, sql,
+		if (sql_on_all_attached_db(db, sql,
 		    multireposql, " UNION ALL ") != EPKG_OK) {
 			sbuf_delete(sql);
 			return (NULL);
@@ -3694,15 +4724,39 @@ pkgdb_set2(struct pkgdb *db, struct pkg *pkg, ...)
 	return (ret);
 }
 
+/*
+ * The file may have changed since sha256 was computed, so no metadata is
+ * recorded: the checksum will be verified by reading the file.
+ */
 int
 pkgdb_file_set_cksum(struct pkgdb *db, struct pkg_file *file,
 		     const char *sha256)
+{
+	return (pkgdb_file_set_sum(db, file, sha256, NULL));
+}
+
+/*
+ * Store the checksum of a file along with the key of the metadata it was
+ * computed from, st having to be taken before reading the file.  Without
+ * st the checksum will always be verified by reading the file.
+ */
+int
+pkgdb_file_set_sum(struct pkgdb *db, struct pkg_file *file,
+    const char *sha256, const struct stat *st)
 {
 	sqlite3_stmt	*stmt = NULL;
 	const char	 sql_file_update[] = ""
-		"UPDATE files SET sha256 = ?1 WHERE path = ?2";
+		"UPDATE files SET sha256 = ?1, stat = ?3 WHERE path = ?2";
+	struct pkg_file_stat meta;
+	char		 key[FILE_STAT_KEYLEN];
 	int		 ret;
 
+	memset(&meta, 0, sizeof(meta));
+	if (st != NULL) {
+		file_stat_get(st, &meta);
+		file_stat_key(&meta, key, sizeof(key));
+	}
+
 	ret = sqlite3_prepare_v2(db->sqlite, sql_file_update, -1, &stmt, NULL);
 	if (ret != SQLITE_OK) {
 		ERROR_SQLITE(db->sqlite);
@@ -3710,6 +4764,10 @@ pkgdb_file_set_cksum(struct pkgdb *db, struct pkg_file *file,
 	}
 	sqlite3_bind_text(stmt, 1, sha256, -1, SQLITE_STATIC);
 	sqlite3_bind_text(stmt, 2, pkg_file_path(file), -1, SQLITE_STATIC);
+	if (st != NULL)
+		sqlite3_bind_text(stmt, 3, key, -1, SQLITE_STATIC);
+	else
+		sqlite3_bind_null(stmt, 3);
 
 	if (sqlite3_step(stmt) != SQLITE_DONE) {
 		ERROR_SQLITE(db->sqlite);
@@ -3718,6 +4776,37 @@ pkgdb_file_set_cksum(struct pkgdb *db, struct pkg_file *file,
 	}
 	sqlite3_finalize(stmt);
 	strlcpy(file->sum, sha256, sizeof(file->sum));
+	file->meta = meta;
+
+	return (EPKG_OK);
+}
+
+/*
+ * Record the metadata the checksums of the files of pkg were computed from,
+ * so that pkg check can trust them as long as it does not change.  Only
+ * the files hashed in place, whose metadata is known, are recorded.
+ */
+int
+pkgdb_register_file_stats(struct pkgdb *db, struct pkg *pkg)
+{
+	struct pkg_file	*file = NULL;
+	char		 key[FILE_STAT_KEYLEN];
+
+	assert(db != NULL);
+
+	if (!db->prstmt_initialized && prstmt_initialize(db) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	while (pkg_files(pkg, &file) == EPKG_OK) {
+		if (*pkg_file_cksum(file) == '\0' || file->meta.ino == 0)
+			continue;
+		file_stat_key(&file->meta, key, sizeof(key));
+		if (run_prstmt(FILES_STAT, key, pkg_file_path(file))
+		    != SQLITE_DONE) {
+			ERROR_SQLITE(db->sqlite);
+			return (EPKG_FATAL);
+		}
+	}
 
 	return (EPKG_OK);
 }
@@ -3748,6 +4837,9 @@ sqlcmd_init(sqlite3 *db, __unused const char **err,
 				pkgdb_pkgle, NULL, NULL);
 	sqlite3_create_function(db, "reponame", 1, SQLITE_ANY, NULL,
 				pkgdb_strip_reponame, NULL, NULL);
+	sqlite3_create_function(db, "fts_rank", 1, SQLITE_ANY, NULL,
+				pkgdb_fts_rank, NULL, NULL);
+	pkgdb_version_sql_init(db);
 
 	return SQLITE_OK;
 }
@@ -3774,6 +4866,47 @@ pkgshell_open(const char **reponame)
 	*reponame = strdup(localpath);
 }
 
+/*
+ * In WAL mode readers work on a snapshot and never wait for a writer,
+ * but switching to exclusive locking would take that away.  Writers are
+ * instead serialized through an advisory lock on a separate file, with
+ * the same patience as the busy timeout of the sqlite handle.
+ */
+static int
+pkgdb_wal_lock(struct pkgdb *db)
+{
+	char		 lockpath[MAXPATHLEN + 1];
+	const char	*dbdir;
+	int		 tries;
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	snprintf(lockpath, sizeof(lockpath), "%s/local.lock", dbdir);
+
+	if ((db->lock_fd = open(lockpath, O_RDWR|O_CREAT, 0644)) == -1) {
+		pkg_emit_errno("open", lockpath);
+		return (EPKG_FATAL);
+	}
+
+	for (tries = 0; flock(db->lock_fd, LOCK_EX|LOCK_NB) == -1; tries++) {
+		if (errno != EWOULDBLOCK)
+			pkg_emit_errno("flock", lockpath);
+		else if (tries == 20)
+			pkg_emit_error("the local database is locked by "
+			    "another process");
+		else {
+			sqlite3_sleep(250);
+			continue;
+		}
+		close(db->lock_fd);
+		db->lock_fd = -1;
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
 int
 pkgdb_obtain_lock(struct pkgdb *db)
 {
@@ -3782,8 +4915,12 @@ pkgdb_obtain_lock(struct pkgdb *db)
 	assert(db != NULL);
 	assert(db->lock_count >= 0);
 	if (!db->lock_count) {
-		ret = sql_exec(db->sqlite,
-		    "PRAGMA main.locking_mode=EXCLUSIVE;BEGIN IMMEDIATE;COMMIT;");
+		if (db->wal)
+			ret = pkgdb_wal_lock(db);
+		else
+			ret = sql_exec(db->sqlite,
+			    "PRAGMA main.locking_mode=EXCLUSIVE;"
+			    "BEGIN IMMEDIATE;COMMIT;");
 		/* Set lock only if we actually were able to switch locking mode */
 		if (ret == EPKG_OK)
 			++db->lock_count;
@@ -3800,11 +4937,19 @@ pkgdb_release_lock(struct pkgdb *db)
 	assert(db->lock_count >= 0);
 	if (db->lock_count > 0)
 		db->lock_count--;
-	if (db->lock_count == 0)
-		return sql_exec(db->sqlite,
-		    "PRAGMA main.locking_mode=NORMAL;BEGIN IMMEDIATE;COMMIT;");
-	else
+	if (db->lock_count > 0)
 		return (EPKG_OK);
+
+	if (db->wal) {
+		if (db->lock_fd != -1) {
+			close(db->lock_fd);
+			db->lock_fd = -1;
+		}
+		return (EPKG_OK);
+	}
+
+	return sql_exec(db->sqlite,
+	    "PRAGMA main.locking_mode=NORMAL;BEGIN IMMEDIATE;COMMIT;");
 }
 
 int64_t
@@ -3827,52 +4972,72 @@ pkgdb_stats(struct pkgdb *db, pkg_stats_t type)
 		sbuf_printf(sql, "SELECT SUM(flatsize) FROM main.packages;");
 		break;
 	case PKG_STATS_REMOTE_UNIQUE:
+		if (pkgdb_catalog_usable(db)) {
+			sbuf_printf(sql, "SELECT COUNT(DISTINCT origin) "
+			    "FROM catalog.packages;");
+			break;
+		}
 		sbuf_printf(sql, "SELECT COUNT(c) FROM ");
 
 		/* open parentheses for the compound statement */
 		sbuf_printf(sql, "(");
 
 		/* execute on all databases */
-		sql_on_all_attached_db(db->sqlite, sql,
+		sql_on_all_attached_db(db, sql,
 		    "SELECT origin AS c FROM '%1$s'.packages", " UNION ");
 
 		/* close parentheses for the compound statement */
 		sbuf_printf(sql, ");");
 		break;
 	case PKG_STATS_REMOTE_COUNT:
+		if (pkgdb_catalog_usable(db)) {
+			sbuf_printf(sql, "SELECT COUNT(*) "
+			    "FROM catalog.packages;");
+			break;
+		}
 		sbuf_printf(sql, "SELECT COUNT(c) FROM ");
 
 		/* open parentheses for the compound statement */
 		sbuf_printf(sql, "(");
 
 		/* execute on all databases */
-		sql_on_all_attached_db(db->sqlite, sql,
+		sql_on_all_attached_db(db, sql,
 		    "SELECT origin AS c FROM '%1$s'.packages", " UNION ALL ");
 
 		/* close parentheses for the compound statement */
 		sbuf_printf(sql, ");");
 		break;
 	case PKG_STATS_REMOTE_SIZE:
+		if (pkgdb_catalog_usable(db)) {
+			sbuf_printf(sql, "SELECT SUM(flatsize) "
+			    "FROM catalog.packages;");
+			break;
+		}
 		sbuf_printf(sql, "SELECT SUM(s) FROM ");
 
 		/* open parentheses for the compound statement */
 		sbuf_printf(sql, "(");
 
 		/* execute on all databases */
-		sql_on_all_attached_db(db->sqlite, sql,
+		sql_on_all_attached_db(db, sql,
 		    "SELECT flatsize AS s FROM '%1$s'.packages", " UNION ALL ");
 
 		/* close parentheses for the compound statement */
 		sbuf_printf(sql, ");");
 		break;
 	case PKG_STATS_REMOTE_REPOS:
+		if (pkgdb_catalog_usable(db)) {
+			sbuf_printf(sql, "SELECT COUNT(*) "
+			    "FROM catalog.repos;");
+			break;
+		}
 		sbuf_printf(sql, "SELECT COUNT(c) FROM ");
 
 		/* open parentheses for the compound statement */
 		sbuf_printf(sql, "(");
 
 		/* execute on all databases */
-		sql_on_all_attached_db(db->sqlite, sql,
+		sql_on_all_attached_db(db, sql,
 		    "SELECT '%1$s' AS c", " UNION ALL ");
 
 		/* close parentheses for the compound statement */
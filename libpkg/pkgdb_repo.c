@@ -33,6 +33,7 @@
  */
 
 #include <sys/param.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 #include <errno.h>
@@ -60,7 +61,7 @@
 /* The package repo schema minor revision.
    Minor schema changes don't prevent older pkgng
    versions accessing the repo. */
-#define REPO_SCHEMA_MINOR 5
+#define REPO_SCHEMA_MINOR 7
 
 #define REPO_SCHEMA_VERSION (REPO_SCHEMA_MAJOR * 1000 + REPO_SCHEMA_MINOR)
 
@@ -88,9 +89,11 @@ static sql_prstmt sql_prepared_statements[PRSTMT_LAST] = {
 		NULL,
 		"INSERT INTO packages ("
 		"origin, name, version, comment, desc, arch, maintainer, www, "
-		"prefix, pkgsize, flatsize, licenselogic, cksum, path, manifestdigest"
+		"prefix, pkgsize, flatsize, licenselogic, cksum, path, manifestdigest, "
+		"vkey"
 		")"
-		"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?15)",
+		"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?15, "
+		"version_key(?3))",
 		"TTTTTTTTTIIITTT",
 	},
 	[DEPS] = {
@@ -165,8 +168,10 @@ static sql_prstmt sql_prepared_statements[PRSTMT_LAST] = {
 	},
 	[VERSION] = {
 		NULL,
-		"SELECT version FROM packages WHERE origin=?1",
-		"T",
+		"SELECT version, "
+		"coalesce(vkey, version_key(version)) < version_key(?2) "
+		"FROM packages WHERE origin=?1",
+		"TT",
 	},
 	[DELETE] = {
 		NULL,
@@ -346,6 +351,7 @@ pkgdb_repo_open(const char *repodb, bool force, sqlite3 **sqlite)
 
 	sqlite3_create_function(*sqlite, "file_exists", 2, SQLITE_ANY, NULL,
 	    file_exists, NULL, NULL);
+	pkgdb_version_sql_init(*sqlite);
 
 	if (!incremental) {
 		retcode = sql_exec(*sqlite, initsql, REPO_SCHEMA_VERSION);
@@ -409,12 +415,12 @@ maybe_delete_conflicting(const char *origin, const char *version,
 	int ret = EPKG_FATAL;
 	const char *oversion;
 
-	if (run_prepared_statement(VERSION, origin) != SQLITE_ROW)
+	if (run_prepared_statement(VERSION, origin, version) != SQLITE_ROW)
 		return (EPKG_FATAL); /* sqlite error */
 	oversion = sqlite3_column_text(STMT(VERSION), 0);
 	if (!forced) {
-		switch(pkg_version_cmp(oversion, version)) {
-		case -1:
+		/* the statement compares the version keys: is oversion older? */
+		if (sqlite3_column_int(STMT(VERSION), 1)) {
 			pkg_emit_error("duplicate package origin: replacing older "
 					"version %s in repo with package %s for "
 					"origin %s", oversion, pkg_path, origin);
@@ -423,14 +429,11 @@ maybe_delete_conflicting(const char *origin, const char *version,
 				return (EPKG_FATAL); /* sqlite error */
 
 			ret = EPKG_OK;	/* conflict cleared */
-			break;
-		case 0:
-		case 1:
+		} else {
 			pkg_emit_error("duplicate package origin: package %s is not "
 					"newer than version %s already in repo for "
 					"origin %s", pkg_path, oversion, origin);
 			ret = EPKG_END;	/* keep what is already in the repo */
-			break;
 		}
 	}
 	else {
@@ -894,3 +897,129 @@ pkgdb_repo_origins(sqlite3 *sqlite)
 
 	return pkgdb_it_new(&repodb, stmt, PKG_REMOTE, PKGDB_IT_FLAG_ONCE);
 }
+
+int
+pkgdb_catalog_update(struct pkg_repo *repo)
+{
+	sqlite3		*sqlite = NULL;
+	struct pkg_repo	*r = NULL;
+	struct sbuf	*enabled = NULL;
+	struct stat	 st;
+	const char	*dbdir = NULL;
+	char		 catalogfile[MAXPATHLEN];
+	char		 repofile[MAXPATHLEN];
+	char		*req = NULL;
+	int64_t		 current = 0;
+	int		 ret = EPKG_FATAL;
+	const char	 init_sql[] = ""
+		"CREATE TABLE IF NOT EXISTS repos ("
+			"name TEXT PRIMARY KEY,"
+			"dev INTEGER,"
+			"ino INTEGER,"
+			"mtime INTEGER,"
+			"size INTEGER"
+		");"
+		"CREATE TABLE IF NOT EXISTS packages ("
+			"repo TEXT NOT NULL,"
+			"id INTEGER NOT NULL,"
+			"origin TEXT NOT NULL,"
+			"name TEXT NOT NULL,"
+			"version TEXT NOT NULL,"
+			"comment TEXT,"
+			"flatsize INTEGER,"
+			"vkey BLOB,"
+			"PRIMARY KEY (repo, id)"
+		");"
+		"CREATE INDEX IF NOT EXISTS packages_name ON packages(name);"
+		/* the newest version of an origin across the repositories */
+		"CREATE INDEX IF NOT EXISTS packages_origin "
+			"ON packages(origin, vkey);"
+		"PRAGMA user_version = %d;";
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	snprintf(catalogfile, sizeof(catalogfile), "%s/catalog.sqlite", dbdir);
+	snprintf(repofile, sizeof(repofile), "%s/%s.sqlite", dbdir,
+	    pkg_repo_name(repo));
+
+	if (stat(repofile, &st) != 0) {
+		pkg_emit_errno("stat", repofile);
+		return (EPKG_FATAL);
+	}
+
+	if (sqlite3_open(catalogfile, &sqlite) != SQLITE_OK) {
+		ERROR_SQLITE(sqlite);
+		sqlite3_close(sqlite);
+		return (EPKG_FATAL);
+	}
+	sqlite3_busy_timeout(sqlite, 5000);
+	pkgdb_version_sql_init(sqlite);
+
+	/* a catalogue in another format is rebuilt from scratch */
+	if (get_pragma(sqlite, "PRAGMA user_version;", &current) != EPKG_OK)
+		goto cleanup;
+	if (current != CATALOG_VERSION && sql_exec(sqlite,
+	    "DROP TABLE IF EXISTS packages;"
+	    "DROP TABLE IF EXISTS repos;") != EPKG_OK)
+		goto cleanup;
+
+	if (sql_exec(sqlite, init_sql, CATALOG_VERSION) != EPKG_OK)
+		goto cleanup;
+
+	if (sql_exec(sqlite, "ATTACH %Q AS source;", repofile) != EPKG_OK)
+		goto cleanup;
+
+	enabled = sbuf_new_auto();
+	while (pkg_repos(&r) == EPKG_OK) {
+		if (!pkg_repo_enabled(r))
+			continue;
+		sbuf_printf(enabled, "%s'%s'", sbuf_len(enabled) > 0 ? "," : "",
+		    pkg_repo_name(r));
+	}
+	sbuf_finish(enabled);
+
+	if (sql_exec(sqlite, "BEGIN;"
+	    "DELETE FROM packages WHERE repo NOT IN (%s);"
+	    "DELETE FROM repos WHERE name NOT IN (%s);",
+	    sbuf_data(enabled), sbuf_data(enabled)) != EPKG_OK)
+		goto rollback;
+
+	/* Nothing to do if the catalogue did not change since last time */
+	req = sqlite3_mprintf("SELECT COUNT(*) FROM repos WHERE name = %Q "
+	    "AND dev = %lld AND ino = %lld AND mtime = %lld AND size = %lld;",
+	    pkg_repo_name(repo), (long long)st.st_dev, (long long)st.st_ino,
+	    (long long)st.st_mtime, (long long)st.st_size);
+	ret = get_pragma(sqlite, req, &current);
+	sqlite3_free(req);
+	if (ret != EPKG_OK)
+		goto rollback;
+
+	if (current == 0 && sql_exec(sqlite,
+	    "DELETE FROM packages WHERE repo = %Q;"
+	    "INSERT INTO packages "
+		"(repo, id, origin, name, version, comment, flatsize, vkey) "
+		"SELECT %Q, id, origin, name, version, comment, flatsize, "
+		"version_key(version) "
+		"FROM source.packages;"
+	    "INSERT OR REPLACE INTO repos (name, dev, ino, mtime, size) "
+		"VALUES (%Q, %lld, %lld, %lld, %lld);",
+	    pkg_repo_name(repo), pkg_repo_name(repo), pkg_repo_name(repo),
+	    (long long)st.st_dev, (long long)st.st_ino,
+	    (long long)st.st_mtime, (long long)st.st_size) != EPKG_OK)
+		goto rollback;
+
+	if ((ret = sql_exec(sqlite, "COMMIT;")) == EPKG_OK)
+		goto cleanup;
+
+rollback:
+	ret = EPKG_FATAL;
+	sql_exec(sqlite, "ROLLBACK;");
+
+cleanup:
+	if (enabled != NULL)
+		sbuf_delete(enabled);
+	sqlite3_close(sqlite);
+
+	return (ret);
+}
@@ -354,6 +354,37 @@ static struct db_upgrades {
 		"AND package_id = old.package_id; "
 	"END;"
 	},
+	{19,
+	"CREATE TABLE file_names ("
+		"path TEXT PRIMARY KEY,"
+		"name TEXT NOT NULL"
+	");"
+	"CREATE TRIGGER file_names_insert AFTER INSERT ON files "
+	"FOR EACH ROW BEGIN "
+		"INSERT OR REPLACE INTO file_names (path, name) "
+		"VALUES (new.path, " FILE_BASENAME("new.path") "); "
+	"END;"
+	"CREATE TRIGGER file_names_update AFTER UPDATE OF path ON files "
+	"FOR EACH ROW BEGIN "
+		"DELETE FROM file_names WHERE path = old.path; "
+		"INSERT OR REPLACE INTO file_names (path, name) "
+		"VALUES (new.path, " FILE_BASENAME("new.path") "); "
+	"END;"
+	"CREATE TRIGGER file_names_delete AFTER DELETE ON files "
+	"FOR EACH ROW BEGIN "
+		"DELETE FROM file_names WHERE path = old.path; "
+	"END;"
+	"INSERT INTO file_names (path, name) "
+		"SELECT path, " FILE_BASENAME("path") " FROM files;"
+	"CREATE INDEX file_names_name ON file_names(name);"
+	},
+	{20,
+	"ALTER TABLE packages ADD COLUMN vkey BLOB;"
+	"UPDATE packages SET vkey = version_key(version);"
+	},
+	{21,
+	"ALTER TABLE files ADD COLUMN stat TEXT;"
+	},
 
 	/* Mark the end of the array */
 	{ -1, NULL }
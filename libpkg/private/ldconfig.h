@@ -34,7 +34,6 @@
 extern int	insecure;	/* -i flag, needed here for elfhints.c */
 
 __BEGIN_DECLS
-void		shlib_list_init(void);
 void		rpath_list_init(void);
 const char     *shlib_list_find_by_name(const char *);
 void		shlib_list_free(void);
@@ -104,6 +104,7 @@ extern int eventpipe;
 
 struct pkg {
 	struct sbuf	*fields[PKG_NUM_FIELDS];
+	struct sbuf	*vkey;		/* see pkg_version_key() */
 	bool		 direct;
 	bool		 automatic;
 	bool		 locked;
@@ -154,6 +155,7 @@ struct pkg_category {
 struct pkg_file {
 	char		 path[MAXPATHLEN +1];
 	char		 sum[SHA256_DIGEST_LENGTH * 2 +1];
+	struct pkg_file_stat meta;
 	char		 uname[MAXLOGNAME +1];
 	char		 gname[MAXLOGNAME +1];
 	bool		 keep;
@@ -263,6 +265,13 @@ struct pkg_repo {
 	};
 	FILE *ssh;
 	bool enable;
+	/* catalogue file as of its last schema check */
+	bool checked;
+	int check_result;
+	dev_t check_dev;
+	ino_t check_ino;
+	time_t check_mtime;
+	off_t check_size;
 	UT_hash_handle hh;
 };
 
@@ -358,6 +367,7 @@ int packing_append_buffer(struct packing *pack, const char *buffer,
 int packing_append_tree(struct packing *pack, const char *treepath,
 			const char *newroot);
 int packing_finish(struct packing *pack);
+int packing_open_frame(struct archive *a, const char *path, const char *name);
 pkg_formats packing_format_from_string(const char *str);
 
 int pkg_delete_files(struct pkg *pkg, bool force);
@@ -371,6 +381,10 @@ struct pkgdb_it *pkgdb_integrity_conflict_local(struct pkgdb *db,
 						const char *origin);
 
 int pkg_set_mtree(struct pkg *, const char *mtree);
+void pkg_set_s(struct pkg *pkg, pkg_attr attr, const char *str);
+void pkg_set_i(struct pkg *pkg, pkg_attr attr, int64_t val);
+void pkg_set_vkey(struct pkg *pkg, const void *key, size_t len);
+int pkg_vkey_cmp(struct pkg *p1, struct pkg *p2);
 
 /* pkg repo related */
 int pkg_check_repo_version(struct pkgdb *db, const char *database);
@@ -401,7 +415,10 @@ int pkgdb_update_shlibs_provided(struct pkg *pkg, int64_t package_id, sqlite3 *s
 int pkgdb_insert_annotations(struct pkg *pkg, int64_t package_id, sqlite3 *s);
 int pkgdb_register_finale(struct pkgdb *db, int retcode);
 
-int pkg_register_shlibs(struct pkg *pkg);
+int pkg_register_shlibs(struct pkg *pkg, const char *root);
+void pkg_elf_cache_free(void);
+void pkg_elf_cache_prime(const char *fpath, const struct stat *sb,
+    const char *map, size_t len);
 
 void pkg_config_parse(yaml_document_t *doc, yaml_node_t *node, struct pkg_config *conf_by_key);
 
@@ -32,17 +32,32 @@
 
 #include "sqlite3.h"
 
+#define CATALOG_VERSION 2
+
+/*
+ * SQL expression yielding the last component of a path column: rtrim()
+ * strips everything but slashes from the right, leaving the directory.
+ */
+#define FILE_BASENAME(col) \
+	"substr(" col ", length(rtrim(" col ", replace(" col ", '/', ''))) + 1)"
+
 struct pkgdb {
 	sqlite3		*sqlite;
 	pkgdb_t		 type;
 	int		 lock_count;
+	int		 lock_fd;
 	bool		 prstmt_initialized;
+	bool		 wal;
+	bool		 repos_attached;
+	short		 catalog;
 };
 
 struct pkgdb_it {
 	struct pkgdb	*db;
 	sqlite3	*sqlite;
 	sqlite3_stmt	*stmt;
+	int	*colmap;	/* pkg_attr of each column, built on first row */
+	int	ncols;
 	short	type;
 	short	flags;
 	short	finished;
@@ -68,6 +83,20 @@ struct pkgdb_it *pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type, short
 int pkgdb_obtain_lock(struct pkgdb *db);
 int pkgdb_release_lock(struct pkgdb *db);
 
+/**
+ * Same as pkgdb_file_set_cksum() with the metadata of the file taken before
+ * it was hashed, NULL to have its checksum always verified by reading it.
+ */
+struct stat;
+int pkgdb_file_set_sum(struct pkgdb *db, struct pkg_file *file,
+    const char *sha256, const struct stat *st);
+
+/**
+ * Record the metadata of the installed files of pkg next to their
+ * checksums, for the files whose metadata was taken when they were hashed.
+ */
+int pkgdb_register_file_stats(struct pkgdb *db, struct pkg *pkg);
+
 void pkgshell_open(const char **r);
 
 /**
@@ -130,6 +159,15 @@ int pkgdb_repo_remove_package(const char *origin);
  */
 int pkgdb_repo_check_version(struct pkgdb *db, const char *database);
 
+/**
+ * Index the packages of a freshly updated repository in the merged
+ * catalogue, <dbdir>/catalog.sqlite, used to find which repositories hold
+ * a package without querying all of them
+ * @param repo the repository
+ * @return EPKG_OK if succeeded
+ */
+int pkgdb_catalog_update(struct pkg_repo *repo);
+
 /**
  * Returns a list of all packages sorted by origin
  * @param sqlite database
@@ -137,4 +175,11 @@ int pkgdb_repo_check_version(struct pkgdb *db, const char *database);
  */
 struct pkgdb_it *pkgdb_repo_origins(sqlite3 *sqlite);
 
+/**
+ * Register the version_key() and vercmp() functions and the VERSION
+ * collation on a database connection
+ * @param s database
+ */
+void pkgdb_version_sql_init(sqlite3 *s);
+
 #endif
@@ -58,8 +58,11 @@ static const char initsql[] = ""
 	    /* relative path to the package in the repository */
 	    "path TEXT NOT NULL,"
 	    "pkg_format_version INTEGER,"
-	    "manifestdigest TEXT NULL"
+	    "manifestdigest TEXT NULL,"
+	    /* pkg_version_key() of version */
+	    "vkey BLOB"
 	");"
+	"CREATE INDEX packages_vkey ON packages(origin, vkey);"
 	"CREATE TABLE deps ("
 	    "origin TEXT,"
 	    "name TEXT,"
@@ -128,6 +131,24 @@ static const char initsql[] = ""
 	    " ON DELETE CASCADE ON UPDATE RESTRICT,"
 	    "UNIQUE (package_id, tag_id)"
 	");"
+	/* full-text index used by pkg search, kept up to date by triggers */
+	"CREATE VIRTUAL TABLE pkg_search USING fts4("
+	    "name, origin, comment, \"desc\", content=\"packages\""
+	");"
+	"CREATE TRIGGER pkg_search_bd BEFORE DELETE ON packages BEGIN "
+	    "DELETE FROM pkg_search WHERE docid = old.id; "
+	"END;"
+	"CREATE TRIGGER pkg_search_bu BEFORE UPDATE ON packages BEGIN "
+	    "DELETE FROM pkg_search WHERE docid = old.id; "
+	"END;"
+	"CREATE TRIGGER pkg_search_ai AFTER INSERT ON packages BEGIN "
+	    "INSERT INTO pkg_search(docid, name, origin, comment, \"desc\") "
+	    "VALUES (new.id, new.name, new.origin, new.comment, new.\"desc\"); "
+	"END;"
+	"CREATE TRIGGER pkg_search_au AFTER UPDATE ON packages BEGIN "
+	    "INSERT INTO pkg_search(docid, name, origin, comment, \"desc\") "
+	    "VALUES (new.id, new.name, new.origin, new.comment, new.\"desc\"); "
+	"END;"
 	"PRAGMA user_version=%d;"
 	;
 
@@ -207,6 +228,35 @@ static const struct repo_changes repo_upgrades[] = {
 	 "DROP TABLE pkg_abstract;"
 	 "DROP TABLE abstract;"
 	},
+	{2005,
+	 2006,
+	 "Add full-text search index",
+	 "CREATE VIRTUAL TABLE %Q.pkg_search USING fts4("
+		"name, origin, comment, \"desc\", content=\"packages\""
+	 ");"
+	 "CREATE TRIGGER %Q.pkg_search_bd BEFORE DELETE ON packages BEGIN "
+		"DELETE FROM pkg_search WHERE docid = old.id; "
+	 "END;"
+	 "CREATE TRIGGER %Q.pkg_search_bu BEFORE UPDATE ON packages BEGIN "
+		"DELETE FROM pkg_search WHERE docid = old.id; "
+	 "END;"
+	 "CREATE TRIGGER %Q.pkg_search_ai AFTER INSERT ON packages BEGIN "
+		"INSERT INTO pkg_search(docid, name, origin, comment, \"desc\") "
+		"VALUES (new.id, new.name, new.origin, new.comment, new.\"desc\"); "
+	 "END;"
+	 "CREATE TRIGGER %Q.pkg_search_au AFTER UPDATE ON packages BEGIN "
+		"INSERT INTO pkg_search(docid, name, origin, comment, \"desc\") "
+		"VALUES (new.id, new.name, new.origin, new.comment, new.\"desc\"); "
+	 "END;"
+	 "INSERT INTO %Q.pkg_search(pkg_search) VALUES('rebuild');"
+	},
+	{2006,
+	 2007,
+	 "Add sortable version keys",
+	 "ALTER TABLE %Q.packages ADD COLUMN vkey BLOB;"
+	 "UPDATE %Q.packages SET vkey = version_key(version);"
+	 "CREATE INDEX %Q.packages_vkey ON packages(origin, vkey);"
+	},
 	/* Mark the end of the array */
 	{ -1, -1, NULL, NULL, }
 
@@ -215,6 +265,20 @@ static const struct repo_changes repo_upgrades[] = {
 /* How to downgrade a newer repo to match what the current system
    expects */
 static const struct repo_changes repo_downgrades[] = {
+	{2007,
+	 2006,
+	 "Drop version key index",
+	 "DROP INDEX %Q.packages_vkey;"
+	},
+	{2006,
+	 2005,
+	 "Drop full-text search index",
+	 "DROP TRIGGER %Q.pkg_search_au;"
+	 "DROP TRIGGER %Q.pkg_search_ai;"
+	 "DROP TRIGGER %Q.pkg_search_bu;"
+	 "DROP TRIGGER %Q.pkg_search_bd;"
+	 "DROP TABLE %Q.pkg_search;"
+	},
 	{2005,
 	 2004,
 	 "Revert rename of 'abstract metadata' to 'annotations'",
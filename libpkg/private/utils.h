@@ -52,6 +52,19 @@ struct hardlinks {
 	UT_hash_handle hh;
 };
 
+/*
+ * Device, inode, size, modification and change times of a file when its
+ * checksum was computed: as long as they do not change, the content of the
+ * file did not either.  ino is 0 when they are not known.
+ */
+struct pkg_file_stat {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime;		/* in nanoseconds */
+	int64_t ctime;		/* in nanoseconds */
+};
+
 struct dns_srvinfo {
 	unsigned int type;
 	unsigned int class;
@@ -75,7 +88,12 @@ int format_exec_cmd(char **, const char *, const char *, const char *, char *);
 int is_dir(const char *);
 int is_conf_file(const char *path, char *newpath, size_t len);
 
+void hex_encode(const unsigned char *, size_t, char *);
 int sha256_file(const char *, char[SHA256_DIGEST_LENGTH * 2 +1]);
+int sha256_file_r(const char *, char[SHA256_DIGEST_LENGTH * 2 +1],
+    const char **);
+int sha256_fd_r(int, char[SHA256_DIGEST_LENGTH * 2 +1]);
+void sha256_buf(const char *, size_t, char[SHA256_DIGEST_LENGTH * 2 +1]);
 int md5_file(const char *, char[MD5_DIGEST_LENGTH * 2 +1]);
 
 int rsa_sign(char *path, pem_password_cb *password_cb, char *rsa_key_path,
@@ -83,7 +101,12 @@ int rsa_sign(char *path, pem_password_cb *password_cb, char *rsa_key_path,
 int rsa_verify(const char *path, const char *key,
 		unsigned char *sig, unsigned int sig_len);
 
-bool is_hardlink(struct hardlinks *hl, struct stat *st);
+bool is_hardlink(struct hardlinks **hl, struct stat *st);
+#define FILE_STAT_KEYLEN	128
+void file_stat_get(const struct stat *st, struct pkg_file_stat *fs);
+void file_stat_key(const struct pkg_file_stat *fs, char *out, size_t len);
+bool file_stat_parse(const char *key, struct pkg_file_stat *fs);
+void parallel_for(int n, int64_t threads, void (*fn)(void *, int), void *arg);
 
 struct dns_srvinfo *
 	dns_getsrvinfo(const char *zone);
@@ -0,0 +1,247 @@
+/*-
+ * Copyright (c) 2013 Baptiste Daroussin <bapt@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * SHA-256 of buffers and files.  The compression function is OpenSSL's,
+ * which picks the SHA extensions of the CPU at runtime when there are
+ * any; what is done here is feeding it: files are read with large
+ * page-aligned read(2)s into a buffer kept by each thread, and the
+ * digests are hex-encoded through a table.  pkg_sha256_files() spreads
+ * many files over CHECK_THREADS threads.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pkg.h"
+#include "private/event.h"
+#include "private/utils.h"
+
+#define SHA256_BUFSIZE	(1024 * 1024)
+
+static pthread_key_t	buffer_key;
+static pthread_once_t	buffer_once = PTHREAD_ONCE_INIT;
+static int		buffer_key_ret;
+
+static void
+buffer_key_init(void)
+{
+	buffer_key_ret = pthread_key_create(&buffer_key, free);
+}
+
+/* The read buffer of the calling thread, freed when the thread exits */
+static char *
+sha256_buffer(void)
+{
+	void *buf;
+
+	pthread_once(&buffer_once, buffer_key_init);
+	if (buffer_key_ret != 0)
+		return (NULL);
+
+	if ((buf = pthread_getspecific(buffer_key)) != NULL)
+		return (buf);
+
+	if (posix_memalign(&buf, getpagesize(), SHA256_BUFSIZE) != 0)
+		return (NULL);
+	if (pthread_setspecific(buffer_key, buf) != 0) {
+		free(buf);
+		return (NULL);
+	}
+
+	return (buf);
+}
+
+void
+hex_encode(const unsigned char *in, size_t len, char *out)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		out[i * 2] = hex[in[i] >> 4];
+		out[i * 2 + 1] = hex[in[i] & 0x0f];
+	}
+	out[len * 2] = '\0';
+}
+
+void
+sha256_buf(const char *buf, size_t len, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	SHA256_CTX sha256;
+
+	SHA256_Init(&sha256);
+	SHA256_Update(&sha256, buf, len);
+	SHA256_Final(hash, &sha256);
+	hex_encode(hash, SHA256_DIGEST_LENGTH, out);
+}
+
+/*
+ * Hash what is left to read of fd without emitting events: on failure
+ * errno is left set.
+ */
+int
+sha256_fd_r(int fd, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	SHA256_CTX sha256;
+	char *buf;
+	ssize_t r;
+
+	out[0] = '\0';
+
+	if ((buf = sha256_buffer()) == NULL) {
+		errno = ENOMEM;
+		return (EPKG_FATAL);
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	/* only a hint, it is fine if it fails */
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	SHA256_Init(&sha256);
+	while ((r = read(fd, buf, SHA256_BUFSIZE)) != 0) {
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return (EPKG_FATAL);
+		}
+		SHA256_Update(&sha256, buf, r);
+	}
+	SHA256_Final(hash, &sha256);
+	hex_encode(hash, SHA256_DIGEST_LENGTH, out);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Same as sha256_file() without emitting events, so that it can run on any
+ * thread: on failure errno is left set and errfunc names the function that
+ * failed.
+ */
+int
+sha256_file_r(const char *path, char out[SHA256_DIGEST_LENGTH * 2 + 1],
+    const char **errfunc)
+{
+	int fd, ret, saved;
+
+	out[0] = '\0';
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		*errfunc = "open";
+		return (EPKG_FATAL);
+	}
+
+	if ((ret = sha256_fd_r(fd, out)) != EPKG_OK)
+		*errfunc = "read";
+
+	saved = errno;
+	close(fd);
+	errno = saved;
+
+	return (ret);
+}
+
+int
+sha256_file(const char *path, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	const char *errfunc;
+
+	if (sha256_file_r(path, out, &errfunc) != EPKG_OK) {
+		pkg_emit_errno(errfunc, path);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+int
+pkg_sha256_file(const char *path, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	return (sha256_file(path, out));
+}
+
+struct sha256_job {
+	const char	*path;
+	char		*out;
+	const char	*errfunc;
+	int		 error;
+	int		 ret;
+};
+
+static void
+sha256_worker(void *arg, int i)
+{
+	struct sha256_job *job = &((struct sha256_job *)arg)[i];
+
+	job->ret = sha256_file_r(job->path, job->out, &job->errfunc);
+	job->error = errno;
+}
+
+int
+pkg_sha256_files(const char **paths, int n,
+    char (*out)[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	struct sha256_job *jobs;
+	int64_t threads = 0;
+	int ret = EPKG_OK;
+	int i;
+
+	if (n <= 0)
+		return (EPKG_OK);
+
+	if ((jobs = calloc(n, sizeof(*jobs))) == NULL) {
+		pkg_emit_errno("calloc", "sha256_job");
+		return (EPKG_FATAL);
+	}
+	for (i = 0; i < n; i++) {
+		jobs[i].path = paths[i];
+		jobs[i].out = out[i];
+	}
+
+	pkg_config_int64(PKG_CONFIG_CHECK_THREADS, &threads);
+	parallel_for(n, threads, sha256_worker, jobs);
+
+	/* the events are only emitted from the calling thread */
+	for (i = 0; i < n; i++) {
+		if (jobs[i].ret == EPKG_OK)
+			continue;
+		errno = jobs[i].error;
+		pkg_emit_errno(jobs[i].errfunc, jobs[i].path);
+		ret = EPKG_FATAL;
+	}
+	free(jobs);
+
+	return (ret);
+}
@@ -681,5 +681,8 @@ cleanup:
 		utimes(repofile, ftimes);
 	}
 
+	if (res == EPKG_OK || res == EPKG_UPTODATE)
+		pkgdb_catalog_update(repo);
+
 	return (res);
 }
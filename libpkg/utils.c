@@ -27,11 +27,13 @@
 
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/sysctl.h>
 #include <stdio.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -278,17 +280,6 @@ is_dir(const char *path)
 	return (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
 }
 
-static void
-md5_hash(unsigned char hash[MD5_DIGEST_LENGTH],
-    char out[MD5_DIGEST_LENGTH * 2 + 1])
-{
-	int i;
-	for (i = 0; i < MD5_DIGEST_LENGTH; i++)
-		sprintf(out + (i *2), "%02x", hash[i]);
-
-	out[MD5_DIGEST_LENGTH * 2] = '\0';
-}
-
 int
 md5_file(const char *path, char out[MD5_DIGEST_LENGTH * 2 + 1])
 {
@@ -318,90 +309,170 @@ md5_file(const char *path, char out[MD5_DIGEST_LENGTH * 2 + 1])
 	fclose(fp);
 
 	MD5_Final(hash, &md5);
-	md5_hash(hash, out);
+	hex_encode(hash, MD5_DIGEST_LENGTH, out);
 
 	return (EPKG_OK);
 }
 
-static void
-sha256_hash(unsigned char hash[SHA256_DIGEST_LENGTH],
-    char out[SHA256_DIGEST_LENGTH * 2 + 1])
+int
+is_conf_file(const char *path, char *newpath, size_t len)
 {
-	int i;
-	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
-		sprintf(out + (i * 2), "%02x", hash[i]);
+	size_t n;
+	const char *p = NULL;
+
+	n = strlen(path);
+
+	if (n < 8)
+		return (0);
+
+	p = &path[n - 8];
+
+	if (strcmp(p, ".pkgconf") == 0) {
+		strlcpy(newpath, path, len);
+		newpath[n - 8] = '\0';
+		return (1);
+	}
 
-	out[SHA256_DIGEST_LENGTH * 2] = '\0';
+	return (0);
 }
 
-int
-sha256_file(const char *path, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+struct parallel_pool {
+	pthread_mutex_t	 lock;
+	void		(*fn)(void *, int);
+	void		*arg;
+	int		 n;
+	int		 next;
+};
+
+static void *
+parallel_worker(void *arg)
 {
-	FILE *fp;
-	char buffer[BUFSIZ];
-	unsigned char hash[SHA256_DIGEST_LENGTH];
-	size_t r = 0;
-	SHA256_CTX sha256;
+	struct parallel_pool	*pool = arg;
+	int			 i;
 
-	if ((fp = fopen(path, "rb")) == NULL) {
-		pkg_emit_errno("fopen", path);
-		return EPKG_FATAL;
-	}
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
 
-	SHA256_Init(&sha256);
+		if (i >= pool->n)
+			break;
 
-	while ((r = fread(buffer, 1, BUFSIZ, fp)) > 0)
-		SHA256_Update(&sha256, buffer, r);
+		pool->fn(pool->arg, i);
+	}
 
-	if (ferror(fp) != 0) {
-		fclose(fp);
-		out[0] = '\0';
-		pkg_emit_errno("fread", path);
-		return EPKG_FATAL;
+	return (NULL);
+}
+
+/*
+ * Call fn(arg, i) for every i from 0 to n - 1 on up to threads threads, 0
+ * or less meaning one per CPU.  The calling thread takes part, and does
+ * everything itself if no thread can be created.
+ */
+void
+parallel_for(int n, int64_t threads, void (*fn)(void *, int), void *arg)
+{
+	struct parallel_pool	 pool;
+	pthread_t		*tids = NULL;
+	size_t			 len;
+	int			 ncpu, i, j;
+
+	if (n <= 0)
+		return;
+
+	if (threads <= 0) {
+		len = sizeof(ncpu);
+		if (sysctlbyname("hw.ncpu", &ncpu, &len, NULL, 0) == -1)
+			ncpu = 1;
+		threads = ncpu;
 	}
+	if (threads > n)
+		threads = n;
 
-	fclose(fp);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.n = n;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
 
-	SHA256_Final(hash, &sha256);
-	sha256_hash(hash, out);
+	/* the calling thread is one of them */
+	if (threads > 1)
+		tids = calloc(threads - 1, sizeof(pthread_t));
 
-	return (EPKG_OK);
+	if (tids == NULL) {
+		parallel_worker(&pool);
+	} else {
+		for (i = 0; i < threads - 1; i++) {
+			if (pthread_create(&tids[i], NULL, parallel_worker,
+			    &pool) != 0)
+				break;
+		}
+		parallel_worker(&pool);
+		for (j = 0; j < i; j++)
+			pthread_join(tids[j], NULL);
+		free(tids);
+	}
+	pthread_mutex_destroy(&pool.lock);
 }
 
-int
-is_conf_file(const char *path, char *newpath, size_t len)
+#define NSEC(ts)	((int64_t)(ts).tv_sec * 1000000000 + (ts).tv_nsec)
+
+void
+file_stat_get(const struct stat *st, struct pkg_file_stat *fs)
 {
-	size_t n;
-	const char *p = NULL;
+	fs->dev = st->st_dev;
+	fs->ino = st->st_ino;
+	fs->size = st->st_size;
+	fs->mtime = NSEC(st->st_mtim);
+	fs->ctime = NSEC(st->st_ctim);
+}
 
-	n = strlen(path);
+/*
+ * The text form of a struct pkg_file_stat stored in the database, at most
+ * FILE_STAT_KEYLEN long.
+ */
+void
+file_stat_key(const struct pkg_file_stat *fs, char *out, size_t len)
+{
+	snprintf(out, len, "%ju %ju %jd %jd.%09jd %jd.%09jd",
+	    (uintmax_t)fs->dev, (uintmax_t)fs->ino, (intmax_t)fs->size,
+	    (intmax_t)(fs->mtime / 1000000000),
+	    (intmax_t)(fs->mtime % 1000000000),
+	    (intmax_t)(fs->ctime / 1000000000),
+	    (intmax_t)(fs->ctime % 1000000000));
+}
 
-	if (n < 8)
-		return (0);
+bool
+file_stat_parse(const char *key, struct pkg_file_stat *fs)
+{
+	uintmax_t dev, ino;
+	intmax_t size, msec, mnsec, csec, cnsec;
 
-	p = &path[n - 8];
+	if (sscanf(key, "%ju %ju %jd %jd.%jd %jd.%jd", &dev, &ino, &size,
+	    &msec, &mnsec, &csec, &cnsec) != 7)
+		return (false);
 
-	if (strcmp(p, ".pkgconf") == 0) {
-		strlcpy(newpath, path, len);
-		newpath[n - 8] = '\0';
-		return (1);
-	}
+	fs->dev = dev;
+	fs->ino = ino;
+	fs->size = size;
+	fs->mtime = msec * 1000000000 + mnsec;
+	fs->ctime = csec * 1000000000 + cnsec;
 
-	return (0);
+	return (true);
 }
 
 bool
-is_hardlink(struct hardlinks *hl, struct stat *st)
+is_hardlink(struct hardlinks **hl, struct stat *st)
 {
 	struct hardlinks *h;
 
-	HASH_FIND_INO(hl, &st->st_ino, h);
+	HASH_FIND_INO(*hl, &st->st_ino, h);
 	if (h != NULL)
 		return false;
 
 	h = malloc(sizeof(struct hardlinks));
 	h->inode = st->st_ino;
-	HASH_ADD_INO(hl, inode, h);
+	HASH_ADD_INO(*hl, inode, h);
 
 	return (true);
 }
@@ -79,56 +79,11 @@ struct audit_entry {
 	struct audit_entry *next;
 };
 
-/*
- * The _sorted stuff.
- *
- * We are using the optimized search based on the following observations:
- *
- * - number of VuXML entries is more likely to be far greater than
- *   the number of installed ports; thus we should try to optimize
- *   the walk through all entries for a given port;
- *
- * - fnmatch() is good and fast, but if we will compare the audit entry
- *   name prefix without globbing characters to the prefix of port name
- *   of the same length and they are different, there is no point to
- *   check the rest;
- *
- * - (most important bit): if parsed VuXML entries are lexicographically
- *   sorted per the largest prefix with no globbing characters and we
- *   know how many succeeding entries have the same prefix we can
- *
- *   a. skip the rest of the entries once the non-globbing prefix is
- *      lexicographically larger than the port name prefix of the
- *      same length: all successive prefixes will be larger as well;
- *
- *   b. if we have non-globbing prefix that is lexicographically smaller
- *      than port name prefix, we can skip all succeeding entries with
- *      the same prefix; and as some port names tend to repeat due to
- *      multiple vulnerabilities, it could be a large win.
- */
-struct audit_entry_sorted {
-	struct audit_entry *e;	/* Entry itself */
-	size_t noglob_len;	/* Prefix without glob characters */
-	size_t next_pfx_incr;	/* Index increment for the entry with
-				   different prefix */
-};
-
-/*
- * Another small optimization to skip the beginning of the
- * VuXML entry array, if possible.
- *
- * audit_entry_first_byte_idx[ch] represents the index
- * of the first VuXML entry in the sorted array that has
- * its non-globbing prefix that is started with the character
- * 'ch'.  It allows to skip entries from the beginning of the
- * VuXML array that aren't relevant for the checked port name.
- */
-static size_t audit_entry_first_byte_idx[256];
-
 void
 usage_audit(void)
 {
-	fprintf(stderr, "usage: pkg audit [-Fqx] <pattern>\n\n");
+	fprintf(stderr, "usage: pkg audit [-Fqx] <pattern>\n");
+	fprintf(stderr, "       pkg audit [-Fqx] [-a]\n\n");
 	fprintf(stderr, "For more information see 'pkg help audit'.\n");
 }
 
@@ -139,6 +94,7 @@ fetch_and_extract(const char *src, const char *dest, bool xml)
 	struct archive_entry *ae = NULL;
 	int fd = -1;
 	char tmp[MAXPATHLEN];
+	char idxpath[MAXPATHLEN];
 	const char *tmpdir;
 	int retcode = EPKG_FATAL;
 	int ret;
@@ -202,6 +158,10 @@ fetch_and_extract(const char *src, const char *dest, bool xml)
 		}
 	}
 
+	/* The compiled index is out of date now */
+	snprintf(idxpath, sizeof(idxpath), "%s.idx", dest);
+	unlink(idxpath);
+
 	retcode = EPKG_OK;
 
 	cleanup:
@@ -601,106 +561,501 @@ str_noglob_len(const char *s)
 	return n;
 }
 
+static void
+free_audit_list(struct audit_entry *h)
+{
+	struct audit_entry *e;
+	struct audit_versions *vers, *vers_tmp;
+	struct audit_cve *cve, *cve_tmp;
+
+	while (h) {
+		e = h;
+		h = h->next;
+		LL_FOREACH_SAFE(e->versions, vers, vers_tmp) {
+			if (vers->v1.version) {
+				free(vers->v1.version);
+			}
+			if (vers->v2.version) {
+				free(vers->v2.version);
+			}
+			free(vers);
+		}
+		LL_FOREACH_SAFE(e->cve, cve, cve_tmp) {
+			if (cve->cvename)
+				free(cve->cvename);
+			free(cve);
+		}
+		if (e->url)
+			free(e->url);
+		if (e->desc)
+			free(e->desc);
+		if (e->id)
+			free(e->id);
+		free(e);
+	}
+}
+
 /*
- * Helper for quicksort that lexicographically orders prefixes.
+ * Compiled audit database.
+ *
+ * Parsing the audit file, and vuln.xml even more so, is by far the most
+ * expensive part of an audit.  The parsed entries are therefore compiled
+ * into <audit file>.idx, which later runs mmap() as long as the source
+ * file has not changed.
+ *
+ * Entries are grouped by package name.  Names without globbing characters
+ * are sorted for a binary search, the few glob patterns are kept in a
+ * separate table matched with fnmatch().  Version ranges are stored with
+ * their operators already parsed.  All strings live in a string table at
+ * the end of the file and are referenced by offset, offset 0 meaning
+ * "none".
  */
-static int
-audit_entry_compare(const void *a, const void *b)
+#define AUDIT_IDX_MAGIC		"PKGAUDIX"
+#define AUDIT_IDX_VERSION	1
+
+struct audit_idx_header {
+	char		magic[8];
+	uint64_t	src_mtime;
+	uint64_t	src_size;
+	uint32_t	version;
+	uint32_t	nexact;
+	uint32_t	nglob;
+	uint32_t	nentries;
+	uint32_t	nranges;
+	uint32_t	ncves;
+	uint32_t	strtab_len;
+	uint32_t	pad;
+};
+
+struct audit_idx_name {
+	uint32_t	name;
+	uint32_t	first;		/* first entry */
+	uint32_t	count;		/* number of entries */
+};
+
+struct audit_idx_entry {
+	uint32_t	id;
+	uint32_t	desc;
+	uint32_t	url;
+	uint32_t	first_range;
+	uint32_t	nranges;
+	uint32_t	first_cve;
+	uint32_t	ncves;
+};
+
+struct audit_idx_range {
+	uint32_t	v1;
+	uint32_t	v2;
+	uint32_t	types;		/* v1 type | v2 type << 8 */
+};
+
+struct audit_index {
+	void				*base;
+	size_t				 len;
+	bool				 mapped;
+	const struct audit_idx_header	*hdr;
+	const struct audit_idx_name	*exact;
+	const struct audit_idx_name	*glob;
+	const struct audit_idx_entry	*entries;
+	const struct audit_idx_range	*ranges;
+	const uint32_t			*cves;
+	const char			*strtab;
+};
+
+struct audit_strtab {
+	char	*buf;
+	size_t	 len;
+	size_t	 cap;
+};
+
+static bool
+audit_is_glob(const char *name)
+{
+	return (name[str_noglob_len(name)] != '\0');
+}
+
+static uint32_t
+audit_strtab_add(struct audit_strtab *st, const char *str)
 {
-	const struct audit_entry_sorted *e1, *e2;
-	size_t min_len;
-	int result;
+	size_t len, off;
 
-	e1 = (const struct audit_entry_sorted *)a;
-	e2 = (const struct audit_entry_sorted *)b;
+	if (str == NULL)
+		return (0);
 
-	min_len = (e1->noglob_len < e2->noglob_len ?
-	    e1->noglob_len : e2->noglob_len);
-	result = strncmp(e1->e->pkgname, e2->e->pkgname, min_len);
-	/*
-	 * Additional check to see if some word is a prefix of an
-	 * another one and, thus, should go before the former.
-	 */
-	if (result == 0) {
-		if (e1->noglob_len < e2->noglob_len)
-			result = -1;
-		else if (e1->noglob_len > e2->noglob_len)
-			result = 1;
+	len = strlen(str) + 1;
+	if (st->len + len > st->cap) {
+		while (st->len + len > st->cap)
+			st->cap = st->cap ? st->cap * 2 : BUFSIZ;
+		if ((st->buf = realloc(st->buf, st->cap)) == NULL)
+			err(1, "realloc(audit_strtab)");
 	}
+	off = st->len;
+	memcpy(st->buf + off, str, len);
+	st->len += len;
 
-	return (result);
+	return (off);
 }
 
+struct audit_sorted {
+	struct audit_entry	*e;
+	size_t			 seq;	/* position in the audit file */
+};
+
 /*
- * Sorts VuXML entries and calculates increments to jump to the
- * next distinct prefix.
+ * Exact names first, then glob patterns, each sorted by name.  Entries of
+ * a same name keep the order of the audit file, so that a given file
+ * always compiles to the same index.
  */
-static struct audit_entry_sorted *
-preprocess_db(struct audit_entry *h)
+static int
+audit_entry_name_cmp(const void *a, const void *b)
 {
-	struct audit_entry *e;
-	struct audit_entry_sorted *ret;
-	size_t i, n, tofill;
+	const struct audit_sorted *s1 = a;
+	const struct audit_sorted *s2 = b;
+	bool g1, g2;
+	int ret;
 
-	n = 0;
-	LL_FOREACH(h, e)
-		n++;
+	g1 = audit_is_glob(s1->e->pkgname);
+	g2 = audit_is_glob(s2->e->pkgname);
+	if (g1 != g2)
+		return (g1 ? 1 : -1);
+
+	if ((ret = strcmp(s1->e->pkgname, s2->e->pkgname)) != 0)
+		return (ret);
 
-	ret = (struct audit_entry_sorted *)calloc(n + 1, sizeof(ret[0]));
-	if (ret == NULL)
-		err(1, "calloc(audit_entry_sorted*)");
-	bzero((void *)ret, (n + 1) * sizeof(ret[0]));
+	return (s1->seq < s2->seq ? -1 : s1->seq > s2->seq);
+}
 
-	n = 0;
+static void *
+audit_index_build(struct audit_entry *h, const struct stat *src, size_t *lenp)
+{
+	struct audit_sorted *sorted;
+	struct audit_entry *e;
+	struct audit_versions *vers;
+	struct audit_cve *cve;
+	struct audit_idx_header hdr;
+	struct audit_idx_name *names;
+	struct audit_idx_entry *entries;
+	struct audit_idx_range *ranges;
+	struct audit_strtab st = { NULL, 0, 0 };
+	uint32_t *cves;
+	size_t n, nnames, nglob, nranges, ncves, i, len;
+	char *buf, *p;
+
+	n = nranges = ncves = 0;
 	LL_FOREACH(h, e) {
-		ret[n].e = e;
-		ret[n].noglob_len = str_noglob_len(e->pkgname);
-		ret[n].next_pfx_incr = 1;
+		if (e->pkgname == NULL)
+			continue;
 		n++;
+		LL_FOREACH(e->versions, vers)
+			nranges++;
+		LL_FOREACH(e->cve, cve)
+			ncves++;
 	}
 
-	qsort(ret, n, sizeof(*ret), audit_entry_compare);
+	if ((sorted = calloc(n + 1, sizeof(*sorted))) == NULL ||
+	    (names = calloc(n + 1, sizeof(*names))) == NULL ||
+	    (entries = calloc(n + 1, sizeof(*entries))) == NULL ||
+	    (ranges = calloc(nranges + 1, sizeof(*ranges))) == NULL ||
+	    (cves = calloc(ncves + 1, sizeof(*cves))) == NULL)
+		err(1, "calloc(audit_index)");
 
-	/*
-	 * Determining jump indexes to the next different prefix.
-	 * Only non-1 increments are calculated there.
-	 *
-	 * Due to the current usage that picks only increment for the
-	 * first of the non-unique prefixes in a row, we could
-	 * calculate only that one and skip calculations for the
-	 * succeeding, but for the uniformity and clarity we're
-	 * calculating 'em all.
-	 */
-	for (n = 1, tofill = 0; ret[n].e; n++) {
-		if (ret[n - 1].noglob_len != ret[n].noglob_len) {
-			struct audit_entry_sorted *base;
-
-			base = ret + n - tofill;
-			for (i = 0; tofill > 1; i++, tofill--)
-				base[i].next_pfx_incr = tofill;
-			tofill = 1;
-		} else if (strcmp(ret[n - 1].e->pkgname,
-		    ret[n].e->pkgname) == 0) {
-			tofill++;
-		} else {
-			tofill = 1;
+	i = 0;
+	LL_FOREACH(h, e) {
+		if (e->pkgname != NULL) {
+			sorted[i].e = e;
+			sorted[i].seq = i;
+			i++;
 		}
 	}
+	qsort(sorted, n, sizeof(*sorted), audit_entry_name_cmp);
+
+	/* Offset 0 is the empty string */
+	audit_strtab_add(&st, "");
+
+	nnames = nglob = nranges = ncves = 0;
+	for (i = 0; i < n; i++) {
+		e = sorted[i].e;
+		if (i == 0 || strcmp(e->pkgname, sorted[i - 1].e->pkgname) != 0) {
+			names[nnames].name = audit_strtab_add(&st, e->pkgname);
+			names[nnames].first = i;
+			if (audit_is_glob(e->pkgname))
+				nglob++;
+			nnames++;
+		}
+		names[nnames - 1].count++;
+
+		entries[i].id = audit_strtab_add(&st, e->id);
+		entries[i].desc = audit_strtab_add(&st, e->desc);
+		entries[i].url = audit_strtab_add(&st, e->url);
+		entries[i].first_range = nranges;
+		LL_FOREACH(e->versions, vers) {
+			ranges[nranges].v1 = audit_strtab_add(&st,
+			    vers->v1.version);
+			ranges[nranges].v2 = audit_strtab_add(&st,
+			    vers->v2.version);
+			ranges[nranges].types = vers->v1.type |
+			    (vers->v2.type << 8);
+			nranges++;
+		}
+		entries[i].nranges = nranges - entries[i].first_range;
+		entries[i].first_cve = ncves;
+		LL_FOREACH(e->cve, cve)
+			cves[ncves++] = audit_strtab_add(&st, cve->cvename);
+		entries[i].ncves = ncves - entries[i].first_cve;
+	}
 
-	/* Calculate jump indexes for the first byte of the package name */
-	bzero(audit_entry_first_byte_idx, sizeof(audit_entry_first_byte_idx));
-	for (n = 1, i = 0; n < 256; n++) {
-		while (ret[i].e != NULL &&
-		    (size_t)(ret[i].e->pkgname[0]) < n)
-			i++;
-		audit_entry_first_byte_idx[n] = i;
+	/* Keep every table 4-byte aligned */
+	while (st.len % sizeof(uint32_t) != 0)
+		audit_strtab_add(&st, "");
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, AUDIT_IDX_MAGIC, sizeof(hdr.magic));
+	hdr.src_mtime = src->st_mtime;
+	hdr.src_size = src->st_size;
+	hdr.version = AUDIT_IDX_VERSION;
+	hdr.nexact = nnames - nglob;
+	hdr.nglob = nglob;
+	hdr.nentries = n;
+	hdr.nranges = nranges;
+	hdr.ncves = ncves;
+	hdr.strtab_len = st.len;
+
+	len = sizeof(hdr) + nnames * sizeof(*names) + n * sizeof(*entries) +
+	    nranges * sizeof(*ranges) + ncves * sizeof(*cves) + st.len;
+	if ((buf = malloc(len)) == NULL)
+		err(1, "malloc(audit_index)");
+
+	p = buf;
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	memcpy(p, names, nnames * sizeof(*names));
+	p += nnames * sizeof(*names);
+	memcpy(p, entries, n * sizeof(*entries));
+	p += n * sizeof(*entries);
+	memcpy(p, ranges, nranges * sizeof(*ranges));
+	p += nranges * sizeof(*ranges);
+	memcpy(p, cves, ncves * sizeof(*cves));
+	p += ncves * sizeof(*cves);
+	memcpy(p, st.buf, st.len);
+
+	free(sorted);
+	free(names);
+	free(entries);
+	free(ranges);
+	free(cves);
+	free(st.buf);
+
+	*lenp = len;
+	return (buf);
+}
+
+/*
+ * Write the index next to the audit file.  Failing to do so, e.g. when
+ * run by an unprivileged user, only means it will be compiled again.
+ */
+static void
+audit_index_save(const char *path, const void *buf, size_t len)
+{
+	char tmp[MAXPATHLEN];
+	const char *p = buf;
+	ssize_t w;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1)
+		return;
+
+	while (len > 0) {
+		if ((w = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		p += w;
+		len -= w;
 	}
 
-	return (ret);
+	if (len != 0 || fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH) == -1 ||
+	    close(fd) == -1 || rename(tmp, path) == -1) {
+		if (len != 0)
+			close(fd);
+		unlink(tmp);
+	}
+}
+
+/*
+ * The index may be truncated or corrupted: make sure every table slice and
+ * string offset it holds stays within the file before trusting it.
+ */
+static int
+audit_index_check(const struct audit_index *idx)
+{
+	const struct audit_idx_header *hdr = idx->hdr;
+	const struct audit_idx_name *n;
+	const struct audit_idx_entry *e;
+	const struct audit_idx_range *r;
+	uint32_t slen = hdr->strtab_len;
+	size_t i;
+
+	for (i = 0; i < (size_t)hdr->nexact + hdr->nglob; i++) {
+		n = &idx->exact[i];
+		if (n->name >= slen ||
+		    (uint64_t)n->first + n->count > hdr->nentries)
+			return (EPKG_FATAL);
+	}
+
+	for (i = 0; i < hdr->nentries; i++) {
+		e = &idx->entries[i];
+		if (e->id >= slen || e->desc >= slen || e->url >= slen ||
+		    (uint64_t)e->first_range + e->nranges > hdr->nranges ||
+		    (uint64_t)e->first_cve + e->ncves > hdr->ncves)
+			return (EPKG_FATAL);
+	}
+
+	for (i = 0; i < hdr->nranges; i++) {
+		r = &idx->ranges[i];
+		if (r->v1 >= slen || r->v2 >= slen)
+			return (EPKG_FATAL);
+	}
+
+	for (i = 0; i < hdr->ncves; i++)
+		if (idx->cves[i] >= slen)
+			return (EPKG_FATAL);
+
+	return (EPKG_OK);
+}
+
+static int
+audit_index_setup(struct audit_index *idx, const struct stat *src)
+{
+	const struct audit_idx_header *hdr = idx->base;
+	const char *p = idx->base;
+	size_t len;
+
+	if (idx->len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, AUDIT_IDX_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != AUDIT_IDX_VERSION ||
+	    hdr->src_mtime != (uint64_t)src->st_mtime ||
+	    hdr->src_size != (uint64_t)src->st_size)
+		return (EPKG_FATAL);
+
+	len = sizeof(*hdr) +
+	    ((size_t)hdr->nexact + hdr->nglob) * sizeof(struct audit_idx_name) +
+	    (size_t)hdr->nentries * sizeof(struct audit_idx_entry) +
+	    (size_t)hdr->nranges * sizeof(struct audit_idx_range) +
+	    (size_t)hdr->ncves * sizeof(uint32_t) + hdr->strtab_len;
+	if (len != idx->len || hdr->strtab_len == 0 ||
+	    p[idx->len - 1] != '\0')
+		return (EPKG_FATAL);
+
+	p += sizeof(*hdr);
+	idx->hdr = hdr;
+	idx->exact = (const struct audit_idx_name *)p;
+	idx->glob = idx->exact + hdr->nexact;
+	p += ((size_t)hdr->nexact + hdr->nglob) * sizeof(struct audit_idx_name);
+	idx->entries = (const struct audit_idx_entry *)p;
+	p += hdr->nentries * sizeof(struct audit_idx_entry);
+	idx->ranges = (const struct audit_idx_range *)p;
+	p += hdr->nranges * sizeof(struct audit_idx_range);
+	idx->cves = (const uint32_t *)p;
+	p += hdr->ncves * sizeof(uint32_t);
+	idx->strtab = p;
+
+	return (audit_index_check(idx));
+}
+
+static void
+audit_index_free(struct audit_index *idx)
+{
+	if (idx->base == NULL)
+		return;
+
+	if (idx->mapped)
+		munmap(idx->base, idx->len);
+	else
+		free(idx->base);
+	idx->base = NULL;
+}
+
+/*
+ * Load the compiled audit database, compiling it from the audit file
+ * first if it is missing or out of date.
+ */
+static int
+audit_index_load(struct audit_index *idx, const char *path, bool xml)
+{
+	struct audit_entry *h = NULL;
+	struct stat st, ist;
+	char idxpath[MAXPATHLEN];
+	void *base;
+	int fd, ret;
+
+	memset(idx, 0, sizeof(*idx));
+
+	if (stat(path, &st) == -1)
+		return (EPKG_FATAL);
+
+	snprintf(idxpath, sizeof(idxpath), "%s.idx", path);
+	if ((fd = open(idxpath, O_RDONLY)) != -1) {
+		if (fstat(fd, &ist) == 0 && ist.st_size > 0 &&
+		    (base = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED,
+		    fd, 0)) != MAP_FAILED) {
+			idx->base = base;
+			idx->len = ist.st_size;
+			idx->mapped = true;
+			if (audit_index_setup(idx, &st) == EPKG_OK) {
+				close(fd);
+				return (EPKG_OK);
+			}
+			audit_index_free(idx);
+		}
+		close(fd);
+	}
+
+	if (xml)
+		ret = parse_db_vulnxml(path, &h);
+	else
+		ret = parse_db_portaudit(path, &h);
+	if (ret != EPKG_OK)
+		return (ret);
+
+	idx->base = audit_index_build(h, &st, &idx->len);
+	idx->mapped = false;
+	free_audit_list(h);
+
+	audit_index_save(idxpath, idx->base, idx->len);
+
+	return (audit_index_setup(idx, &st));
+}
+
+static const char *
+audit_index_str(const struct audit_index *idx, uint32_t off)
+{
+	return (off == 0 ? NULL : idx->strtab + off);
+}
+
+static const struct audit_idx_name *
+audit_index_find(const struct audit_index *idx, const char *pkgname)
+{
+	size_t lo = 0, hi = idx->hdr->nexact, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(pkgname, idx->strtab + idx->exact[mid].name);
+		if (cmp == 0)
+			return (&idx->exact[mid]);
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return (NULL);
 }
 
 static bool
-match_version(const char *pkgversion, struct version_entry *v)
+match_version(const char *pkgversion, const char *version, int type)
 {
 	bool res = false;
 
@@ -708,154 +1063,281 @@ match_version(const char *pkgversion, struct version_entry *v)
 	 * Return true so it is easier for the caller to handle case where there is
 	 * only one version to match: the missing one will always match.
 	 */
-	if (v->version == NULL)
+	if (version == NULL)
 		return true;
 
-	switch (pkg_version_cmp(pkgversion, v->version)) {
+	switch (pkg_version_cmp(pkgversion, version)) {
 	case -1:
-		if (v->type == LT || v->type == LTE)
+		if (type == LT || type == LTE)
 			res = true;
 		break;
 	case 0:
-		if (v->type == EQ || v->type == LTE || v->type == GTE)
+		if (type == EQ || type == LTE || type == GTE)
 			res = true;
 		break;
 	case 1:
-		if (v->type == GT || v->type == GTE)
+		if (type == GT || type == GTE)
 			res = true;
 		break;
 	}
 	return res;
 }
 
+static void
+audit_report(const struct audit_index *idx, const struct audit_idx_entry *e,
+    const char *pkgname, const char *pkgversion)
+{
+	struct pkg_vulnerability v;
+	const char **cves;
+	uint32_t i;
+
+	if ((cves = calloc(e->ncves + 1, sizeof(*cves))) == NULL)
+		err(1, "calloc(cves)");
+	for (i = 0; i < e->ncves; i++)
+		cves[i] = audit_index_str(idx, idx->cves[e->first_cve + i]);
+
+	if (quiet) {
+		printf("%s-%s\n", pkgname, pkgversion);
+	} else {
+		printf("%s-%s is vulnerable:\n", pkgname, pkgversion);
+		printf("%s\n", audit_index_str(idx, e->desc));
+		for (i = 0; i < e->ncves; i++)
+			printf("CVE: %s\n", cves[i]);
+		if (e->url != 0)
+			printf("WWW: %s\n\n", audit_index_str(idx, e->url));
+		else if (e->id != 0)
+			printf("WWW: http://portaudit.FreeBSD.org/%s.html\n\n",
+			    audit_index_str(idx, e->id));
+	}
+
+	v.pkg_name = pkgname;
+	v.pkg_version = pkgversion;
+	v.id = audit_index_str(idx, e->id);
+	v.desc = audit_index_str(idx, e->desc);
+	v.url = audit_index_str(idx, e->url);
+	v.cves = cves;
+	v.ncves = e->ncves;
+	pkg_audit_report(&v);
+
+	free(cves);
+}
+
 static bool
-is_vulnerable(struct audit_entry_sorted *a, struct pkg *pkg)
+audit_check_entries(const struct audit_index *idx,
+    const struct audit_idx_name *n, const char *pkgname,
+    const char *pkgversion)
 {
-	struct audit_entry *e;
-	struct audit_versions *vers;
-	struct audit_cve *cve;
+	const struct audit_idx_entry *e;
+	const struct audit_idx_range *r;
+	uint32_t i, j;
+	bool res = false;
+
+	for (i = 0; i < n->count; i++) {
+		e = &idx->entries[n->first + i];
+		for (j = 0; j < e->nranges; j++) {
+			r = &idx->ranges[e->first_range + j];
+			if (!match_version(pkgversion,
+			    audit_index_str(idx, r->v1), r->types & 0xff) ||
+			    !match_version(pkgversion,
+			    audit_index_str(idx, r->v2), r->types >> 8))
+				continue;
+
+			res = true;
+			audit_report(idx, e, pkgname, pkgversion);
+			break;
+		}
+	}
+
+	return (res);
+}
+
+static bool
+is_vulnerable(const struct audit_index *idx, struct pkg *pkg)
+{
+	const struct audit_idx_name *n;
 	const char *pkgname;
 	const char *pkgversion;
-	bool res = false, res1, res2;
+	uint32_t i;
+	bool res = false;
 
 	pkg_get(pkg,
 		PKG_NAME, &pkgname,
 		PKG_VERSION, &pkgversion
 	);
 
-	a += audit_entry_first_byte_idx[(size_t)pkgname[0]];
-	for (; (e = a->e) != NULL; a += a->next_pfx_incr) {
-		int cmp;
-		size_t i;
-
-		/*
-		 * Audit entries are sorted, so if we had found one
-		 * that is lexicographically greater than our name,
-		 * it and the rest won't match our name.
-		 */
-		cmp = strncmp(pkgname, e->pkgname, a->noglob_len);
-		if (cmp > 0)
+	if ((n = audit_index_find(idx, pkgname)) != NULL &&
+	    audit_check_entries(idx, n, pkgname, pkgversion))
+		res = true;
+
+	for (i = 0; i < idx->hdr->nglob; i++) {
+		n = &idx->glob[i];
+		if (fnmatch(idx->strtab + n->name, pkgname, 0) != 0)
 			continue;
-		else if (cmp < 0)
-			break;
+		if (audit_check_entries(idx, n, pkgname, pkgversion))
+			res = true;
+	}
 
-		for (i = 0; i < a->next_pfx_incr; i++) {
-			e = a[i].e;
-			if (fnmatch(e->pkgname, pkgname, 0) != 0)
-				continue;
+	return (res);
+}
 
-			LL_FOREACH(e->versions, vers) {
-				res1 = match_version(pkgversion, &vers->v1);
-				res2 = match_version(pkgversion, &vers->v2);
-				if (res1 && res2) {
-					res = true;
-					if (quiet) {
-						printf("%s-%s\n", pkgname, pkgversion);
-					} else {
-						printf("%s-%s is vulnerable:\n", pkgname, pkgversion);
-						printf("%s\n", e->desc);
-						/* XXX: for vulnxml we should use more clever approach indeed */
-						if (e->cve) {
-							cve = e->cve;
-							while (cve) {
-								printf("CVE: %s\n", cve->cvename);
-								cve = cve->next;
-							}
-						}
-						if (e->url)
-							printf("WWW: %s\n\n", e->url);
-						else if (e->id)
-							printf("WWW: http://portaudit.FreeBSD.org/%s.html\n\n", e->id);
-					}
-					break;
-				}
-			}
-		}
-	}
+/*
+ * Auditing all installed packages at once.
+ *
+ * Both the installed packages and the exact names of the index are
+ * sorted, so they are merge-joined in a single pass.  A glob pattern can
+ * only match names starting with its literal prefix, which are found
+ * with a binary search; fnmatch() only runs on those.
+ */
+struct audit_pkg {
+	char	*name;
+	char	*version;
+	bool	 vulnerable;
+};
 
-	return res;
+struct audit_hit {
+	size_t				 pkg;
+	size_t				 seq;
+	const struct audit_idx_name	*n;
+};
+
+struct audit_hits {
+	struct audit_hit	*hits;
+	size_t			 len;
+	size_t			 cap;
+};
+
+static int
+audit_pkg_cmp(const void *a, const void *b)
+{
+	const struct audit_pkg *p1 = a, *p2 = b;
+
+	return (strcmp(p1->name, p2->name));
+}
+
+static int
+audit_hit_cmp(const void *a, const void *b)
+{
+	const struct audit_hit *h1 = a, *h2 = b;
+
+	if (h1->pkg != h2->pkg)
+		return (h1->pkg < h2->pkg ? -1 : 1);
+	return (h1->seq < h2->seq ? -1 : h1->seq > h2->seq);
 }
 
 static void
-free_audit_list(struct audit_entry *h)
+audit_hit_add(struct audit_hits *h, size_t pkg, const struct audit_idx_name *n)
 {
-	struct audit_entry *e;
-	struct audit_versions *vers, *vers_tmp;
-	struct audit_cve *cve, *cve_tmp;
+	if (h->len == h->cap) {
+		h->cap = h->cap ? h->cap * 2 : 64;
+		h->hits = realloc(h->hits, h->cap * sizeof(*h->hits));
+		if (h->hits == NULL)
+			err(1, "realloc(audit_hits)");
+	}
+	h->hits[h->len].pkg = pkg;
+	h->hits[h->len].seq = h->len;
+	h->hits[h->len].n = n;
+	h->len++;
+}
 
-	while (h) {
-		e = h;
-		h = h->next;
-		LL_FOREACH_SAFE(e->versions, vers, vers_tmp) {
-			if (vers->v1.version) {
-				free(vers->v1.version);
-			}
-			if (vers->v2.version) {
-				free(vers->v2.version);
-			}
-			free(vers);
-		}
-		LL_FOREACH_SAFE(e->cve, cve, cve_tmp) {
-			if (cve->cvename)
-				free(cve->cvename);
-			free(cve);
+static size_t
+audit_pkg_lower_bound(struct audit_pkg *pkgs, size_t npkgs,
+    const char *prefix, size_t len)
+{
+	size_t lo = 0, hi = npkgs, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strncmp(pkgs[mid].name, prefix, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+static unsigned int
+audit_all(const struct audit_index *idx, struct audit_pkg *pkgs, size_t npkgs)
+{
+	struct audit_hits h = { NULL, 0, 0 };
+	const char *pattern;
+	size_t i, j, len;
+	unsigned int vuln = 0;
+	int cmp;
+
+	qsort(pkgs, npkgs, sizeof(*pkgs), audit_pkg_cmp);
+
+	i = j = 0;
+	while (i < npkgs && j < idx->hdr->nexact) {
+		cmp = strcmp(pkgs[i].name, idx->strtab + idx->exact[j].name);
+		if (cmp < 0)
+			i++;
+		else if (cmp > 0)
+			j++;
+		else
+			audit_hit_add(&h, i++, &idx->exact[j]);
+	}
+
+	for (j = 0; j < idx->hdr->nglob; j++) {
+		pattern = idx->strtab + idx->glob[j].name;
+		len = str_noglob_len(pattern);
+		for (i = audit_pkg_lower_bound(pkgs, npkgs, pattern, len);
+		    i < npkgs && strncmp(pkgs[i].name, pattern, len) == 0; i++)
+			if (fnmatch(pattern, pkgs[i].name, 0) == 0)
+				audit_hit_add(&h, i, &idx->glob[j]);
+	}
+
+	/* Report per package, exact names before patterns */
+	qsort(h.hits, h.len, sizeof(*h.hits), audit_hit_cmp);
+	for (i = 0; i < h.len; i++) {
+		struct audit_pkg *p = &pkgs[h.hits[i].pkg];
+
+		if (audit_check_entries(idx, h.hits[i].n, p->name, p->version) &&
+		    !p->vulnerable) {
+			p->vulnerable = true;
+			vuln++;
 		}
-		if (e->url)
-			free(e->url);
-		if (e->desc)
-			free(e->desc);
-		if (e->id)
-			free(e->id);
-		free(e);
 	}
+
+	free(h.hits);
+
+	return (vuln);
 }
 
 int
 exec_audit(int argc, char **argv)
 {
-	struct audit_entry *h = NULL;
-	struct audit_entry_sorted *cooked_audit_entries = NULL;
+	struct audit_index idx;
 	struct pkgdb *db = NULL;
 	struct pkgdb_it *it = NULL;
 	struct pkg *pkg = NULL;
+	struct audit_pkg *pkgs = NULL;
+	size_t npkgs = 0, pkgs_cap = 0, i;
 	const char *db_dir;
+	const char *pkgname, *pkgversion;
 	char *name;
 	char *version;
 	char audit_file[MAXPATHLEN + 1];
 	unsigned int vuln = 0;
 	bool fetch = false;
 	bool xml = false;
+	bool all = false;
 	int ch;
 	int ret = EX_OK, res;
 	const char *portaudit_site = NULL;
 
+	memset(&idx, 0, sizeof(idx));
+
 	if (pkg_config_string(PKG_CONFIG_DBDIR, &db_dir) != EPKG_OK) {
 		warnx("PKG_DBIR is missing");
 		return (EX_CONFIG);
 	}
 
-	while ((ch = getopt(argc, argv, "qxF")) != -1) {
+	while ((ch = getopt(argc, argv, "aqxF")) != -1) {
 		switch (ch) {
+		case 'a':
+			all = true;
+			break;
 		case 'q':
 			quiet = true;
 			break;
@@ -896,7 +1378,7 @@ exec_audit(int argc, char **argv)
 		}
 	}
 
-	if (argc > 2) {
+	if (argc > 2 || (all && argc > 0)) {
 		usage_audit();
 		return (EX_USAGE);
 	}
@@ -913,10 +1395,7 @@ exec_audit(int argc, char **argv)
 		pkg_set(pkg,
 		    PKG_NAME, name,
 		    PKG_VERSION, version);
-		if (xml)
-			res = parse_db_vulnxml(audit_file, &h);
-		else
-			res = parse_db_portaudit(audit_file, &h);
+		res = audit_index_load(&idx, audit_file, xml);
 		if (res != EPKG_OK) {
 			if (errno == ENOENT)
 				warnx("unable to open %s file, try running 'pkg audit -F' first",
@@ -927,8 +1406,7 @@ exec_audit(int argc, char **argv)
 			ret = EX_DATAERR;
 			goto cleanup;
 		}
-		cooked_audit_entries = preprocess_db(h);
-		is_vulnerable(cooked_audit_entries, pkg);
+		is_vulnerable(&idx, pkg);
 		goto cleanup;
 	}
 
@@ -951,17 +1429,15 @@ exec_audit(int argc, char **argv)
 	if (pkgdb_open(&db, PKGDB_DEFAULT) != EPKG_OK)
 		return (EX_IOERR);
 
-	if ((it = pkgdb_query(db, NULL, MATCH_ALL)) == NULL)
+	if ((it = pkgdb_query_fields(db, NULL, MATCH_ALL,
+	    PKG_FIELD(PKG_VERSION))) == NULL)
 	{
 		warnx("cannot query local database");
 		ret = EX_IOERR;
 		goto cleanup;
 	}
 
-	if (xml)
-		res = parse_db_vulnxml(audit_file, &h);
-	else
-		res = parse_db_portaudit(audit_file, &h);
+	res = audit_index_load(&idx, audit_file, xml);
 	if (res != EPKG_OK) {
 		if (errno == ENOENT)
 			warnx("unable to open %s file, try running 'pkg audit -F' first",
@@ -972,11 +1448,21 @@ exec_audit(int argc, char **argv)
 		ret = EX_DATAERR;
 		goto cleanup;
 	}
-	cooked_audit_entries = preprocess_db(h);
+	while ((ret = pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC)) == EPKG_OK) {
+		if (npkgs == pkgs_cap) {
+			pkgs_cap = pkgs_cap ? pkgs_cap * 2 : 256;
+			pkgs = realloc(pkgs, pkgs_cap * sizeof(*pkgs));
+			if (pkgs == NULL)
+				err(1, "realloc(audit_pkg)");
+		}
+		pkg_get(pkg, PKG_NAME, &pkgname, PKG_VERSION, &pkgversion);
+		pkgs[npkgs].name = strdup(pkgname);
+		pkgs[npkgs].version = strdup(pkgversion);
+		pkgs[npkgs].vulnerable = false;
+		npkgs++;
+	}
 
-	while ((ret = pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC)) == EPKG_OK)
-		if (is_vulnerable(cooked_audit_entries, pkg))
-			vuln++;
+	vuln = audit_all(&idx, pkgs, npkgs);
 
 	if (ret == EPKG_END && vuln == 0)
 		ret = EX_OK;
@@ -988,7 +1474,12 @@ cleanup:
 	pkgdb_it_free(it);
 	pkgdb_close(db);
 	pkg_free(pkg);
-	free_audit_list(h);
+	audit_index_free(&idx);
+	for (i = 0; i < npkgs; i++) {
+		free(pkgs[i].name);
+		free(pkgs[i].version);
+	}
+	free(pkgs);
 
 	return (ret);
 }
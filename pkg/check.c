@@ -30,6 +30,7 @@
 
 #include <err.h>
 #include <assert.h>
+#include <getopt.h>
 #include <sysexits.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -55,6 +56,11 @@ static void add_missing_dep(struct pkg_dep *d, struct deps_head *dh, int *nbpkgs
 static void deps_free(struct deps_head *dh);
 static int fix_deps(struct pkgdb *db, struct deps_head *dh, int nbpkgs, bool yes);
 static void check_summary(struct pkgdb *db, struct deps_head *dh);
+static int check_files(struct pkgdb *db, struct pkg **batch, int nbatch,
+    bool checksums, bool recompute, bool reanalyse_shlibs, bool full);
+
+/* Packages whose files are checked at once, see pkg_check_files() */
+#define CHECK_BATCH	64
 
 static int
 check_deps(struct pkgdb *db, struct pkg *p, struct deps_head *dh, bool noinstall)
@@ -233,10 +239,46 @@ check_summary(struct pkgdb *db, struct deps_head *dh)
 	pkg_free(pkg);
 }
 
+/*
+ * Checksums and recomputation of a batch of packages share one pass over
+ * their files; shlibs are then reanalysed package after package.
+ */
+static int
+check_files(struct pkgdb *db, struct pkg **batch, int nbatch, bool checksums,
+    bool recompute, bool reanalyse_shlibs, bool full)
+{
+	const char *pkgname;
+	unsigned int flags = 0;
+	int rc = EX_OK;
+	int i;
+
+	if (checksums)
+		flags |= PKG_CHECK_FILESUM;
+	if (recompute)
+		flags |= PKG_CHECK_RECOMPUTE;
+	if (full)
+		flags |= PKG_CHECK_FULL;
+	if ((checksums || recompute) &&
+	    pkg_check_files(db, batch, nbatch, flags) != EPKG_OK)
+		rc = EX_DATAERR;
+
+	for (i = 0; i < nbatch; i++) {
+		if (reanalyse_shlibs &&
+		    pkgdb_reanalyse_shlibs(db, batch[i]) != EPKG_OK) {
+			pkg_get(batch[i], PKG_NAME, &pkgname);
+			printf("Failed to reanalyse for shlibs: %s\n", pkgname);
+			rc = EX_UNAVAILABLE;
+		}
+		pkg_free(batch[i]);
+	}
+
+	return (rc);
+}
+
 void
 usage_check(void)
 {
-	fprintf(stderr, "usage: pkg check [-Bdsr] [-vy] [-a | -gix <pattern>]\n\n");
+	fprintf(stderr, "usage: pkg check [-Bdsr] [-Fvy] [-a | -gix <pattern>]\n\n");
 	fprintf(stderr, "For more information see 'pkg help check'.\n");
 }
 
@@ -256,7 +298,10 @@ exec_check(int argc, char **argv)
 	bool recompute = false;
 	bool reanalyse_shlibs = false;
 	bool noinstall = false;
+	bool full = false;
 	int nbpkgs = 0;
+	struct pkg *batch[CHECK_BATCH];
+	int nbatch = 0;
 	int i;
 	int verbose = 0;
 
@@ -264,11 +309,20 @@ exec_check(int argc, char **argv)
 
 	struct deps_head dh = STAILQ_HEAD_INITIALIZER(dh);
 
-	while ((ch = getopt(argc, argv, "yagidnBxsrv")) != -1) {
+	struct option longopts[] = {
+		{ "full",	no_argument,	NULL,	'F' },
+		{ NULL,		0,		NULL,	0 },
+	};
+
+	while ((ch = getopt_long(argc, argv, "yagidnBFxsrv", longopts, NULL))
+	    != -1) {
 		switch (ch) {
 		case 'a':
 			match = MATCH_ALL;
 			break;
+		case 'F':
+			full = true;
+			break;
 		case 'B':
 			reanalyse_shlibs = true;
 			flags |= PKG_LOAD_FILES;
@@ -359,29 +413,32 @@ exec_check(int argc, char **argv)
 					rc = EX_UNAVAILABLE;
 				}
 			}
-			if (checksums) {
-				if (verbose)
-					printf("Checking checksums: %s\n", pkgname);
-				if (pkg_test_filesum(pkg) != EPKG_OK) {
-					rc = EX_DATAERR;
-				}
+			if (verbose && checksums)
+				printf("Checking checksums: %s\n", pkgname);
+			if (verbose && recompute)
+				printf("Recomputing size and checksums: %s\n", pkgname);
+			if (verbose && reanalyse_shlibs)
+				printf("Reanalyzing files for shlibs: %s\n", pkgname);
+			if (checksums || recompute || reanalyse_shlibs) {
+				/* the batch now owns the package */
+				batch[nbatch++] = pkg;
+				pkg = NULL;
 			}
-			if (recompute) {
-				if (verbose)
-					printf("Recomputing size and checksums: %s\n", pkgname);
-				if (pkg_recompute(db, pkg) != EPKG_OK) {
-					rc = EX_DATAERR;
-				}
-			}
-			if (reanalyse_shlibs) {
-				if (verbose)
-					printf("Reanalyzing files for shlibs: %s\n", pkgname);
-				if (pkgdb_reanalyse_shlibs(db, pkg) != EPKG_OK) {
-					printf("Failed to reanalyse for shlibs: %s\n", pkgname);
-					rc = EX_UNAVAILABLE;
-				}
+			if (nbatch == CHECK_BATCH) {
+				ret = check_files(db, batch, nbatch, checksums,
+				    recompute, reanalyse_shlibs, full);
+				if (ret != EX_OK)
+					rc = ret;
+				nbatch = 0;
 			}
 		}
+		if (nbatch > 0) {
+			ret = check_files(db, batch, nbatch, checksums,
+			    recompute, reanalyse_shlibs, full);
+			if (ret != EX_OK)
+				rc = ret;
+			nbatch = 0;
+		}
 
 		if (dcheck && nbpkgs > 0 && !noinstall) {
 			printf("\n>>> Missing package dependencies were detected.\n");
@@ -25,6 +25,7 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/queue.h>
 
@@ -33,9 +34,11 @@
 #include <fts.h>
 #include <pkg.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
+#include <uthash.h>
 
 #include "pkgcli.h"
 
@@ -55,6 +58,161 @@ struct deletion_list {
 
 STAILQ_HEAD(dl_head, deletion_list);
 
+/*
+ * What the repositories provide, read once from their packages tables so
+ * that most of the cached files can be told apart from their path and
+ * size without being opened
+ */
+struct repo_entry {
+	char		*name;
+	char		*origin;
+	char		*version;
+	char		*cksum;
+	char		*repopath;
+	int64_t		 pkgsize;
+	UT_hash_handle	 hh_path;
+	UT_hash_handle	 hh_name;
+	UT_hash_handle	 hh_origin;
+};
+
+struct repo_index {
+	struct repo_entry	*by_path;
+	struct repo_entry	*by_name;
+	struct repo_entry	*by_origin;
+};
+
+/* A cached file to hash before it can be kept */
+struct cksum_check {
+	char			*path;
+	struct repo_entry	*entry;
+};
+
+static const char *pkg_extensions[] = {
+	"txz", "tzst", "tbz", "tgz", "tar", NULL
+};
+
+static void
+repo_entry_free(struct repo_entry *e)
+{
+	free(e->name);
+	free(e->origin);
+	free(e->version);
+	free(e->cksum);
+	free(e->repopath);
+	free(e);
+}
+
+static void
+repo_index_free(struct repo_index *idx)
+{
+	struct repo_entry *e, *tmp;
+
+	HASH_CLEAR(hh_name, idx->by_name);
+	HASH_CLEAR(hh_origin, idx->by_origin);
+	HASH_ITER(hh_path, idx->by_path, e, tmp) {
+		HASH_DELETE(hh_path, idx->by_path, e);
+		repo_entry_free(e);
+	}
+}
+
+static int
+repo_index_load(struct pkgdb *db, struct repo_index *idx)
+{
+	struct pkgdb_it		*it;
+	struct pkg		*p = NULL;
+	struct repo_entry	*e, *found;
+	const char		*name, *origin, *version, *cksum, *repopath;
+	int64_t			 pkgsize;
+	int			 ret;
+
+	it = pkgdb_rquery_fields(db, NULL, MATCH_ALL, NULL,
+	    PKG_FIELD(PKG_VERSION) | PKG_FIELD(PKG_CKSUM) |
+	    PKG_FIELD(PKG_PKGSIZE) | PKG_FIELD(PKG_REPOPATH));
+	if (it == NULL)
+		return (EPKG_FATAL);
+
+	while ((ret = pkgdb_it_next(it, &p, PKG_LOAD_BASIC)) == EPKG_OK) {
+		pkg_get(p, PKG_NAME, &name, PKG_ORIGIN, &origin,
+		    PKG_VERSION, &version, PKG_CKSUM, &cksum,
+		    PKG_REPOPATH, &repopath, PKG_PKGSIZE, &pkgsize);
+		if (repopath == NULL)
+			continue;
+
+		/* the same file offered by several repositories */
+		HASH_FIND(hh_path, idx->by_path, repopath, strlen(repopath),
+		    found);
+		if (found != NULL)
+			continue;
+
+		if ((e = calloc(1, sizeof(*e))) == NULL ||
+		    (e->name = strdup(name)) == NULL ||
+		    (e->origin = strdup(origin)) == NULL ||
+		    (e->version = strdup(version)) == NULL ||
+		    (e->cksum = strdup(cksum != NULL ? cksum : "")) == NULL ||
+		    (e->repopath = strdup(repopath)) == NULL) {
+			warn("loading the repositories");
+			if (e != NULL)
+				repo_entry_free(e);
+			ret = EPKG_FATAL;
+			break;
+		}
+		e->pkgsize = pkgsize;
+
+		HASH_ADD_KEYPTR(hh_path, idx->by_path, e->repopath,
+		    strlen(e->repopath), e);
+
+		/* sorted newest first: keep the first entry of each */
+		HASH_FIND(hh_name, idx->by_name, e->name, strlen(e->name),
+		    found);
+		if (found == NULL)
+			HASH_ADD_KEYPTR(hh_name, idx->by_name, e->name,
+			    strlen(e->name), e);
+		HASH_FIND(hh_origin, idx->by_origin, e->origin,
+		    strlen(e->origin), found);
+		if (found == NULL)
+			HASH_ADD_KEYPTR(hh_origin, idx->by_origin, e->origin,
+			    strlen(e->origin), e);
+	}
+
+	pkg_free(p);
+	pkgdb_it_free(it);
+
+	return (ret == EPKG_END ? EPKG_OK : ret);
+}
+
+/*
+ * Package name of a cached file, from its <name>-<version>.<ext> file
+ * name, false when it does not look like a package
+ */
+static bool
+name_from_path(const char *path, char *name, size_t len)
+{
+	const char	*base, *ext, *dash;
+	int		 i;
+
+	if ((base = strrchr(path, '/')) != NULL)
+		base++;
+	else
+		base = path;
+
+	if ((ext = strrchr(base, '.')) == NULL)
+		return (false);
+	for (i = 0; pkg_extensions[i] != NULL; i++)
+		if (strcmp(ext + 1, pkg_extensions[i]) == 0)
+			break;
+	if (pkg_extensions[i] == NULL)
+		return (false);
+
+	for (dash = ext - 1; dash > base && *dash != '-'; dash--)
+		;
+	if (dash == base || (size_t)(dash - base) >= len)
+		return (false);
+
+	strlcpy(name, base, dash - base + 1);
+
+	return (true);
+}
+
 static int
 add_to_dellist(struct dl_head *dl,  unsigned reason, const char *path,
 	       const char *origin, const char *newname, const char *newversion)
@@ -208,25 +366,47 @@ usage_clean(void)
 	fprintf(stderr, "For more information see 'pkg help clean'.\n");
 }
 
+/*
+ * Origin of a cached file nothing in the repositories is named after: the
+ * archive has to be opened
+ */
+static int
+origin_from_archive(const char *path, struct pkg **pkg,
+    struct pkg_manifest_key *keys, const char **origin)
+{
+	if (pkg_open(pkg, path, keys, PKG_OPEN_MANIFEST_ONLY) != EPKG_OK)
+		return (EPKG_FATAL);
+	pkg_get(*pkg, PKG_ORIGIN, origin);
+
+	return (EPKG_OK);
+}
+
 int
 exec_clean(int argc, char **argv)
 {
 	struct pkgdb	*db = NULL;
-	struct pkgdb_it	*it = NULL;
 	struct pkg	*pkg = NULL;
-	struct pkg	*p = NULL;
 	FTS		*fts = NULL;
 	FTSENT		*ent = NULL;
 	struct dl_head	dl = STAILQ_HEAD_INITIALIZER(dl);
+	struct repo_index idx = { NULL, NULL, NULL };
+	struct repo_entry *e;
+	struct cksum_check *checks = NULL;
+	const char	**checkpaths = NULL;
+	char		(*sums)[SHA256_DIGEST_LENGTH * 2 + 1] = NULL;
 	const char	*cachedir;
+	const char	*origin;
 	char		*paths[2];
 	char		*repopath;
+	char		 name[MAXPATHLEN];
 	bool		 all = false;
 	bool		 dry_run = false;
 	bool		 yes;
+	int		 nchecks = 0, checkscap = 0;
 	int		 retcode;
 	int		 ret;
 	int		 ch;
+	int		 i;
 	struct pkg_manifest_key *keys = NULL;
 
 	pkg_config_bool(PKG_CONFIG_ASSUME_ALWAYS_YES, &yes);
@@ -280,6 +460,9 @@ exec_clean(int argc, char **argv)
 		goto cleanup;
 	}
 
+	if (repo_index_load(db, &idx) != EPKG_OK)
+		goto cleanup;
+
 	if ((fts = fts_open(paths, FTS_PHYSICAL, NULL)) == NULL) {
 		warn("fts_open(%s)", cachedir);
 		goto cleanup;
@@ -289,8 +472,6 @@ exec_clean(int argc, char **argv)
 
 	pkg_manifest_keys_new(&keys);
 	while ((ent = fts_read(fts)) != NULL) {
-		const char *origin, *pkgrepopath;
-
 		if (ent->fts_info != FTS_F)
 			continue;
 
@@ -298,76 +479,105 @@ exec_clean(int argc, char **argv)
 		if (repopath[0] == '/')
 			repopath++;
 
-		if (pkg_open(&pkg, ent->fts_path, keys, PKG_OPEN_MANIFEST_ONLY) != EPKG_OK) {
-			if (!quiet)
-				warnx("skipping %s", ent->fts_path);
-			continue;
-		}
-
-		pkg_get(pkg, PKG_ORIGIN, &origin);
-		it = pkgdb_search(db, origin, MATCH_EXACT, FIELD_ORIGIN,
-		    FIELD_NONE, NULL);
-
-		if (it == NULL) {
-			if (!quiet)
-				warnx("skipping %s", ent->fts_path);
-			continue;
-		}
+		HASH_FIND(hh_path, idx.by_path, repopath, strlen(repopath), e);
+		if (e == NULL && name_from_path(repopath, name, sizeof(name)))
+			HASH_FIND(hh_name, idx.by_name, name, strlen(name), e);
 
 		if (all) {
+			if (e != NULL)
+				origin = e->origin;
+			else if (origin_from_archive(ent->fts_path, &pkg, keys,
+			    &origin) != EPKG_OK) {
+				if (!quiet)
+					warnx("skipping %s", ent->fts_path);
+				continue;
+			}
 			ret = add_to_dellist(&dl, ALL, ent->fts_path,
 					     origin, NULL, NULL);
-			pkgdb_it_free(it);
-			continue;
-		}
-
-		ret = pkgdb_it_next(it, &p, PKG_LOAD_BASIC);
-		if (ret == EPKG_FATAL) {
-			if (!quiet)
-				warnx("skipping %s", ent->fts_path);
-			continue;
-		}
-
-		if (ret == EPKG_END) {
-			/* No matching package found in repo */
-			ret = add_to_dellist(&dl, REMOVED, ent->fts_path,
-					     origin, NULL, NULL);
-			continue;
-		}
-
-		pkg_get(p, PKG_REPOPATH, &pkgrepopath);
-
-		if (strcmp(repopath, pkgrepopath)) {
-			const char	*newname;
-			const char	*newversion;
-
-			pkg_get(p,
-				PKG_NAME,    &newname,
-				PKG_VERSION, &newversion);
-
+		} else if (e != NULL && strcmp(repopath, e->repopath) == 0) {
+			/* a differing size settles it without reading */
+			if (e->pkgsize > 0 && ent->fts_statp->st_size != e->pkgsize) {
+				ret = add_to_dellist(&dl, CKSUM_MISMATCH,
+				    ent->fts_path, e->origin, NULL, NULL);
+			} else {
+				if (nchecks == checkscap) {
+					struct cksum_check *n;
+
+					checkscap = checkscap == 0 ? 64 :
+					    checkscap * 2;
+					n = realloc(checks, checkscap *
+					    sizeof(*checks));
+					if (n == NULL) {
+						retcode = EX_OSERR;
+						goto cleanup;
+					}
+					checks = n;
+				}
+				if ((checks[nchecks].path =
+				    strdup(ent->fts_path)) == NULL) {
+					retcode = EX_OSERR;
+					goto cleanup;
+				}
+				checks[nchecks++].entry = e;
+				ret = EPKG_OK;
+			}
+		} else if (e != NULL) {
 			ret = add_to_dellist(&dl, OUT_OF_DATE, ent->fts_path,
-					     origin, newname, newversion);
+			    e->origin, e->name, e->version);
 		} else {
-			char local_cksum[SHA256_DIGEST_LENGTH * 2 + 1];
-			const char *cksum;
-
-			pkg_get(p, PKG_CKSUM, &cksum);
-
-			if (hash_file(ent->fts_path, local_cksum) == EPKG_OK) {
-
-				if (strcmp(cksum, local_cksum) != 0) {
-					ret = add_to_dellist(&dl, CKSUM_MISMATCH, ent->fts_path,
-							     origin, NULL, NULL);
-				}
+			if (origin_from_archive(ent->fts_path, &pkg, keys,
+			    &origin) != EPKG_OK) {
+				if (!quiet)
+					warnx("skipping %s", ent->fts_path);
+				continue;
 			}
+
+			/*
+			 * Nothing is named like it any more, but the port may
+			 * have been renamed: only removed if its origin is
+			 * gone too
+			 */
+			HASH_FIND(hh_origin, idx.by_origin, origin,
+			    strlen(origin), e);
+			if (e == NULL)
+				/* No matching package found in repo */
+				ret = add_to_dellist(&dl, REMOVED,
+				    ent->fts_path, origin, NULL, NULL);
+			else
+				ret = add_to_dellist(&dl, OUT_OF_DATE,
+				    ent->fts_path, origin, e->name, e->version);
 		}
 
-		if (ret != EPKG_OK && ret != EPKG_END) {
+		if (ret != EPKG_OK) {
 			retcode = EX_OSERR; /* out of memory */
 			goto cleanup;
 		}
+	}
 
-		pkgdb_it_free(it);
+	/* Only the files matching their repository entry are read */
+	if (nchecks > 0) {
+		checkpaths = calloc(nchecks, sizeof(*checkpaths));
+		sums = calloc(nchecks, sizeof(*sums));
+		if (checkpaths == NULL || sums == NULL) {
+			retcode = EX_OSERR;
+			goto cleanup;
+		}
+		for (i = 0; i < nchecks; i++)
+			checkpaths[i] = checks[i].path;
+
+		/* unreadable files are reported and kept */
+		pkg_sha256_files(checkpaths, nchecks, sums);
+
+		for (i = 0; i < nchecks; i++) {
+			if (sums[i][0] == '\0' ||
+			    strcmp(sums[i], checks[i].entry->cksum) == 0)
+				continue;
+			if (add_to_dellist(&dl, CKSUM_MISMATCH, checks[i].path,
+			    checks[i].entry->origin, NULL, NULL) != EPKG_OK) {
+				retcode = EX_OSERR;
+				goto cleanup;
+			}
+		}
 	}
 
 	if (STAILQ_EMPTY(&dl)) {
@@ -393,8 +603,14 @@ cleanup:
 	pkg_manifest_keys_free(keys);
 	free_dellist(&dl);
 
+	for (i = 0; i < nchecks; i++)
+		free(checks[i].path);
+	free(checks);
+	free(checkpaths);
+	free(sums);
+	repo_index_free(&idx);
+
 	pkg_free(pkg);
-	pkg_free(p);
 	if (fts != NULL)
 		fts_close(fts);
 	if (db != NULL)
@@ -89,6 +89,9 @@ pkg_create_matches(int argc, char **argv, match_t match, pkg_formats fmt,
 	}
 
 	switch (fmt) {
+	case TZST:
+		format = "tzst";
+		break;
 	case TXZ:
 		format = "txz";
 		break;
@@ -96,6 +99,7 @@ pkg_create_matches(int argc, char **argv, match_t match, pkg_formats fmt,
 		format = "tbz";
 		break;
 	case TGZ:
+	case STGZ:
 		format = "tgz";
 		break;
 	case TAR:
@@ -167,7 +171,7 @@ cleanup:
  * -g: globbing
  * -r: rootdir for the package
  * -m: path to dir where to find the metadata
- * -f <format>: format could be txz, tgz, tbz or tar
+ * -f <format>: format could be tzst, txz, tgz, stgz, tbz or tar
  * -o: output directory where to create packages by default ./ is used
  */
 
@@ -238,12 +242,16 @@ exec_create(int argc, char **argv)
 	} else {
 		if (format[0] == '.')
 			++format;
-		if (strcmp(format, "txz") == 0)
+		if (strcmp(format, "tzst") == 0)
+			fmt = TZST;
+		else if (strcmp(format, "txz") == 0)
 			fmt = TXZ;
 		else if (strcmp(format, "tbz") == 0)
 			fmt = TBZ;
 		else if (strcmp(format, "tgz") == 0)
 			fmt = TGZ;
+		else if (strcmp(format, "stgz") == 0)
+			fmt = STGZ;
 		else if (strcmp(format, "tar") == 0)
 			fmt = TAR;
 		else {
@@ -85,6 +85,7 @@ static struct commands {
 	{ "repo", "Creates a package repository catalogue", exec_repo, usage_repo},
 	{ "rquery", "Queries information in repository catalogues", exec_rquery, usage_rquery},
 	{ "search", "Performs a search of package repository catalogues", exec_search, usage_search},
+	{ "serve", "Serves queries from a long running process", exec_serve, usage_serve},
 	{ "set", "Modifies information about packages in the local database", exec_set, usage_set},
 	{ "ssh", "ssh packages to be used via ssh", exec_ssh, usage_ssh},
 	{ "shell", "Opens a debug shell", exec_shell, usage_shell},
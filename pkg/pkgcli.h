@@ -101,6 +101,13 @@ void usage_repo(void);
 int exec_rquery(int, char **);
 void usage_rquery(void);
 
+/* pkg serve */
+int exec_serve(int, char **);
+void usage_serve(void);
+int serve_query(const char *kind, match_t match, bool case_sensitive,
+    const char *reponame, const char *condition, char *qstr, int npatterns,
+    char **patterns, int *retcode);
+
 /* pkg set */
 int exec_set(int, char **);
 void usage_set(void);
@@ -234,8 +241,6 @@ int info_flags(unsigned int opt, bool remote);
 void print_info(struct pkg * const pkg, unsigned int opt);
 char *absolutepath(const char *src, char *dest, size_t dest_len);
 void print_jobs_summary(struct pkg_jobs *j, const char *msg, ...);
-struct sbuf *exec_buf(const char *cmd);
-int hash_file(const char *, char[SHA256_DIGEST_LENGTH * 2 +1]);
 
 int event_callback(void *data, struct pkg_event *ev);
 
@@ -248,13 +253,23 @@ struct query_flags {
 	const char *options;
 	const unsigned multiline;
 	const int dbflags;
+	const uint64_t fields;
 };
 
-void print_query(struct pkg *pkg, char *qstr, char multiline);
+extern struct query_flags accepted_query_flags[];
+extern const unsigned int accepted_query_flags_len;
+extern struct query_flags accepted_rquery_flags[];
+extern const unsigned int accepted_rquery_flags_len;
+
+struct query_format;
+struct query_format *compile_query(const char *qstr, char multiline);
+void free_query(struct query_format *q);
+void print_query(struct pkg *pkg, struct query_format *q);
+void format_query(struct sbuf *out, struct pkg *pkg, struct query_format *q);
 int format_sql_condition(const char *str, struct sbuf *sqlcond,
 			 bool for_remote);
 int analyse_query_string(char *qstr, struct query_flags *q_flags,
 			 const unsigned int q_flags_len, int *flags,
-			 char *multiline);
+			 uint64_t *fields, char *multiline);
 
 #endif
@@ -42,417 +42,452 @@
 
 #include "pkgcli.h"
 
-static struct query_flags accepted_query_flags[] = {
-	{ 'd', "nov",		1, PKG_LOAD_DEPS },
-	{ 'r', "nov",		1, PKG_LOAD_RDEPS },
-	{ 'C', "",		1, PKG_LOAD_CATEGORIES },
-	{ 'F', "ps",		1, PKG_LOAD_FILES },
-	{ 'O', "kv",		1, PKG_LOAD_OPTIONS },
-	{ 'D', "",		1, PKG_LOAD_DIRS },
-	{ 'L', "",		1, PKG_LOAD_LICENSES },
-	{ 'U', "",		1, PKG_LOAD_USERS },
-	{ 'G', "",		1, PKG_LOAD_GROUPS },
-	{ 'B', "",		1, PKG_LOAD_SHLIBS_REQUIRED },
-	{ 'b', "",		1, PKG_LOAD_SHLIBS_PROVIDED },
-	{ 'A', "tv",            1, PKG_LOAD_ANNOTATIONS },
-	{ '?', "drCFODLUGBbA",	1, PKG_LOAD_BASIC },	/* dbflags handled in analyse_query_string() */
-	{ '#', "drCFODLUGBbA",	1, PKG_LOAD_BASIC },	/* dbflags handled in analyse_query_string() */
-	{ 's', "hb",		0, PKG_LOAD_BASIC },
-	{ 'n', "",		0, PKG_LOAD_BASIC },
-	{ 'v', "",		0, PKG_LOAD_BASIC },
-	{ 'o', "",		0, PKG_LOAD_BASIC },
-	{ 'p', "",		0, PKG_LOAD_BASIC },
-	{ 'm', "",		0, PKG_LOAD_BASIC },
-	{ 'c', "",		0, PKG_LOAD_BASIC },
-	{ 'e', "",		0, PKG_LOAD_BASIC },
-	{ 'w', "",		0, PKG_LOAD_BASIC },
-	{ 'l', "",		0, PKG_LOAD_BASIC },
-	{ 'a', "",		0, PKG_LOAD_BASIC },
-	{ 'k', "",		0, PKG_LOAD_BASIC },
-	{ 'M', "",		0, PKG_LOAD_BASIC },
-	{ 'i', "",		0, PKG_LOAD_BASIC },
-	{ 't', "",		0, PKG_LOAD_BASIC }
+struct query_flags accepted_query_flags[] = {
+	{ 'd', "nov",		1, PKG_LOAD_DEPS, 0 },
+	{ 'r', "nov",		1, PKG_LOAD_RDEPS, 0 },
+	{ 'C', "",		1, PKG_LOAD_CATEGORIES, 0 },
+	{ 'F', "ps",		1, PKG_LOAD_FILES, 0 },
+	{ 'O', "kv",		1, PKG_LOAD_OPTIONS, 0 },
+	{ 'D', "",		1, PKG_LOAD_DIRS, 0 },
+	{ 'L', "",		1, PKG_LOAD_LICENSES, 0 },
+	{ 'U', "",		1, PKG_LOAD_USERS, 0 },
+	{ 'G', "",		1, PKG_LOAD_GROUPS, 0 },
+	{ 'B', "",		1, PKG_LOAD_SHLIBS_REQUIRED, 0 },
+	{ 'b', "",		1, PKG_LOAD_SHLIBS_PROVIDED, 0 },
+	{ 'A', "tv",            1, PKG_LOAD_ANNOTATIONS, 0 },
+	{ '?', "drCFODLUGBbA",	1, PKG_LOAD_BASIC, 0 },	/* dbflags handled in analyse_query_string() */
+	{ '#', "drCFODLUGBbA",	1, PKG_LOAD_BASIC, 0 },	/* dbflags handled in analyse_query_string() */
+	{ 's', "hb",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_FLATSIZE) },
+	{ 'n', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_NAME) },
+	{ 'v', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_VERSION) },
+	{ 'o', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_ORIGIN) },
+	{ 'p', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_PREFIX) },
+	{ 'm', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_MAINTAINER) },
+	{ 'c', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_COMMENT) },
+	{ 'e', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_DESC) },
+	{ 'w', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_WWW) },
+	{ 'l', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_LICENSE_LOGIC) },
+	{ 'a', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_AUTOMATIC) },
+	{ 'k', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_LOCKED) },
+	{ 'M', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_MESSAGE) },
+	{ 'i', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_INFOS) },
+	{ 't', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_TIME) }
 };
 
+const unsigned int accepted_query_flags_len =
+    sizeof(accepted_query_flags) / sizeof(accepted_query_flags[0]);
+
+/*
+ * Query formats are compiled once into a list of operations, run for
+ * each package: literal text, package attributes, list counters and, for
+ * the multiline list, fields of the current element.
+ */
+typedef enum {
+	QOP_LITERAL,
+	QOP_STRING,
+	QOP_BOOL,
+	QOP_INT64,
+	QOP_FLATSIZE_HUMAN,
+	QOP_LICENSE_LOGIC,
+	QOP_HAS,
+	QOP_COUNT,
+	QOP_ITEM,
+} query_op_t;
+
+struct query_op {
+	query_op_t	  type;
+	int		  attr;
+	const char	*(*item)(void *);
+	char		 *lit;
+	size_t		  len;
+};
+
+struct query_format {
+	int		(*next)(struct pkg *, void **);
+	struct query_op	 *ops;
+	int		  nops;
+	struct sbuf	 *line;
+};
+
+static const char *item_dep_name(void *d) { return (pkg_dep_name(d)); }
+static const char *item_dep_origin(void *d) { return (pkg_dep_origin(d)); }
+static const char *item_dep_version(void *d) { return (pkg_dep_version(d)); }
+static const char *item_category(void *d) { return (pkg_category_name(d)); }
+static const char *item_file_path(void *d) { return (pkg_file_path(d)); }
+static const char *item_file_cksum(void *d) { return (pkg_file_cksum(d)); }
+static const char *item_option_key(void *d) { return (pkg_option_opt(d)); }
+static const char *item_option_value(void *d) { return (pkg_option_value(d)); }
+static const char *item_dir(void *d) { return (pkg_dir_path(d)); }
+static const char *item_license(void *d) { return (pkg_license_name(d)); }
+static const char *item_user(void *d) { return (pkg_user_name(d)); }
+static const char *item_group(void *d) { return (pkg_group_name(d)); }
+static const char *item_shlib(void *d) { return (pkg_shlib_name(d)); }
+static const char *item_note_tag(void *d) { return (pkg_annotation_tag(d)); }
+static const char *item_note_value(void *d) { return (pkg_annotation_value(d)); }
+
+static int next_dep(struct pkg *p, void **d) { return (pkg_deps(p, (struct pkg_dep **)d)); }
+static int next_rdep(struct pkg *p, void **d) { return (pkg_rdeps(p, (struct pkg_dep **)d)); }
+static int next_category(struct pkg *p, void **d) { return (pkg_categories(p, (struct pkg_category **)d)); }
+static int next_option(struct pkg *p, void **d) { return (pkg_options(p, (struct pkg_option **)d)); }
+static int next_file(struct pkg *p, void **d) { return (pkg_files(p, (struct pkg_file **)d)); }
+static int next_dir(struct pkg *p, void **d) { return (pkg_dirs(p, (struct pkg_dir **)d)); }
+static int next_license(struct pkg *p, void **d) { return (pkg_licenses(p, (struct pkg_license **)d)); }
+static int next_user(struct pkg *p, void **d) { return (pkg_users(p, (struct pkg_user **)d)); }
+static int next_group(struct pkg *p, void **d) { return (pkg_groups(p, (struct pkg_group **)d)); }
+static int next_shlib_required(struct pkg *p, void **d) { return (pkg_shlibs_required(p, (struct pkg_shlib **)d)); }
+static int next_shlib_provided(struct pkg *p, void **d) { return (pkg_shlibs_provided(p, (struct pkg_shlib **)d)); }
+static int next_note(struct pkg *p, void **d) { return (pkg_annotations(p, (struct pkg_note **)d)); }
+
+static const struct {
+	char	  flag;
+	int	  list;
+	int	(*next)(struct pkg *, void **);
+} query_lists[] = {
+	{ 'd', PKG_DEPS,		next_dep },
+	{ 'r', PKG_RDEPS,		next_rdep },
+	{ 'C', PKG_CATEGORIES,		next_category },
+	{ 'F', PKG_FILES,		next_file },
+	{ 'O', PKG_OPTIONS,		next_option },
+	{ 'D', PKG_DIRS,		next_dir },
+	{ 'L', PKG_LICENSES,		next_license },
+	{ 'U', PKG_USERS,		next_user },
+	{ 'G', PKG_GROUPS,		next_group },
+	{ 'B', PKG_SHLIBS_REQUIRED,	next_shlib_required },
+	{ 'b', PKG_SHLIBS_PROVIDED,	next_shlib_provided },
+	{ 'A', PKG_ANNOTATIONS,		next_note },
+	{ 0, 0, NULL }
+};
+
+static const struct {
+	char	  flag;
+	char	  opt;
+	const char *(*item)(void *);
+} query_items[] = {
+	{ 'd', 'n', item_dep_name },
+	{ 'd', 'o', item_dep_origin },
+	{ 'd', 'v', item_dep_version },
+	{ 'r', 'n', item_dep_name },
+	{ 'r', 'o', item_dep_origin },
+	{ 'r', 'v', item_dep_version },
+	{ 'C', 0,   item_category },
+	{ 'F', 'p', item_file_path },
+	{ 'F', 's', item_file_cksum },
+	{ 'O', 'k', item_option_key },
+	{ 'O', 'v', item_option_value },
+	{ 'D', 0,   item_dir },
+	{ 'L', 0,   item_license },
+	{ 'U', 0,   item_user },
+	{ 'G', 0,   item_group },
+	{ 'B', 0,   item_shlib },
+	{ 'b', 0,   item_shlib },
+	{ 'A', 't', item_note_tag },
+	{ 'A', 'v', item_note_value },
+	{ 0, 0, NULL }
+};
+
+static struct query_op *
+query_op_new(struct query_format *q, query_op_t type, int attr)
+{
+	struct query_op *op;
+
+	q->ops = realloc(q->ops, (q->nops + 1) * sizeof(struct query_op));
+	if (q->ops == NULL)
+		err(1, "realloc");
+	op = &q->ops[q->nops++];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	op->attr = attr;
+
+	return (op);
+}
+
 static void
-format_str(struct pkg *pkg, struct sbuf *dest, const char *qstr, void *data)
+query_lit_flush(struct query_format *q, struct sbuf *lit)
 {
-	char size[7];
-	const char *tmp;
-	bool tmp2;
-	int64_t flatsize;
-	int64_t timestamp;
-	lic_t licenselogic;
+	struct query_op *op;
 
-	sbuf_clear(dest);
+	sbuf_finish(lit);
+	if (sbuf_len(lit) == 0)
+		return;
+	op = query_op_new(q, QOP_LITERAL, 0);
+	op->len = sbuf_len(lit);
+	if ((op->lit = strdup(sbuf_data(lit))) == NULL)
+		err(1, "strdup");
+	sbuf_clear(lit);
+}
 
-	while (qstr[0] != '\0') {
-		if (qstr[0] == '%') {
-			qstr++;
-			switch (qstr[0]) {
+static int
+query_list(char flag)
+{
+	int i;
+
+	for (i = 0; query_lists[i].flag != 0; i++)
+		if (query_lists[i].flag == flag)
+			return (i);
+	return (-1);
+}
+
+/*
+ * Compile a query string already checked by analyse_query_string().
+ */
+struct query_format *
+compile_query(const char *qstr, char multiline)
+{
+	struct query_format *q;
+	struct query_op *op;
+	struct sbuf *lit;
+	int i;
+
+	if ((q = calloc(1, sizeof(struct query_format))) == NULL)
+		err(1, "calloc");
+	q->line = sbuf_new_auto();
+	lit = sbuf_new_auto();
+
+	if ((i = query_list(multiline)) >= 0)
+		q->next = query_lists[i].next;
+
+	for (; qstr[0] != '\0'; qstr++) {
+		if (qstr[0] == '\\') {
+			switch (qstr[1]) {
 			case 'n':
-				pkg_get(pkg, PKG_NAME, &tmp);
-				if (tmp != NULL)
-					sbuf_cat(dest, tmp);
-				break;
-			case 'v':
-				pkg_get(pkg, PKG_VERSION, &tmp);
-				if (tmp != NULL)
-					sbuf_cat(dest, tmp);
-				break;
-			case 'o':
-				pkg_get(pkg, PKG_ORIGIN, &tmp);
-				if (tmp != NULL)
-					sbuf_cat(dest, tmp);
-				break;
-			case 'R':
-				pkg_get(pkg, PKG_REPONAME, &tmp);
-				if (tmp != NULL)
-					sbuf_cat(dest, tmp);
-				break;
-			case 'p':
-				pkg_get(pkg, PKG_PREFIX, &tmp);
-				if (tmp != NULL)
-					sbuf_cat(dest, tmp);
-				break;
-			case 'm':
-				pkg_get(pkg, PKG_MAINTAINER, &tmp);
-				if (tmp != NULL)
-					sbuf_cat(dest, tmp);
-				break;
-			case 'c':
-				pkg_get(pkg, PKG_COMMENT, &tmp);
-				if (tmp != NULL)
-					sbuf_cat(dest, tmp);
-				break;
-			case 'w':
-				pkg_get(pkg, PKG_WWW, &tmp);
-				if (tmp != NULL)
-					sbuf_cat(dest, tmp);
-				break;
-			case 'i':
-				pkg_get(pkg, PKG_INFOS, &tmp);
-				if (tmp != NULL)
-					sbuf_cat(dest, tmp);
+				sbuf_putc(lit, '\n');
 				break;
 			case 'a':
-				pkg_get(pkg, PKG_AUTOMATIC, &tmp2);
-				sbuf_printf(dest, "%d", tmp2);
-				break;
-			case 'k':
-				pkg_get(pkg, PKG_LOCKED, &tmp2);
-				sbuf_printf(dest, "%d", tmp2);
-				break;
-			case 't':
-				pkg_get(pkg, PKG_TIME, &timestamp);
-				sbuf_printf(dest, "%" PRId64, timestamp);
-				break;
-			case 's':
-				qstr++;
-				pkg_get(pkg, PKG_FLATSIZE, &flatsize);
-				if (qstr[0] == 'h') {
-					humanize_number(size, sizeof(size),
-					    flatsize, "B", HN_AUTOSCALE, 0);
-					sbuf_cat(dest, size);
-				} else if (qstr[0] == 'b') {
-					sbuf_printf(dest, "%" PRId64, flatsize);
-				}
-				break;
-			case 'e':
-				pkg_get(pkg, PKG_DESC, &tmp);
-				if (tmp != NULL)
-					sbuf_cat(dest, tmp);
-				break;
-			case '?':
-				qstr++;
-				switch (qstr[0]) {
-				case 'd':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_DEPS) > 0);
-					break;
-				case 'r':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_RDEPS) > 0);
-					break;
-				case 'C':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_CATEGORIES) > 0);
-					break;
-				case 'F':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_FILES) > 0);
-					break;
-				case 'O':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_OPTIONS) > 0);
-					break;
-				case 'D':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_DIRS) > 0);
-					break;
-				case 'L':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_LICENSES) > 0);
-					break;
-				case 'U':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_USERS) > 0);
-					break;
-				case 'G':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_GROUPS) > 0);
-					break;
-				case 'B':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_SHLIBS_REQUIRED) > 0);
-					break;
-				case 'b':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_SHLIBS_PROVIDED) > 0);
-					break;
-				case 'A':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_ANNOTATIONS) > 0);
-					break;
-				}
+				sbuf_putc(lit, '\a');
 				break;
-			case '#':
-				qstr++;
-				switch (qstr[0]) {
-				case 'd':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_DEPS));
-					break;
-				case 'r':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_RDEPS));
-					break;
-				case 'C':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_CATEGORIES));
-					break;
-				case 'F':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_FILES));
-					break;
-				case 'O':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_OPTIONS));
-					break;
-				case 'D':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_DIRS));
-					break;
-				case 'L':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_LICENSES));
-					break;
-				case 'U':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_USERS));
-					break;
-				case 'G':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_GROUPS));
-					break;
-				case 'B':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_SHLIBS_REQUIRED));
-					break;
-				case 'b':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_SHLIBS_PROVIDED));
-					break;
-				case 'A':
-					sbuf_printf(dest, "%d", pkg_list_count(pkg, PKG_ANNOTATIONS));
-					break;
-				}
-				break;
-			case 'l':
-				pkg_get(pkg, PKG_LICENSE_LOGIC, &licenselogic);
-				switch (licenselogic) {
-				case LICENSE_SINGLE:
-					sbuf_cat(dest, "single");
-					break;
-				case LICENSE_OR:
-					sbuf_cat(dest, "or");
-					break;
-				case LICENSE_AND:
-					sbuf_cat(dest, "and");
-					break;
-				}
+			case 'b':
+				sbuf_putc(lit, '\b');
 				break;
-			case 'd':
-				qstr++;
-				if (qstr[0] == 'n')
-					sbuf_cat(dest, pkg_dep_name((struct pkg_dep *)data));
-				else if (qstr[0] == 'o')
-					sbuf_cat(dest, pkg_dep_origin((struct pkg_dep *)data));
-				else if (qstr[0] == 'v')
-					sbuf_cat(dest, pkg_dep_version((struct pkg_dep *)data));
+			case 'f':
+				sbuf_putc(lit, '\f');
 				break;
 			case 'r':
-				qstr++;
-				if (qstr[0] == 'n')
-					sbuf_cat(dest, pkg_dep_name((struct pkg_dep *)data));
-				else if (qstr[0] == 'o')
-					sbuf_cat(dest, pkg_dep_origin((struct pkg_dep *)data));
-				else if (qstr[0] == 'v')
-					sbuf_cat(dest, pkg_dep_version((struct pkg_dep *)data));
+				sbuf_putc(lit, '\r');
 				break;
-			case 'C':
-				sbuf_cat(dest, pkg_category_name((struct pkg_category *)data));
+			case '\\':
+				sbuf_putc(lit, '\\');
 				break;
-			case 'F':
-				qstr++;
-				if (qstr[0] == 'p')
-					sbuf_cat(dest, pkg_file_path((struct pkg_file *)data));
-				else if (qstr[0] == 's')
-					sbuf_cat(dest, pkg_file_cksum((struct pkg_file *)data));
+			case 't':
+				sbuf_putc(lit, '\t');
 				break;
-			case 'O':
+			case '\0':
+				continue;
+			}
+			qstr++;
+			continue;
+		}
+		if (qstr[0] != '%') {
+			sbuf_putc(lit, qstr[0]);
+			continue;
+		}
+
+		qstr++;
+		if (qstr[0] == '%') {
+			sbuf_putc(lit, '%');
+			continue;
+		}
+		query_lit_flush(q, lit);
+
+		switch (qstr[0]) {
+		case 'n':
+			query_op_new(q, QOP_STRING, PKG_NAME);
+			break;
+		case 'v':
+			query_op_new(q, QOP_STRING, PKG_VERSION);
+			break;
+		case 'o':
+			query_op_new(q, QOP_STRING, PKG_ORIGIN);
+			break;
+		case 'R':
+			query_op_new(q, QOP_STRING, PKG_REPONAME);
+			break;
+		case 'p':
+			query_op_new(q, QOP_STRING, PKG_PREFIX);
+			break;
+		case 'm':
+			query_op_new(q, QOP_STRING, PKG_MAINTAINER);
+			break;
+		case 'c':
+			query_op_new(q, QOP_STRING, PKG_COMMENT);
+			break;
+		case 'w':
+			query_op_new(q, QOP_STRING, PKG_WWW);
+			break;
+		case 'i':
+			query_op_new(q, QOP_STRING, PKG_INFOS);
+			break;
+		case 'e':
+			query_op_new(q, QOP_STRING, PKG_DESC);
+			break;
+		case 'M':
+			query_op_new(q, QOP_STRING, PKG_MESSAGE);
+			break;
+		case 'a':
+			query_op_new(q, QOP_BOOL, PKG_AUTOMATIC);
+			break;
+		case 'k':
+			query_op_new(q, QOP_BOOL, PKG_LOCKED);
+			break;
+		case 't':
+			query_op_new(q, QOP_INT64, PKG_TIME);
+			break;
+		case 'l':
+			query_op_new(q, QOP_LICENSE_LOGIC, PKG_LICENSE_LOGIC);
+			break;
+		case 's':
+			if (qstr[1] == 'h')
+				query_op_new(q, QOP_FLATSIZE_HUMAN,
+				    PKG_FLATSIZE);
+			else if (qstr[1] == 'b')
+				query_op_new(q, QOP_INT64, PKG_FLATSIZE);
+			if (qstr[1] != '\0')
 				qstr++;
-				if (qstr[0] == 'k')
-					sbuf_cat(dest, pkg_option_opt((struct pkg_option *)data));
-				else if (qstr[0] == 'v')
-					sbuf_cat(dest, pkg_option_value((struct pkg_option *)data));
-				break;
-			case 'D':
-				sbuf_cat(dest, pkg_dir_path((struct pkg_dir *)data));
-				break;
-			case 'L':
-				sbuf_cat(dest, pkg_license_name((struct pkg_license *)data));
-				break;
-			case 'U':
-				sbuf_cat(dest, pkg_user_name((struct pkg_user *)data));
-				break;
-			case 'G':
-				sbuf_cat(dest, pkg_group_name((struct pkg_group *)data));
-				break;
-			case 'B':
-			case 'b':
-				sbuf_cat(dest, pkg_shlib_name((struct pkg_shlib *)data));
-				break;
-			case 'A':
+			break;
+		case '?':
+		case '#':
+			if ((i = query_list(qstr[1])) >= 0)
+				query_op_new(q, qstr[0] == '?' ? QOP_HAS :
+				    QOP_COUNT, query_lists[i].list);
+			if (qstr[1] != '\0')
 				qstr++;
-				if (qstr[0] == 't')
-					sbuf_cat(dest, pkg_annotation_tag((struct pkg_note *)data));
-				else if (qstr[0] == 'v')
-					sbuf_cat(dest, pkg_annotation_value((struct pkg_note *)data));
-				break;
-			case 'M':
-				pkg_get(pkg, PKG_MESSAGE, &tmp);
-				if (tmp != NULL)
-					sbuf_cat(dest, tmp);
-				break;
-			case '%':
-				sbuf_putc(dest, '%');
+			break;
+		default:
+			for (i = 0; query_items[i].flag != 0; i++) {
+				if (query_items[i].flag != qstr[0])
+					continue;
+				if (query_items[i].opt != 0 &&
+				    query_items[i].opt != qstr[1])
+					continue;
+				op = query_op_new(q, QOP_ITEM, 0);
+				op->item = query_items[i].item;
 				break;
 			}
-		} else  if (qstr[0] == '\\') {
-			qstr++;
-			switch (qstr[0]) {
-			case 'n':
-				sbuf_putc(dest, '\n');
-				break;
-			case 'a':
-				sbuf_putc(dest, '\a');
-				break;
-			case 'b':
-				sbuf_putc(dest, '\b');
-				break;
-			case 'f':
-				sbuf_putc(dest, '\f');
-				break;
-			case 'r':
-				sbuf_putc(dest, '\r');
+			if (query_items[i].flag != 0 &&
+			    query_items[i].opt != 0)
+				qstr++;
+			else if (query_items[i].flag == 0 &&
+			    query_list(qstr[0]) >= 0 && qstr[1] != '\0')
+				qstr++;
+			break;
+		}
+		if (qstr[0] == '\0')
+			break;
+	}
+	query_lit_flush(q, lit);
+	sbuf_delete(lit);
+
+	return (q);
+}
+
+void
+free_query(struct query_format *q)
+{
+	int i;
+
+	if (q == NULL)
+		return;
+
+	for (i = 0; i < q->nops; i++)
+		free(q->ops[i].lit);
+	free(q->ops);
+	sbuf_delete(q->line);
+	free(q);
+}
+
+static void
+query_run(struct sbuf *dest, struct pkg *pkg, struct query_format *q,
+    void *data)
+{
+	struct query_op *op;
+	char size[7];
+	const char *tmp;
+	bool tmp2;
+	int64_t i64;
+	lic_t licenselogic;
+	int i;
+
+	for (i = 0; i < q->nops; i++) {
+		op = &q->ops[i];
+		switch (op->type) {
+		case QOP_LITERAL:
+			sbuf_bcat(dest, op->lit, op->len);
+			break;
+		case QOP_STRING:
+			pkg_get(pkg, op->attr, &tmp);
+			if (tmp != NULL)
+				sbuf_cat(dest, tmp);
+			break;
+		case QOP_BOOL:
+			pkg_get(pkg, op->attr, &tmp2);
+			sbuf_putc(dest, tmp2 ? '1' : '0');
+			break;
+		case QOP_INT64:
+			pkg_get(pkg, op->attr, &i64);
+			sbuf_printf(dest, "%" PRId64, i64);
+			break;
+		case QOP_FLATSIZE_HUMAN:
+			pkg_get(pkg, op->attr, &i64);
+			humanize_number(size, sizeof(size), i64, "B",
+			    HN_AUTOSCALE, 0);
+			sbuf_cat(dest, size);
+			break;
+		case QOP_LICENSE_LOGIC:
+			pkg_get(pkg, op->attr, &licenselogic);
+			switch (licenselogic) {
+			case LICENSE_SINGLE:
+				sbuf_cat(dest, "single");
 				break;
-			case '\\':
-				sbuf_putc(dest, '\\');
+			case LICENSE_OR:
+				sbuf_cat(dest, "or");
 				break;
-			case 't':
-				sbuf_putc(dest, '\t');
+			case LICENSE_AND:
+				sbuf_cat(dest, "and");
 				break;
 			}
-		} else {
-			sbuf_putc(dest, qstr[0]);
+			break;
+		case QOP_HAS:
+			sbuf_putc(dest, pkg_list_count(pkg, op->attr) > 0 ?
+			    '1' : '0');
+			break;
+		case QOP_COUNT:
+			sbuf_printf(dest, "%d", pkg_list_count(pkg, op->attr));
+			break;
+		case QOP_ITEM:
+			if (data != NULL)
+				sbuf_cat(dest, op->item(data));
+			break;
 		}
-		qstr++;
 	}
-	sbuf_finish(dest);
 }
 
+/*
+ * Append the lines produced by q for pkg to out, one per element of the
+ * multiline list if there is one.
+ */
 void
-print_query(struct pkg *pkg, char *qstr, char multiline)
+format_query(struct sbuf *out, struct pkg *pkg, struct query_format *q)
 {
-	struct sbuf		*output = sbuf_new_auto();
-	struct pkg_dep		*dep    = NULL;
-	struct pkg_category	*cat    = NULL;
-	struct pkg_option	*option = NULL;
-	struct pkg_file		*file   = NULL;
-	struct pkg_dir		*dir    = NULL;
-	struct pkg_license	*lic    = NULL;
-	struct pkg_user		*user   = NULL;
-	struct pkg_group	*group  = NULL;
-	struct pkg_shlib	*shlib  = NULL;
-	struct pkg_note		*note   = NULL;
-
-	switch (multiline) {
-	case 'd':
-		while (pkg_deps(pkg, &dep) == EPKG_OK) {
-			format_str(pkg, output, qstr, dep);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	case 'r':
-		while (pkg_rdeps(pkg, &dep) == EPKG_OK) {
-			format_str(pkg, output, qstr, dep);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	case 'C':
-		while (pkg_categories(pkg, &cat) == EPKG_OK) {
-			format_str(pkg, output, qstr, cat);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	case 'O':
-		while (pkg_options(pkg, &option) == EPKG_OK) {
-			format_str(pkg, output, qstr, option);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	case 'F':
-		while (pkg_files(pkg, &file) == EPKG_OK) {
-			format_str(pkg, output, qstr, file);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	case 'D':
-		while (pkg_dirs(pkg, &dir) == EPKG_OK) {
-			format_str(pkg, output, qstr, dir);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	case 'L':
-		while (pkg_licenses(pkg, &lic) == EPKG_OK) {
-			format_str(pkg, output, qstr, lic);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	case 'U':
-		while (pkg_users(pkg, &user) == EPKG_OK) {
-			format_str(pkg, output, qstr, user);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	case 'G':
-		while (pkg_groups(pkg, &group) == EPKG_OK) {
-			format_str(pkg, output, qstr, group);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	case 'B':
-		while (pkg_shlibs_required(pkg, &shlib) == EPKG_OK) {
-			format_str(pkg, output, qstr, shlib);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	case 'b':
-		while (pkg_shlibs_provided(pkg, &shlib) == EPKG_OK) {
-			format_str(pkg, output, qstr, shlib);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	case 'A':
-		while (pkg_annotations(pkg, &note) == EPKG_OK) {
-			format_str(pkg, output, qstr, note);
-			printf("%s\n", sbuf_data(output));
-		}
-		break;
-	default:
-		format_str(pkg, output, qstr, dep);
-		printf("%s\n", sbuf_data(output));
-		break;
+	void *data = NULL;
+
+	if (q->next == NULL) {
+		query_run(out, pkg, q, NULL);
+		sbuf_putc(out, '\n');
+		return;
+	}
+
+	while (q->next(pkg, &data) == EPKG_OK) {
+		query_run(out, pkg, q, data);
+		sbuf_putc(out, '\n');
 	}
-	sbuf_delete(output);
+}
+
+void
+print_query(struct pkg *pkg, struct query_format *q)
+{
+	sbuf_clear(q->line);
+	format_query(q->line, pkg, q);
+	sbuf_finish(q->line);
+	fwrite(sbuf_data(q->line), 1, sbuf_len(q->line), stdout);
 }
 
 typedef enum {
@@ -764,7 +799,7 @@ bad_option:
 }
 
 int
-analyse_query_string(char *qstr, struct query_flags *q_flags, const unsigned int q_flags_len, int *flags, char *multiline)
+analyse_query_string(char *qstr, struct query_flags *q_flags, const unsigned int q_flags_len, int *flags, uint64_t *fields, char *multiline)
 {
 	unsigned int i, j, k;
 	unsigned int valid_flag = 0;
@@ -831,6 +866,7 @@ analyse_query_string(char *qstr, struct query_flags *q_flags, const unsigned int
 							}
 					} else {
 						*flags |= q_flags[i].dbflags;
+						*fields |= q_flags[i].fields;
 					}
 
 					break; /* don't iterate over the rest of the flags */
@@ -869,6 +905,7 @@ exec_query(int argc, char **argv)
 	struct pkg_manifest_key *keys = NULL;
 	char *pkgname = NULL;
 	int query_flags = PKG_LOAD_BASIC;
+	uint64_t fields = 0;
 	match_t match = MATCH_EXACT;
 	int ch;
 	int ret;
@@ -877,7 +914,8 @@ exec_query(int argc, char **argv)
 	char multiline = 0;
 	char *condition = NULL;
 	struct sbuf *sqlcond = NULL;
-	const unsigned int q_flags_len = (sizeof(accepted_query_flags)/sizeof(accepted_query_flags[0]));
+	struct query_format *q = NULL;
+	bool case_sensitive = true;
 
 	while ((ch = getopt(argc, argv, "agixF:e:")) != -1) {
 		switch (ch) {
@@ -888,6 +926,7 @@ exec_query(int argc, char **argv)
 			match = MATCH_GLOB;
 			break;
 		case 'i':
+			case_sensitive = false;
 			pkgdb_set_case_sensitivity(false);
 			break;
 		case 'x':
@@ -922,7 +961,9 @@ exec_query(int argc, char **argv)
 		return (EX_USAGE);
 	}
 
-	if (analyse_query_string(argv[0], accepted_query_flags, q_flags_len, &query_flags, &multiline) != EPKG_OK)
+	if (analyse_query_string(argv[0], accepted_query_flags,
+	    accepted_query_flags_len, &query_flags, &fields, &multiline)
+	    != EPKG_OK)
 		return (EX_USAGE);
 
 	if (pkgname != NULL) {
@@ -932,7 +973,9 @@ exec_query(int argc, char **argv)
 		}
 
 		pkg_manifest_keys_free(keys);
-		print_query(pkg, argv[0], multiline);
+		q = compile_query(argv[0], multiline);
+		print_query(pkg, q);
+		free_query(q);
 		pkg_free(pkg);
 		return (EX_OK);
 	}
@@ -946,6 +989,13 @@ exec_query(int argc, char **argv)
 		sbuf_finish(sqlcond);
 	}
 
+	if (serve_query("query", match, case_sensitive, NULL, condition,
+	    argv[0], argc - 1, argv + 1, &retcode) == EPKG_OK) {
+		if (sqlcond != NULL)
+			sbuf_delete(sqlcond);
+		return (retcode);
+	}
+
 	ret = pkgdb_access(PKGDB_MODE_READ, PKGDB_DB_LOCAL);
 	if (ret == EPKG_ENOACCESS) {
 		warnx("Insufficient privilege to query package database");
@@ -961,15 +1011,21 @@ exec_query(int argc, char **argv)
 	if (ret != EPKG_OK)
 		return (EX_IOERR);
 
+	q = compile_query(argv[0], multiline);
+	/* each package is written at once: let them pile up in stdio */
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+
 	if (match == MATCH_ALL || match == MATCH_CONDITION) {
 		const char *condition_sql = NULL;
 		if (match == MATCH_CONDITION && sqlcond)
 			condition_sql = sbuf_data(sqlcond);
-		if ((it = pkgdb_query(db, condition_sql, match)) == NULL)
+		if ((it = pkgdb_query_fields(db, condition_sql, match,
+		    fields)) == NULL)
 			return (EX_IOERR);
 
 		while ((ret = pkgdb_it_next(it, &pkg, query_flags)) == EPKG_OK)
-			print_query(pkg, argv[0],  multiline);
+			print_query(pkg, q);
 
 		if (ret != EPKG_END)
 			retcode = EX_SOFTWARE;
@@ -980,12 +1036,13 @@ exec_query(int argc, char **argv)
 		for (i = 1; i < argc; i++) {
 			pkgname = argv[i];
 
-			if ((it = pkgdb_query(db, pkgname, match)) == NULL)
+			if ((it = pkgdb_query_fields(db, pkgname, match,
+			    fields)) == NULL)
 				return (EX_IOERR);
 
 			while ((ret = pkgdb_it_next(it, &pkg, query_flags)) == EPKG_OK) {
 				nprinted++;
-				print_query(pkg, argv[0], multiline);
+				print_query(pkg, q);
 			}
 
 			if (ret != EPKG_END) {
@@ -1002,6 +1059,7 @@ exec_query(int argc, char **argv)
 		}
 	}
 
+	free_query(q);
 	pkg_free(pkg);
 	pkgdb_close(db);
 
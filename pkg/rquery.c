@@ -42,31 +42,34 @@
 
 #include "pkgcli.h"
 
-static struct query_flags accepted_rquery_flags[] = {
-	{ 'd', "nov",		1, PKG_LOAD_DEPS },
-	{ 'r', "nov",		1, PKG_LOAD_RDEPS },
-	{ 'C', "",		1, PKG_LOAD_CATEGORIES },
-	{ 'O', "kv",		1, PKG_LOAD_OPTIONS },
-	{ 'L', "",		1, PKG_LOAD_LICENSES },
-	{ 'B', "",		1, PKG_LOAD_SHLIBS_REQUIRED },
-	{ 'b', "",		1, PKG_LOAD_SHLIBS_PROVIDED },
-	{ 'A', "tv",		1, PKG_LOAD_ANNOTATIONS },
-	{ '?', "drCOLBbA",	1, PKG_LOAD_BASIC },	/* dbflags handled in analyse_query_string() */
-	{ '#', "drCOLBbA",	1, PKG_LOAD_BASIC },	/* dbflags handled in analyse_query_string() */
-	{ 's', "hb",		0, PKG_LOAD_BASIC },
-	{ 'n', "",		0, PKG_LOAD_BASIC },
-	{ 'e', "",		0, PKG_LOAD_BASIC },
-	{ 'v', "",		0, PKG_LOAD_BASIC },
-	{ 'o', "",		0, PKG_LOAD_BASIC },
-	{ 'R', "",		0, PKG_LOAD_BASIC },
-	{ 'p', "",		0, PKG_LOAD_BASIC },
-	{ 'm', "",		0, PKG_LOAD_BASIC },
-	{ 'c', "",		0, PKG_LOAD_BASIC },
-	{ 'w', "",		0, PKG_LOAD_BASIC },
-	{ 'l', "",		0, PKG_LOAD_BASIC },
-	{ 'M', "",		0, PKG_LOAD_BASIC }
+struct query_flags accepted_rquery_flags[] = {
+	{ 'd', "nov",		1, PKG_LOAD_DEPS, 0 },
+	{ 'r', "nov",		1, PKG_LOAD_RDEPS, 0 },
+	{ 'C', "",		1, PKG_LOAD_CATEGORIES, 0 },
+	{ 'O', "kv",		1, PKG_LOAD_OPTIONS, 0 },
+	{ 'L', "",		1, PKG_LOAD_LICENSES, 0 },
+	{ 'B', "",		1, PKG_LOAD_SHLIBS_REQUIRED, 0 },
+	{ 'b', "",		1, PKG_LOAD_SHLIBS_PROVIDED, 0 },
+	{ 'A', "tv",		1, PKG_LOAD_ANNOTATIONS, 0 },
+	{ '?', "drCOLBbA",	1, PKG_LOAD_BASIC, 0 },	/* dbflags handled in analyse_query_string() */
+	{ '#', "drCOLBbA",	1, PKG_LOAD_BASIC, 0 },	/* dbflags handled in analyse_query_string() */
+	{ 's', "hb",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_FLATSIZE) },
+	{ 'n', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_NAME) },
+	{ 'e', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_DESC) },
+	{ 'v', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_VERSION) },
+	{ 'o', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_ORIGIN) },
+	{ 'R', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_REPONAME) },
+	{ 'p', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_PREFIX) },
+	{ 'm', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_MAINTAINER) },
+	{ 'c', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_COMMENT) },
+	{ 'w', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_WWW) },
+	{ 'l', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_LICENSE_LOGIC) },
+	{ 'M', "",		0, PKG_LOAD_BASIC, PKG_FIELD(PKG_MESSAGE) }
 };
 
+const unsigned int accepted_rquery_flags_len =
+    sizeof(accepted_rquery_flags) / sizeof(accepted_rquery_flags[0]);
+
 void
 usage_rquery(void)
 {
@@ -85,6 +88,7 @@ exec_rquery(int argc, char **argv)
 	struct pkg *pkg = NULL;
 	char *pkgname = NULL;
 	int query_flags = PKG_LOAD_BASIC;
+	uint64_t fields = 0;
 	match_t match = MATCH_EXACT;
 	int ch;
 	int ret = EPKG_OK;
@@ -93,11 +97,12 @@ exec_rquery(int argc, char **argv)
 	char multiline = 0;
 	char *condition = NULL;
 	struct sbuf *sqlcond = NULL;
-	const unsigned int q_flags_len = (sizeof(accepted_rquery_flags)/sizeof(accepted_rquery_flags[0]));
+	struct query_format *q = NULL;
 	const char *reponame = NULL;
 	bool auto_update;
 	bool onematched = false;
 	bool old_quiet;
+	bool case_sensitive = true;
 
 	pkg_config_bool(PKG_CONFIG_REPO_AUTOUPDATE, &auto_update);
 
@@ -110,6 +115,7 @@ exec_rquery(int argc, char **argv)
 			match = MATCH_GLOB;
 			break;
 		case 'i':
+			case_sensitive = false;
 			pkgdb_set_case_sensitivity(false);
 			break;
 		case 'x':
@@ -147,7 +153,9 @@ exec_rquery(int argc, char **argv)
 		return (EX_USAGE);
 	}
 
-	if (analyse_query_string(argv[0], accepted_rquery_flags, q_flags_len, &query_flags, &multiline) != EPKG_OK)
+	if (analyse_query_string(argv[0], accepted_rquery_flags,
+	    accepted_rquery_flags_len, &query_flags, &fields, &multiline)
+	    != EPKG_OK)
 		return (EX_USAGE);
 
 	if (condition != NULL) {
@@ -171,19 +179,32 @@ exec_rquery(int argc, char **argv)
 		return (ret);
 	quiet = old_quiet;
 
+	if (serve_query("rquery", match, case_sensitive, reponame, condition,
+	    argv[0], argc - 1, argv + 1, &retcode) == EPKG_OK) {
+		if (sqlcond != NULL)
+			sbuf_delete(sqlcond);
+		return (retcode);
+	}
+
 	ret = pkgdb_open(&db, PKGDB_REMOTE);
 	if (ret != EPKG_OK)
 		return (EX_IOERR);
 
+	q = compile_query(argv[0], multiline);
+	/* each package is written at once: let them pile up in stdio */
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+
 	if (match == MATCH_ALL || match == MATCH_CONDITION) {
 		const char *condition_sql = NULL;
 		if (match == MATCH_CONDITION && sqlcond)
 			condition_sql = sbuf_data(sqlcond);
-		if ((it = pkgdb_rquery(db, condition_sql, match, reponame)) == NULL)
+		if ((it = pkgdb_rquery_fields(db, condition_sql, match,
+		    reponame, fields)) == NULL)
 			return (EX_IOERR);
 
 		while ((ret = pkgdb_it_next(it, &pkg, query_flags)) == EPKG_OK)
-			print_query(pkg, argv[0],  multiline);
+			print_query(pkg, q);
 
 		if (ret != EPKG_END)
 			retcode = EX_SOFTWARE;
@@ -193,12 +214,13 @@ exec_rquery(int argc, char **argv)
 		for (i = 1; i < argc; i++) {
 			pkgname = argv[i];
 
-			if ((it = pkgdb_rquery(db, pkgname, match, reponame)) == NULL)
+			if ((it = pkgdb_rquery_fields(db, pkgname, match,
+			    reponame, fields)) == NULL)
 				return (EX_IOERR);
 
 			while ((ret = pkgdb_it_next(it, &pkg, query_flags)) == EPKG_OK) {
 				onematched = true;
-				print_query(pkg, argv[0], multiline);
+				print_query(pkg, q);
 			}
 
 			if (ret != EPKG_END) {
@@ -212,6 +234,7 @@ exec_rquery(int argc, char **argv)
 			retcode = EX_UNAVAILABLE;
 	}
 
+	free_query(q);
 	pkg_free(pkg);
 	pkgdb_close(db);
 
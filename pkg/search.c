@@ -215,9 +215,9 @@ usage_search(void)
 {
 	int i, n;
 
-	fprintf(stderr, "usage: pkg search [-egix] [-r repo] [-S search] "
+	fprintf(stderr, "usage: pkg search [-egitx] [-r repo] [-S search] "
 	    "[-L label] [-Q mod]... <pkg-name>\n");
-	fprintf(stderr, "       pkg search [-cDdefgiopqRx] [-r repo] "
+	fprintf(stderr, "       pkg search [-cDdefgiopqRtx] [-r repo] "
 	    "<pattern>\n\n");
 	n = fprintf(stderr, "       Search and Label options:");
 	for (i = 0; search_label[i].option != NULL; i++) {
@@ -256,7 +256,7 @@ exec_search(int argc, char **argv)
 
 	pkg_config_bool(PKG_CONFIG_REPO_AUTOUPDATE, &auto_update);
 
-	while ((ch = getopt(argc, argv, "cDdefgiL:opqQ:r:RS:sUx")) != -1) {
+	while ((ch = getopt(argc, argv, "cDdefgiL:opqQ:r:RS:stUx")) != -1) {
 		switch (ch) {
 		case 'c':	/* Same as -S comment */
 			search = search_label_opt("comment");
@@ -306,6 +306,9 @@ exec_search(int argc, char **argv)
 		case 's':	/* Same as -Q size */
 			opt |= modifier_opt("size");
 			break;
+		case 't':
+			match = MATCH_FTS;
+			break;
 		case 'U':
 			auto_update = false;
 			break;
@@ -0,0 +1,777 @@
+/*-
+ * Copyright (c) 2013 Baptiste Daroussin <bapt@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/sbuf.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pkg.h>
+
+#include "pkgcli.h"
+
+/*
+ * pkg serve keeps the package databases open in a single long lived
+ * process, so that the page cache and the prepared statements survive
+ * between invocations of pkg query and pkg rquery.
+ *
+ * A request is a sequence of NUL terminated strings sent over the
+ * socket, the client then shuts down its writing side:
+ *	kind ("query" or "rquery"), dbdir, match,
+ *	case insensitive ("1") or not ("0"),
+ *	repository name, condition, query format, pattern...
+ * Empty strings stand for "not set".  The server answers either with
+ * "ok: <exit code> <length>\n" followed by length bytes of output, or with
+ * "ko: <reason>\n" in which case the client runs the query itself.
+ *
+ * Clients are served from a single poll(2) loop: requests are only run
+ * once they have been read completely.  A client is dropped when it takes
+ * more than SERVE_TIMEOUT seconds to send its request, or to accept the
+ * next part of the answer, so that a slow client cannot hold the others
+ * up.  The time spent running queries is not counted against anyone.
+ *
+ * Clients give up after SERVE_CLIENT_TIMEOUT seconds without an answer,
+ * and run the query themselves.
+ */
+
+#define SERVE_MAXREQ	(64 * 1024)
+#define SERVE_NFIELDS	7
+#define SERVE_MAXREPOS	32
+#define SERVE_MAXFIELDS	1024
+#define SERVE_MAXCLIENTS	64
+#define SERVE_TIMEOUT	5
+#define SERVE_CLIENT_TIMEOUT	60
+
+static volatile sig_atomic_t serve_quit = 0;
+static volatile sig_atomic_t serve_reopen = 0;
+
+struct serve_db {
+	struct pkgdb	*db;
+	bool		 remote;
+	int		 nfiles;
+	char		 path[SERVE_MAXREPOS][MAXPATHLEN + 1];
+	ino_t		 ino[SERVE_MAXREPOS];
+	time_t		 mtime[SERVE_MAXREPOS];
+};
+
+struct serve_client {
+	int		 fd;
+	time_t		 deadline;
+	struct sbuf	*req;
+	struct sbuf	*reply;
+	size_t		 sent;
+};
+
+void
+usage_serve(void)
+{
+	fprintf(stderr, "usage: pkg serve [-s socket]\n\n");
+	fprintf(stderr, "For more information see 'pkg help serve'.\n");
+}
+
+static void
+serve_sighandler(int sig)
+{
+	if (sig == SIGHUP)
+		serve_reopen = 1;
+	else
+		serve_quit = 1;
+}
+
+static const char *
+serve_socket_path(const char *path)
+{
+	if (path == NULL &&
+	    pkg_config_string(PKG_CONFIG_SERVE_SOCKET, &path) != EPKG_OK)
+		return (NULL);
+
+	if (path == NULL || path[0] == '\0')
+		return (NULL);
+
+	if (strlen(path) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+		return (NULL);
+
+	return (path);
+}
+
+static void
+serve_stat_files(struct serve_db *sdb)
+{
+	struct stat	 st;
+	int		 i;
+
+	for (i = 0; i < sdb->nfiles; i++) {
+		if (stat(sdb->path[i], &st) == 0) {
+			sdb->ino[i] = st.st_ino;
+			sdb->mtime[i] = st.st_mtime;
+		} else {
+			sdb->ino[i] = 0;
+			sdb->mtime[i] = 0;
+		}
+	}
+}
+
+/*
+ * pkg update replaces the repository catalogues by renaming a new file
+ * over the old one, which an open connection would never notice.
+ */
+static bool
+serve_files_changed(struct serve_db *sdb)
+{
+	struct stat	 st;
+	int		 i;
+
+	for (i = 0; i < sdb->nfiles; i++) {
+		if (stat(sdb->path[i], &st) != 0) {
+			if (sdb->ino[i] != 0)
+				return (true);
+			continue;
+		}
+		if (st.st_ino != sdb->ino[i] || st.st_mtime != sdb->mtime[i])
+			return (true);
+	}
+
+	return (false);
+}
+
+static void
+serve_db_close(struct serve_db *sdb)
+{
+	if (sdb->db != NULL)
+		pkgdb_close(sdb->db);
+	sdb->db = NULL;
+	sdb->nfiles = 0;
+}
+
+static int
+serve_db_open(struct serve_db *sdb)
+{
+	struct pkg_repo	*r = NULL;
+	const char	*dbdir = NULL;
+
+	serve_db_close(sdb);
+
+	if (pkgdb_access(PKGDB_MODE_READ, PKGDB_DB_LOCAL) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	sdb->remote = (pkgdb_access(PKGDB_MODE_READ, PKGDB_DB_REPO) == EPKG_OK);
+	if (pkgdb_open(&sdb->db, sdb->remote ? PKGDB_REMOTE : PKGDB_DEFAULT)
+	    != EPKG_OK) {
+		sdb->db = NULL;
+		return (EPKG_FATAL);
+	}
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	while (sdb->remote && pkg_repos(&r) == EPKG_OK &&
+	    sdb->nfiles < SERVE_MAXREPOS) {
+		if (!pkg_repo_enabled(r))
+			continue;
+		snprintf(sdb->path[sdb->nfiles], sizeof(sdb->path[0]),
+		    "%s/%s.sqlite", dbdir, pkg_repo_name(r));
+		sdb->nfiles++;
+	}
+	serve_stat_files(sdb);
+
+	return (EPKG_OK);
+}
+
+static int
+serve_run_query(struct serve_db *sdb, bool remote, match_t match,
+    const char *reponame, const char *condition, char *qstr, int npatterns,
+    char **patterns, struct sbuf *out)
+{
+	struct pkgdb_it	*it = NULL;
+	struct pkg	*pkg = NULL;
+	struct sbuf	*sqlcond = NULL;
+	struct query_format *q = NULL;
+	int		 query_flags = PKG_LOAD_BASIC;
+	uint64_t	 fields = 0;
+	int		 retcode = EX_OK;
+	int		 ret, i;
+	bool		 matched = false;
+	char		 multiline = 0;
+
+	if (remote) {
+		if (analyse_query_string(qstr, accepted_rquery_flags,
+		    accepted_rquery_flags_len, &query_flags, &fields,
+		    &multiline) != EPKG_OK)
+			return (EX_USAGE);
+	} else {
+		if (analyse_query_string(qstr, accepted_query_flags,
+		    accepted_query_flags_len, &query_flags, &fields,
+		    &multiline) != EPKG_OK)
+			return (EX_USAGE);
+	}
+
+	if (match == MATCH_CONDITION) {
+		if (condition == NULL)
+			return (EX_USAGE);
+		sqlcond = sbuf_new_auto();
+		if (format_sql_condition((char *)condition, sqlcond, remote)
+		    != EPKG_OK) {
+			sbuf_delete(sqlcond);
+			return (EX_USAGE);
+		}
+		sbuf_finish(sqlcond);
+	}
+
+	q = compile_query(qstr, multiline);
+
+	if (match == MATCH_ALL || match == MATCH_CONDITION) {
+		const char *condition_sql = NULL;
+		if (sqlcond != NULL)
+			condition_sql = sbuf_data(sqlcond);
+		if (remote)
+			it = pkgdb_rquery_fields(sdb->db, condition_sql, match,
+			    reponame, fields);
+		else
+			it = pkgdb_query_fields(sdb->db, condition_sql, match,
+			    fields);
+		if (it == NULL) {
+			retcode = EX_IOERR;
+			goto cleanup;
+		}
+
+		while ((ret = pkgdb_it_next(it, &pkg, query_flags)) == EPKG_OK)
+			format_query(out, pkg, q);
+
+		if (ret != EPKG_END)
+			retcode = EX_SOFTWARE;
+
+		pkgdb_it_free(it);
+	} else {
+		for (i = 0; i < npatterns; i++) {
+			if (remote)
+				it = pkgdb_rquery_fields(sdb->db, patterns[i],
+				    match, reponame, fields);
+			else
+				it = pkgdb_query_fields(sdb->db, patterns[i],
+				    match, fields);
+			if (it == NULL) {
+				retcode = EX_IOERR;
+				goto cleanup;
+			}
+
+			while ((ret = pkgdb_it_next(it, &pkg, query_flags))
+			    == EPKG_OK) {
+				matched = true;
+				format_query(out, pkg, q);
+			}
+
+			pkgdb_it_free(it);
+
+			if (ret != EPKG_END) {
+				retcode = EX_SOFTWARE;
+				break;
+			}
+		}
+		if (!matched && retcode == EX_OK)
+			retcode = EX_UNAVAILABLE;
+	}
+
+cleanup:
+	free_query(q);
+	pkg_free(pkg);
+	if (sqlcond != NULL)
+		sbuf_delete(sqlcond);
+
+	return (retcode);
+}
+
+static int
+serve_write(int fd, const char *buf, size_t len)
+{
+	ssize_t	 w;
+
+	while (len > 0) {
+		if ((w = write(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return (EPKG_FATAL);
+		}
+		buf += w;
+		len -= w;
+	}
+
+	return (EPKG_OK);
+}
+
+/* Run a complete request and build the whole reply into reply */
+static void
+serve_client_request(struct serve_db *sdb, struct sbuf *req,
+    struct sbuf *reply)
+{
+	struct sbuf	*out = NULL;
+	char		*fields[SERVE_MAXFIELDS];
+	char		*p, *end;
+	const char	*dbdir = NULL;
+	const char	*reason = NULL;
+	int		 nfields = 0;
+	int		 retcode = EX_OK;
+	match_t		 match;
+	bool		 remote;
+
+	p = sbuf_data(req);
+	end = p + sbuf_len(req);
+	while (p < end && nfields < SERVE_MAXFIELDS) {
+		fields[nfields++] = p;
+		p += strlen(p) + 1;
+	}
+
+	if (nfields < SERVE_NFIELDS || p < end) {
+		reason = "invalid request";
+		goto reply;
+	}
+
+	if (strcmp(fields[0], "rquery") == 0)
+		remote = true;
+	else if (strcmp(fields[0], "query") == 0)
+		remote = false;
+	else {
+		reason = "unknown request";
+		goto reply;
+	}
+
+	pkg_config_string(PKG_CONFIG_DBDIR, &dbdir);
+	if (dbdir == NULL || strcmp(dbdir, fields[1]) != 0) {
+		reason = "different database directory";
+		goto reply;
+	}
+
+	if (serve_reopen || (sdb->db != NULL && serve_files_changed(sdb))) {
+		serve_reopen = 0;
+		serve_db_close(sdb);
+	}
+	if (sdb->db == NULL && serve_db_open(sdb) != EPKG_OK) {
+		reason = "cannot open the package database";
+		goto reply;
+	}
+	if (remote && !sdb->remote) {
+		reason = "no repository catalogue available";
+		goto reply;
+	}
+
+	match = (match_t)strtol(fields[2], NULL, 10);
+	pkgdb_set_case_sensitivity(fields[3][0] != '1');
+
+	out = sbuf_new_auto();
+	retcode = serve_run_query(sdb, remote, match,
+	    fields[4][0] != '\0' ? fields[4] : NULL,
+	    fields[5][0] != '\0' ? fields[5] : NULL,
+	    fields[6], nfields - SERVE_NFIELDS, fields + SERVE_NFIELDS, out);
+	sbuf_finish(out);
+
+reply:
+	if (reason != NULL)
+		sbuf_printf(reply, "ko: %s\n", reason);
+	else {
+		sbuf_printf(reply, "ok: %d %zd\n", retcode, sbuf_len(out));
+		sbuf_bcat(reply, sbuf_data(out), sbuf_len(out));
+	}
+	sbuf_finish(reply);
+
+	if (out != NULL)
+		sbuf_delete(out);
+}
+
+static void
+serve_client_close(struct serve_client *c)
+{
+	close(c->fd);
+	sbuf_delete(c->req);
+	if (c->reply != NULL)
+		sbuf_delete(c->reply);
+}
+
+/*
+ * Read what the client sent so far, and once it shut down its writing
+ * side, run the request.  Returns false when the client has to be dropped.
+ */
+static bool
+serve_client_read(struct serve_db *sdb, struct serve_client *c)
+{
+	char	 buf[BUFSIZ];
+	ssize_t	 r;
+
+	if ((r = read(c->fd, buf, sizeof(buf))) < 0)
+		return (errno == EINTR || errno == EAGAIN);
+
+	if (r > 0) {
+		if (sbuf_len(c->req) + r > SERVE_MAXREQ)
+			return (false);
+		sbuf_bcat(c->req, buf, r);
+		return (true);
+	}
+
+	sbuf_finish(c->req);
+	c->reply = sbuf_new_auto();
+	serve_client_request(sdb, c->req, c->reply);
+	c->deadline = time(NULL) + SERVE_TIMEOUT;
+
+	return (true);
+}
+
+/* Returns false once the reply is sent or the client has to be dropped */
+static bool
+serve_client_write(struct serve_client *c)
+{
+	ssize_t	 w;
+
+	w = write(c->fd, sbuf_data(c->reply) + c->sent,
+	    sbuf_len(c->reply) - c->sent);
+	if (w < 0)
+		return (errno == EINTR || errno == EAGAIN);
+	c->sent += w;
+	c->deadline = time(NULL) + SERVE_TIMEOUT;
+
+	return (c->sent < (size_t)sbuf_len(c->reply));
+}
+
+/*
+ * Only the owner and the group of PKG_DBDIR, who can read the databases
+ * anyway, may connect.
+ */
+static int
+serve_socket_perms(const char *sockpath)
+{
+	struct stat	 st;
+	const char	*dbdir = NULL;
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK ||
+	    dbdir == NULL || stat(dbdir, &st) == -1)
+		return (-1);
+
+	if (chown(sockpath, -1, st.st_gid) == -1)
+		return (-1);
+
+	return (chmod(sockpath, 0660));
+}
+
+int
+exec_serve(int argc, char **argv)
+{
+	struct serve_db		 sdb;
+	struct sockaddr_un	 addr;
+	struct sigaction	 sa;
+	struct serve_client	 clients[SERVE_MAXCLIENTS];
+	struct serve_client	*c;
+	struct pollfd		 pfd[SERVE_MAXCLIENTS + 1];
+	const char		*sockpath = NULL;
+	time_t			 now, spent;
+	mode_t			 mask;
+	bool			 keep;
+	int			 ch, sock, fd;
+	int			 nclients = 0, npfd, first, timeout, left;
+	int			 i, j, ret;
+
+	while ((ch = getopt(argc, argv, "s:")) != -1) {
+		switch (ch) {
+		case 's':
+			sockpath = optarg;
+			break;
+		default:
+			usage_serve();
+			return (EX_USAGE);
+		}
+	}
+	argc -= optind;
+
+	if (argc != 0) {
+		usage_serve();
+		return (EX_USAGE);
+	}
+
+	if ((sockpath = serve_socket_path(sockpath)) == NULL) {
+		warnx("Invalid socket path");
+		return (EX_USAGE);
+	}
+
+	memset(&sdb, 0, sizeof(sdb));
+	if (serve_db_open(&sdb) != EPKG_OK) {
+		warnx("Cannot open the package database");
+		return (EX_IOERR);
+	}
+
+	if ((sock = socket(PF_LOCAL, SOCK_STREAM, 0)) == -1) {
+		warn("socket()");
+		serve_db_close(&sdb);
+		return (EX_OSERR);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_LOCAL;
+	strlcpy(addr.sun_path, sockpath, sizeof(addr.sun_path));
+
+	/* do not take the socket over from a running server */
+	if (connect(sock, (struct sockaddr *)&addr, SUN_LEN(&addr)) == 0) {
+		warnx("%s: pkg serve is already running", sockpath);
+		close(sock);
+		serve_db_close(&sdb);
+		return (EX_UNAVAILABLE);
+	}
+	close(sock);
+	if ((sock = socket(PF_LOCAL, SOCK_STREAM, 0)) == -1) {
+		warn("socket()");
+		serve_db_close(&sdb);
+		return (EX_OSERR);
+	}
+
+	/* nobody can connect before the group is set */
+	unlink(sockpath);
+	mask = umask(0177);
+	ret = bind(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
+	umask(mask);
+	if (ret == -1 || serve_socket_perms(sockpath) == -1 ||
+	    listen(sock, 16) == -1) {
+		warn("%s", sockpath);
+		close(sock);
+		serve_db_close(&sdb);
+		return (EX_OSERR);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_sighandler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	while (!serve_quit) {
+		now = time(NULL);
+		timeout = -1;
+		npfd = 0;
+
+		/* stop accepting while all the slots are taken */
+		if (nclients < SERVE_MAXCLIENTS) {
+			pfd[npfd].fd = sock;
+			pfd[npfd++].events = POLLIN;
+		}
+		first = npfd;
+		for (i = 0; i < nclients; i++) {
+			left = clients[i].deadline > now ?
+			    (clients[i].deadline - now) * 1000 : 0;
+			if (timeout == -1 || left < timeout)
+				timeout = left;
+			pfd[npfd].fd = clients[i].fd;
+			pfd[npfd++].events = clients[i].reply == NULL ?
+			    POLLIN : POLLOUT;
+		}
+
+		if (poll(pfd, npfd, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("poll()");
+			break;
+		}
+
+		now = time(NULL);
+		for (i = 0; i < nclients; i++) {
+			c = &clients[i];
+			if (pfd[first + i].revents == 0)
+				continue;
+			keep = c->reply == NULL ? serve_client_read(&sdb, c) :
+			    serve_client_write(c);
+			if (!keep) {
+				serve_client_close(c);
+				c->fd = -1;
+			}
+		}
+
+		/* the others were kept waiting by the queries run above */
+		spent = time(NULL) - now;
+		now += spent;
+		for (i = 0; i < nclients; i++) {
+			c = &clients[i];
+			if (c->fd == -1)
+				continue;
+			c->deadline += spent;
+			if (now >= c->deadline) {
+				serve_client_close(c);
+				c->fd = -1;
+			}
+		}
+		for (i = j = 0; i < nclients; i++)
+			if (clients[i].fd != -1)
+				clients[j++] = clients[i];
+		nclients = j;
+
+		if (first == 0 || (pfd[0].revents & POLLIN) == 0)
+			continue;
+
+		if ((fd = accept(sock, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == ECONNABORTED)
+				continue;
+			warn("accept()");
+			break;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		c = &clients[nclients++];
+		c->fd = fd;
+		c->deadline = now + SERVE_TIMEOUT;
+		c->req = sbuf_new_auto();
+		c->reply = NULL;
+		c->sent = 0;
+	}
+
+	for (i = 0; i < nclients; i++)
+		serve_client_close(&clients[i]);
+	close(sock);
+	unlink(sockpath);
+	serve_db_close(&sdb);
+
+	return (EX_OK);
+}
+
+/*
+ * Client side: hand the query over to a running pkg serve.  Returns
+ * EPKG_OK and sets *retcode if the server answered, anything else means
+ * the caller should run the query itself.
+ */
+int
+serve_query(const char *kind, match_t match, bool case_sensitive,
+    const char *reponame, const char *condition, char *qstr, int npatterns,
+    char **patterns, int *retcode)
+{
+	struct sockaddr_un	 addr;
+	struct timeval		 tv;
+	struct sbuf		*req, *out = NULL;
+	const char		*sockpath, *dbdir = NULL;
+	char			 buf[BUFSIZ];
+	char			 header[64];
+	char			*end;
+	size_t			 hlen = 0;
+	ssize_t			 r;
+	long			 len;
+	int			 sock, i, code;
+	int			 ret = EPKG_FATAL;
+
+	if ((sockpath = serve_socket_path(NULL)) == NULL)
+		return (EPKG_FATAL);
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK ||
+	    dbdir == NULL)
+		return (EPKG_FATAL);
+
+	if ((sock = socket(PF_LOCAL, SOCK_STREAM, 0)) == -1)
+		return (EPKG_FATAL);
+
+	/* a hung server must not hang the client: it runs the query itself */
+	tv.tv_sec = SERVE_CLIENT_TIMEOUT;
+	tv.tv_usec = 0;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+	    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1) {
+		close(sock);
+		return (EPKG_FATAL);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_LOCAL;
+	strlcpy(addr.sun_path, sockpath, sizeof(addr.sun_path));
+	if (connect(sock, (struct sockaddr *)&addr, SUN_LEN(&addr)) == -1) {
+		close(sock);
+		return (EPKG_FATAL);
+	}
+
+	req = sbuf_new_auto();
+	sbuf_printf(req, "%s%c%s%c%d%c%c%c%s%c%s%c%s%c", kind, '\0', dbdir,
+	    '\0', (int)match, '\0', case_sensitive ? '0' : '1', '\0',
+	    reponame != NULL ? reponame : "", '\0',
+	    condition != NULL ? condition : "", '\0', qstr, '\0');
+	for (i = 0; i < npatterns; i++)
+		sbuf_printf(req, "%s%c", patterns[i], '\0');
+	sbuf_finish(req);
+
+	signal(SIGPIPE, SIG_IGN);
+	if (serve_write(sock, sbuf_data(req), sbuf_len(req)) != EPKG_OK ||
+	    shutdown(sock, SHUT_WR) == -1)
+		goto cleanup;
+
+	/* read the status line one byte at a time, the output follows */
+	while (hlen < sizeof(header) - 1) {
+		if ((r = read(sock, header + hlen, 1)) <= 0)
+			goto cleanup;
+		if (header[hlen++] == '\n')
+			break;
+	}
+	header[hlen] = '\0';
+
+	if (strncmp(header, "ok: ", 4) != 0)
+		goto cleanup;
+	code = (int)strtol(header + 4, &end, 10);
+	if (*end != ' ')
+		goto cleanup;
+	len = strtol(end + 1, &end, 10);
+	if (*end != '\n' || len < 0)
+		goto cleanup;
+
+	/*
+	 * Nothing is printed unless the whole output arrived: if the server
+	 * dies half way, the query is run here instead.
+	 */
+	out = sbuf_new_auto();
+	while ((r = read(sock, buf, sizeof(buf))) != 0) {
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			goto cleanup;
+		}
+		sbuf_bcat(out, buf, r);
+	}
+	sbuf_finish(out);
+	if (sbuf_len(out) != len)
+		goto cleanup;
+
+	fwrite(sbuf_data(out), 1, sbuf_len(out), stdout);
+	*retcode = code;
+	ret = EPKG_OK;
+
+cleanup:
+	sbuf_delete(req);
+	if (out != NULL)
+		sbuf_delete(out);
+	close(sock);
+
+	return (ret);
+}
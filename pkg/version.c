@@ -31,10 +31,16 @@
 #include <sys/param.h>
 #include <sys/queue.h>
 #include <sys/sbuf.h>
+#include <sys/sysctl.h>
 #include <sys/utsname.h>
+#include <sys/wait.h>
 
 #define _WITH_GETLINE
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <pkg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -55,6 +61,415 @@ struct index_entry {
 	UT_hash_handle hh;
 };
 
+/*
+ * Version of a port as given by make -V PKGVERSION, along with the
+ * modification time and size of the Makefile and distinfo it was computed
+ * from, and of the Makefile of its master port for a slave port.  The
+ * entries are kept between runs in <dbdir>/ports-versions, so make is only
+ * run again for the ports that changed.
+ */
+#define PORT_NSTAMPS	6
+
+struct port_entry {
+	char *origin;
+	char *version;		/* NULL if make failed */
+	int64_t stamp[PORT_NSTAMPS];
+	UT_hash_handle hh;
+};
+
+#define PORTS_CACHE	"ports-versions"
+
+/*
+ * Find the MASTERDIR a slave port sets in its Makefile.  Only values
+ * relative to ${.CURDIR} or ${PORTSDIR} are understood: false is returned
+ * for anything else, as the master port cannot be known without make.
+ * dir is left empty for a port which is not a slave port.
+ */
+static bool
+port_masterdir(const char *portsdir, const char *origin, char *dir,
+    size_t dirlen)
+{
+	FILE *fp;
+	char path[MAXPATHLEN], *line = NULL, *p, *val;
+	size_t linecap = 0;
+	ssize_t linelen;
+	bool ret = true;
+
+	dir[0] = '\0';
+	snprintf(path, sizeof(path), "%s/%s/Makefile", portsdir, origin);
+	if ((fp = fopen(path, "r")) == NULL)
+		return (true);
+
+	while ((linelen = getline(&line, &linecap, fp)) > 0) {
+		if (strncmp(line, "MASTERDIR", 9) != 0)
+			continue;
+		p = line + 9;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '?' || *p == ':')
+			p++;
+		if (*p++ != '=')
+			continue;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		val = p;
+		val[strcspn(val, " \t\n#")] = '\0';
+
+		if (strncmp(val, "${.CURDIR}", 10) == 0)
+			snprintf(dir, dirlen, "%s/%s%s", portsdir, origin,
+			    val + 10);
+		else if (strncmp(val, "${PORTSDIR}", 11) == 0)
+			snprintf(dir, dirlen, "%s%s", portsdir, val + 11);
+		if (dir[0] == '\0' || strchr(dir, '$') != NULL) {
+			dir[0] = '\0';
+			ret = false;
+		}
+		break;
+	}
+
+	free(line);
+	fclose(fp);
+	return (ret);
+}
+
+/*
+ * Returns false when the stamps cannot tell whether the port changed, in
+ * which case its version is always computed again.
+ */
+static bool
+port_stamp(const char *portsdir, const char *origin,
+    int64_t stamp[PORT_NSTAMPS])
+{
+	static const char *files[] = { "Makefile", "distinfo" };
+	char path[MAXPATHLEN], masterdir[MAXPATHLEN];
+	struct stat st;
+	unsigned int i;
+	bool ret;
+
+	ret = port_masterdir(portsdir, origin, masterdir, sizeof(masterdir));
+
+	for (i = 0; i < 3; i++) {
+		if (i < 2)
+			snprintf(path, sizeof(path), "%s/%s/%s", portsdir,
+			    origin, files[i]);
+		else
+			snprintf(path, sizeof(path), "%s/Makefile", masterdir);
+		if ((i < 2 || masterdir[0] != '\0') &&
+		    stat(path, &st) == 0) {
+			stamp[2 * i] = st.st_mtime;
+			stamp[2 * i + 1] = st.st_size;
+		} else {
+			stamp[2 * i] = -1;
+			stamp[2 * i + 1] = -1;
+		}
+	}
+
+	return (ret);
+}
+
+static void
+port_free(struct port_entry *e)
+{
+	free(e->origin);
+	free(e->version);
+	free(e);
+}
+
+/*
+ * The cache is a line naming the ports tree followed by one line per port:
+ * origin, the six stamps and the version, separated by tabs.  Only the
+ * ports make succeeded on are saved.  A cache made
+ * for another ports tree is ignored.
+ */
+static struct port_entry *
+ports_cache_load(const char *cachepath, const char *portsdir)
+{
+	FILE *fp;
+	struct port_entry *head = NULL, *e;
+	char *line = NULL, *p, *fields[PORT_NSTAMPS + 2];
+	size_t linecap = 0;
+	ssize_t linelen;
+	int i;
+	bool header = true;
+
+	if ((fp = fopen(cachepath, "r")) == NULL)
+		return (NULL);
+
+	while ((linelen = getline(&line, &linecap, fp)) > 0) {
+		if (line[linelen - 1] == '\n')
+			line[linelen - 1] = '\0';
+		if (header) {
+			if (strncmp(line, "portsdir\t", 9) != 0 ||
+			    strcmp(line + 9, portsdir) != 0)
+				break;
+			header = false;
+			continue;
+		}
+		p = line;
+		for (i = 0; i < PORT_NSTAMPS + 2 && p != NULL; i++)
+			fields[i] = strsep(&p, "\t");
+		if (i != PORT_NSTAMPS + 2 || fields[i - 1] == NULL ||
+		    fields[i - 1][0] == '\0')
+			continue;
+
+		HASH_FIND_STR(head, fields[0], e);
+		if (e != NULL)
+			continue;
+		if ((e = calloc(1, sizeof(*e))) == NULL)
+			break;
+		e->origin = strdup(fields[0]);
+		for (i = 0; i < PORT_NSTAMPS; i++)
+			e->stamp[i] = strtoimax(fields[i + 1], NULL, 10);
+		e->version = strdup(fields[PORT_NSTAMPS + 1]);
+		HASH_ADD_KEYPTR(hh, head, e->origin, strlen(e->origin), e);
+	}
+
+	free(line);
+	fclose(fp);
+	return (head);
+}
+
+/*
+ * Replace the cache atomically.  The cache is only an optimisation: when
+ * it cannot be written, e.g. when not running as root, it is left alone.
+ */
+static void
+ports_cache_save(const char *cachepath, const char *portsdir,
+    struct port_entry *head)
+{
+	FILE *fp;
+	struct port_entry *e, *tmp;
+	char tmppath[MAXPATHLEN];
+	int fd, i;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", cachepath);
+	if ((fd = mkstemp(tmppath)) == -1)
+		return;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmppath);
+		return;
+	}
+
+	fprintf(fp, "portsdir\t%s\n", portsdir);
+	HASH_ITER(hh, head, e, tmp) {
+		/* failures are retried on the next run */
+		if (e->version == NULL)
+			continue;
+		fprintf(fp, "%s", e->origin);
+		for (i = 0; i < PORT_NSTAMPS; i++)
+			fprintf(fp, "\t%" PRId64, e->stamp[i]);
+		fprintf(fp, "\t%s\n", e->version);
+	}
+
+	if (ferror(fp) | (fclose(fp) != 0) ||
+	    rename(tmppath, cachepath) != 0)
+		unlink(tmppath);
+}
+
+/*
+ * Run make -V PKGVERSION for each entry of todo, with up to PORTS_JOBS
+ * processes at once, and store the first line of their output.
+ */
+static void
+ports_make(const char *portsdir, struct port_entry **todo, int ntodo)
+{
+	struct port_job {
+		struct port_entry *entry;
+		struct sbuf *out;
+		pid_t pid;
+	} *jobs;
+	struct pollfd *pfd;
+	struct port_entry *e;
+	char path[MAXPATHLEN], buf[BUFSIZ], *nl;
+	int64_t njobs = 0;
+	int fds[2], running = 0, next = 0, i, status, devnull, ncpu;
+	size_t len;
+	ssize_t r;
+	pid_t pid;
+
+	if (ntodo == 0)
+		return;
+
+	pkg_config_int64(PKG_CONFIG_PORTS_JOBS, &njobs);
+	if (njobs <= 0) {
+		len = sizeof(ncpu);
+		if (sysctlbyname("hw.ncpu", &ncpu, &len, NULL, 0) == -1)
+			ncpu = 1;
+		njobs = ncpu;
+	}
+	if (njobs > ntodo)
+		njobs = ntodo;
+
+	jobs = calloc(njobs, sizeof(*jobs));
+	pfd = calloc(njobs, sizeof(*pfd));
+	if (jobs == NULL || pfd == NULL)
+		err(EX_OSERR, "calloc");
+
+	while (next < ntodo || running > 0) {
+		while (running < njobs && next < ntodo) {
+			e = todo[next++];
+			snprintf(path, sizeof(path), "%s/%s", portsdir,
+			    e->origin);
+			if (pipe(fds) == -1) {
+				warn("pipe");
+				continue;
+			}
+			if ((pid = fork()) == -1) {
+				warn("fork");
+				close(fds[0]);
+				close(fds[1]);
+				continue;
+			}
+			if (pid == 0) {
+				dup2(fds[1], STDOUT_FILENO);
+				close(fds[0]);
+				close(fds[1]);
+				if ((devnull = open("/dev/null", O_WRONLY)) != -1)
+					dup2(devnull, STDERR_FILENO);
+				execlp("make", "make", "-C", path,
+				    "-VPKGVERSION", (char *)NULL);
+				_exit(127);
+			}
+			close(fds[1]);
+			jobs[running].entry = e;
+			jobs[running].out = sbuf_new_auto();
+			jobs[running].pid = pid;
+			pfd[running].fd = fds[0];
+			pfd[running].events = POLLIN;
+			pfd[running].revents = 0;
+			running++;
+		}
+		if (running == 0)
+			break;
+
+		if (poll(pfd, running, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_OSERR, "poll");
+		}
+
+		/* from the end, as finished jobs are replaced by the last one */
+		for (i = running - 1; i >= 0; i--) {
+			if (pfd[i].revents == 0)
+				continue;
+			r = read(pfd[i].fd, buf, sizeof(buf));
+			if (r > 0) {
+				sbuf_bcat(jobs[i].out, buf, r);
+				continue;
+			}
+			if (r == -1 && errno == EINTR)
+				continue;
+
+			close(pfd[i].fd);
+			while (waitpid(jobs[i].pid, &status, 0) == -1 &&
+			    errno == EINTR)
+				;
+			sbuf_finish(jobs[i].out);
+			e = jobs[i].entry;
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+				if ((nl = strchr(sbuf_data(jobs[i].out), '\n'))
+				    != NULL)
+					*nl = '\0';
+				if (sbuf_data(jobs[i].out)[0] != '\0')
+					e->version = strdup(sbuf_data(jobs[i].out));
+			}
+			sbuf_delete(jobs[i].out);
+
+			running--;
+			jobs[i] = jobs[running];
+			pfd[i] = pfd[running];
+		}
+	}
+
+	free(jobs);
+	free(pfd);
+}
+
+/*
+ * Versions in the ports tree of the installed packages matching pattern,
+ * computed with make only for the ports whose Makefile, distinfo or master
+ * port Makefile changed since the last run.
+ */
+static struct port_entry *
+ports_versions(struct pkgdb *db, const char *pattern, match_t match,
+    const char *portsdir, const char *matchorigin)
+{
+	struct pkgdb_it *it;
+	struct pkg *pkg = NULL;
+	struct port_entry *cache, *head = NULL, *e, *tmp, **todo = NULL;
+	const char *origin, *dbdir;
+	char cachepath[MAXPATHLEN];
+	int64_t stamp[PORT_NSTAMPS];
+	int ntodo = 0, todocap = 0;
+	bool dirty = false, stale, known;
+
+	pkg_config_string(PKG_CONFIG_DBDIR, &dbdir);
+	snprintf(cachepath, sizeof(cachepath), "%s/%s", dbdir, PORTS_CACHE);
+	cache = ports_cache_load(cachepath, portsdir);
+
+	if ((it = pkgdb_query_fields(db, pattern, match, 0)) == NULL)
+		goto out;
+
+	while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC) == EPKG_OK) {
+		pkg_get(pkg, PKG_ORIGIN, &origin);
+		if (matchorigin != NULL && strcmp(origin, matchorigin) != 0)
+			continue;
+		HASH_FIND_STR(head, origin, e);
+		if (e != NULL)
+			continue;
+
+		known = port_stamp(portsdir, origin, stamp);
+		HASH_FIND_STR(cache, origin, e);
+		if (e != NULL) {
+			HASH_DEL(cache, e);
+			stale = !known ||
+			    memcmp(e->stamp, stamp, sizeof(stamp)) != 0;
+			if (stale) {
+				free(e->version);
+				e->version = NULL;
+			}
+		} else {
+			if ((e = calloc(1, sizeof(*e))) == NULL)
+				err(EX_OSERR, "calloc");
+			e->origin = strdup(origin);
+			stale = true;
+		}
+		HASH_ADD_KEYPTR(hh, head, e->origin, strlen(e->origin), e);
+		if (!stale)
+			continue;
+
+		dirty = true;
+		memcpy(e->stamp, stamp, sizeof(stamp));
+		/* no Makefile, no port: not worth running make */
+		if (stamp[0] == -1)
+			continue;
+		if (ntodo == todocap) {
+			todocap = todocap == 0 ? 64 : todocap * 2;
+			todo = realloc(todo, todocap * sizeof(*todo));
+			if (todo == NULL)
+				err(EX_OSERR, "realloc");
+		}
+		todo[ntodo++] = e;
+	}
+	pkg_free(pkg);
+	pkgdb_it_free(it);
+
+	ports_make(portsdir, todo, ntodo);
+	free(todo);
+
+out:
+	/* keep the ports not installed anymore, they may come back */
+	HASH_ITER(hh, cache, e, tmp) {
+		HASH_DEL(cache, e);
+		HASH_ADD_KEYPTR(hh, head, e->origin, strlen(e->origin), e);
+	}
+	if (dirty)
+		ports_cache_save(cachepath, portsdir, head);
+
+	return (head);
+}
+
 void
 usage_version(void)
 {
@@ -73,7 +488,9 @@ print_version(struct pkg *pkg, const char *source, const char *ver, char limchar
 	const char *version, *name, *origin;
 	char *namever = NULL;
 
-	pkg_get(pkg, PKG_VERSION, &version, PKG_NAME, &name, PKG_ORIGIN, &origin);
+	/* remote packages from pkgdb_rquery_installed() carry the local version */
+	pkg_get(pkg, pkg_type(pkg) == PKG_REMOTE ? PKG_OLD_VERSION : PKG_VERSION,
+	    &version, PKG_NAME, &name, PKG_ORIGIN, &origin);
 	if (ver == NULL) {
 		if (source == NULL)
 			key = '!';
@@ -153,12 +570,11 @@ exec_version(int argc, char **argv)
 	char *buf;
 	char *version;
 	struct index_entry *entry, *tmp;
+	struct port_entry *porthead = NULL, *port, *porttmp;
 	struct pkgdb *db = NULL;
-	struct pkg *pkg = NULL, *pkg_remote = NULL;
-	struct pkgdb_it *it = NULL, *it_remote = NULL;
+	struct pkg *pkg = NULL;
+	struct pkgdb_it *it = NULL;
 	char limchar = '-';
-	struct sbuf *cmd;
-	struct sbuf *res;
 	const char *portsdir;
 	const char *origin;
 	const char *matchorigin = NULL;
@@ -335,6 +751,32 @@ exec_version(int argc, char **argv)
 			if (pkgdb_open(&db, PKGDB_DEFAULT) != EPKG_OK)
 				return (EX_IOERR);
 
+		if (opt & VERSION_SOURCE_REMOTE) {
+			/* one query matching all the packages with the repos */
+			it = pkgdb_rquery_installed(db, pattern, match, reponame);
+			if (it == NULL)
+				goto cleanup;
+
+			while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC) == EPKG_OK) {
+				pkg_get(pkg, PKG_ORIGIN, &origin,
+				    PKG_VERSION, &version_remote);
+
+				/* If -O was specific, check if this origin matches */
+				if ((opt & VERSION_WITHORIGIN) &&
+				    strcmp(origin, matchorigin) != 0)
+					continue;
+
+				/* no repository has this origin */
+				if (version_remote != NULL &&
+				    version_remote[0] == '\0')
+					version_remote = NULL;
+
+				print_version(pkg, "remote", version_remote,
+				    limchar, opt);
+			}
+			goto cleanup;
+		}
+
 		if ((it = pkgdb_query(db, pattern, match)) == NULL)
 			goto cleanup;
 
@@ -374,6 +816,10 @@ exec_version(int argc, char **argv)
 			fclose(indexfile);
 		}
 
+		if (opt & VERSION_SOURCE_PORTS)
+			porthead = ports_versions(db, pattern, match, portsdir,
+			    matchorigin);
+
 		while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC) == EPKG_OK) {
 			pkg_get(pkg, PKG_ORIGIN, &origin);
 
@@ -386,35 +832,10 @@ exec_version(int argc, char **argv)
 				if (entry != NULL)
 					print_version(pkg, "index", entry->version, limchar, opt);
 			} else if (opt & VERSION_SOURCE_PORTS) {
-				cmd = sbuf_new_auto();
-				sbuf_printf(cmd, "make -C %s/%s -VPKGVERSION 2>/dev/null", portsdir, origin);
-				sbuf_finish(cmd);
-
-				if ((res = exec_buf(sbuf_data(cmd))) != NULL) {
-					buf = sbuf_data(res);
-					while (*buf != '\0') {
-						if (*buf == '\n') {
-							*buf = '\0';
-							break;
-						}
-						buf++;
-					}
-					print_version(pkg, "port", sbuf_data(res), limchar, opt);
-					sbuf_delete(res);
-				} else {
-					print_version(pkg, "port", NULL, limchar, opt);
-				}
-				sbuf_delete(cmd);
-			} else if (opt & VERSION_SOURCE_REMOTE) {
-				if ((it_remote = pkgdb_rquery(db, origin, MATCH_EXACT, reponame)) == NULL)
-					return (EX_IOERR);
-				if (pkgdb_it_next(it_remote, &pkg_remote, PKG_LOAD_BASIC) == EPKG_OK) {
-					pkg_get(pkg_remote, PKG_VERSION, &version_remote);
-					print_version(pkg, "remote", version_remote, limchar, opt);
-				} else {
-					print_version(pkg, "remote", NULL, limchar, opt);
-				}
-				pkgdb_it_free(it_remote);
+				HASH_FIND_STR(porthead, origin, port);
+				print_version(pkg, "port",
+				    port != NULL ? port->version : NULL, limchar,
+				    opt);
 			}
 		}
 	}
@@ -426,9 +847,12 @@ cleanup:
 		free(entry->version);
 		free(entry);
 	}
+	HASH_ITER(hh, porthead, port, porttmp) {
+		HASH_DEL(porthead, port);
+		port_free(port);
+	}
 
 	pkg_free(pkg);
-	pkg_free(pkg_remote);
 	pkgdb_it_free(it);
 	pkgdb_close(db);
 
@@ -452,6 +452,7 @@ _pkg () {
 		'-d[check for and install missing dependencies]' 
 		'-r[recompute sizes and checksums of installed]' 
 		'-s[find invalid checksums]' 
+		'-F[read every file, even if unchanged]' 
 		'-v[Be verbose]' 
 		'(-g -x -X)-a[Process all packages]' 
 		'(-x -X -a)-g[Process packages that matches glob]'
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Compare the time taken to create and to extract, and the size of the
+# archives produced by pkg create for each format and a few
+# COMPRESSION_THREADS and COMPRESSION_LEVEL settings.
+#
+# usage: compression.sh [package [threads ...]]
+#
+# The corpus is an installed package (pkg itself by default), archived
+# once as plain tar to get the reference size.
+
+PKG=${PKG:-pkg}
+name=${1:-pkg}
+[ $# -gt 0 ] && shift
+threads=${*:-1 2 4 0}
+levels=${LEVELS:-0 1 9}
+
+out=$(mktemp -d -t pkgbench) || exit 1
+trap 'rm -rf ${out}' EXIT
+
+now() {
+	date +%s.%N 2>/dev/null | grep -v N || date +%s
+}
+
+run() {
+	rm -f ${out}/*
+	start=$(now)
+	env COMPRESSION_THREADS=$1 COMPRESSION_LEVEL=$2 \
+	    ${PKG} create -o ${out} -f $3 ${name} >/dev/null || exit 1
+	end=$(now)
+	size=$(stat -f %z ${out}/* 2>/dev/null || stat -c %s ${out}/*)
+	tar -xOf ${out}/* >/dev/null || exit 1
+	extracted=$(now)
+}
+
+run 1 0 tar
+raw=${size}
+
+printf "%-8s %-6s %-6s %10s %10s %12s %7s\n" format level threads create \
+    extract bytes ratio
+for fmt in tzst txz tgz stgz tbz; do
+	for level in ${levels}; do
+		for t in ${threads}; do
+			[ ${fmt} != txz -a ${fmt} != tzst ] && [ ${t} != 1 ] && continue
+			run ${t} ${level} ${fmt}
+			printf "%-8s %-6s %-6s %10.2f %10.2f %12d %6.2f%%\n" \
+			    ${fmt} ${level} ${t} \
+			    $(echo "${end} - ${start}" | bc) \
+			    $(echo "${extracted} - ${end}" | bc) \
+			    ${size} $(echo "100 * ${size} / ${raw}" | bc -l)
+		done
+	done
+done
@@ -0,0 +1,164 @@
+/*-
+ * Copyright (c) 2013 Baptiste Daroussin <bapt@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR(S) ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Throughput of pkg_sha256_file(), against the stdio loop it replaced, on
+ * files of a few sizes in the page cache.
+ *
+ * usage: sha256 [-d directory] [-n megabytes]
+ *
+ * Each size is hashed until about -n megabytes (default 256) were read,
+ * in a scratch directory created in -d (default /tmp).
+ */
+
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include <pkg.h>
+
+static const size_t sizes[] = {
+	512, 4096, 65536, 1024 * 1024, 16 * 1024 * 1024, 128 * 1024 * 1024,
+};
+
+static int
+stdio_sha256_file(const char *path, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	FILE *fp;
+	char buffer[BUFSIZ];
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	size_t r;
+	SHA256_CTX sha256;
+	int i;
+
+	if ((fp = fopen(path, "rb")) == NULL)
+		return (EPKG_FATAL);
+
+	SHA256_Init(&sha256);
+	while ((r = fread(buffer, 1, BUFSIZ, fp)) > 0)
+		SHA256_Update(&sha256, buffer, r);
+	fclose(fp);
+	SHA256_Final(hash, &sha256);
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		sprintf(out + (i * 2), "%02x", hash[i]);
+
+	return (EPKG_OK);
+}
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+/* Megabytes per second of hash over path, of size bytes */
+static double
+run(int (*hash)(const char *, char *), const char *path, size_t size,
+    long total, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	double start;
+	long n, rounds;
+
+	rounds = total / size;
+	if (rounds < 1)
+		rounds = 1;
+
+	start = now();
+	for (n = 0; n < rounds; n++)
+		if (hash(path, out) != EPKG_OK)
+			err(1, "%s", path);
+
+	return (rounds * (double)size / (1024 * 1024) / (now() - start));
+}
+
+int
+main(int argc, char **argv)
+{
+	char dir[MAXPATHLEN], path[MAXPATHLEN];
+	char new[SHA256_DIGEST_LENGTH * 2 + 1], old[SHA256_DIGEST_LENGTH * 2 + 1];
+	const char *tmpdir = "/tmp";
+	char *buf;
+	FILE *fp;
+	long total = 256L * 1024 * 1024;
+	unsigned int i;
+	size_t j;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "d:n:")) != -1) {
+		switch (ch) {
+		case 'd':
+			tmpdir = optarg;
+			break;
+		case 'n':
+			total = strtol(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		default:
+			fprintf(stderr, "usage: sha256 [-d directory] "
+			    "[-n megabytes]\n");
+			return (1);
+		}
+	}
+
+	snprintf(dir, sizeof(dir), "%s/pkgbench.XXXXXX", tmpdir);
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+
+	printf("%12s %12s %12s\n", "bytes", "stdio MB/s", "pkg MB/s");
+	for (i = 0; i < nitems(sizes); i++) {
+		snprintf(path, sizeof(path), "%s/%zu", dir, sizes[i]);
+		if ((buf = malloc(sizes[i])) == NULL)
+			err(1, "malloc");
+		for (j = 0; j < sizes[i]; j++)
+			buf[j] = random();
+		if ((fp = fopen(path, "w")) == NULL ||
+		    fwrite(buf, 1, sizes[i], fp) != sizes[i] || fclose(fp) != 0)
+			err(1, "%s", path);
+		free(buf);
+
+		/* once to have the file in the page cache */
+		stdio_sha256_file(path, old);
+		printf("%12zu %12.1f %12.1f\n", sizes[i],
+		    run(stdio_sha256_file, path, sizes[i], total, old),
+		    run(pkg_sha256_file, path, sizes[i], total, new));
+		if (strcmp(old, new) != 0)
+			errx(1, "%s: checksums differ: %s %s", path, old, new);
+		unlink(path);
+	}
+	rmdir(dir);
+
+	return (0);
+}
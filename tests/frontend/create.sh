@@ -0,0 +1,58 @@
+#! /usr/bin/env atf-sh
+
+atf_test_case create_rootdir_shlibs
+create_rootdir_shlibs_head() {
+	atf_set "descr" "pkg create -r -- shared libraries under the root"
+	atf_set "require.files" "/lib/libc.so.7"
+}
+
+create_rootdir_shlibs_body() {
+	root=$HOME/root
+	mkdir -p $root/usr/local/lib $HOME/manifest $HOME/out
+
+	# one library without a checksum in the manifest, hashed and
+	# analysed in one pass, one with it, only analysed
+	cp /lib/libc.so.7 $root/usr/local/lib/libnosum.so.1
+	cp /lib/libc.so.7 $root/usr/local/lib/libsum.so.1
+	sum=$(sha256 -q $root/usr/local/lib/libsum.so.1)
+
+	case $(uname -m) in
+	amd64)	arch=x86:64 ;;
+	i386)	arch=x86:32 ;;
+	*)	atf_skip "no ABI known for $(uname -m)" ;;
+	esac
+	abi=freebsd:$(uname -r | cut -d. -f1):$arch
+
+	cat > $HOME/manifest/+MANIFEST <<EOM
+name: test
+version: 1.0
+origin: misc/test
+comment: a test
+arch: $abi
+www: http://test
+maintainer: test
+prefix: /usr/local
+desc: a test
+files:
+  /usr/local/lib/libnosum.so.1: '-'
+  /usr/local/lib/libsum.so.1: $sum
+EOM
+
+	atf_check \
+	    -o ignore \
+	    -e empty \
+	    -s exit:0 \
+	    pkg create -r $root -m $HOME/manifest -o $HOME/out
+
+	atf_check \
+	    -o match:"libnosum\.so\.1" \
+	    -o match:"libsum\.so\.1" \
+	    -s exit:0 \
+	    pkg info -b -F $HOME/out/test-1.0.txz
+}
+
+atf_init_test_cases() {
+	. $(atf_get_srcdir)/test_environment
+
+	atf_add_test_case create_rootdir_shlibs
+}
@@ -21,9 +21,21 @@ ATF_TC_BODY(pkg, tc)
 {
     test_pkg();
 }
+
+ATF_TC(version);
+ATF_TC_HEAD(version, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "Testing version keys against pkg_version_cmp()...");
+}
+
+ATF_TC_BODY(version, tc)
+{
+    test_version();
+}
 ATF_TP_ADD_TCS(tp)
 {
     ATF_TP_ADD_TC(tp, manifest);
     ATF_TP_ADD_TC(tp, pkg);
+    ATF_TP_ADD_TC(tp, version);
     return atf_no_error();
 }
@@ -2,4 +2,5 @@
 
 void test_manifest(void);
 void test_pkg(void);
+void test_version(void);
 
@@ -0,0 +1,58 @@
+#include <atf-c.h>
+#include <sys/sbuf.h>
+#include <pkg.h>
+#include <string.h>
+
+#include "tests.h"
+
+static const char *versions[] = {
+	/* epochs and revisions */
+	"1.0", "1.0_1", "1.0_2", "1.0,1", "1.0_1,1", "0.9,2", "2.0,1",
+	/* '+' segments */
+	"1.0+1", "1.0+0.1", "1.0+a", "1.0.1+1", "1+1.1", "1.0+", "+1",
+	/* alpha, beta, pre, rc and pl stages */
+	"1.0a", "1.0a1", "1.0.a1", "1.0alpha1", "1.0b1", "1.0beta2",
+	"1.0pre1", "1.0rc1", "1.0.rc2", "1.0pl1", "1.0p1", "1.0z",
+	/* '*' components */
+	"1.0*", "1.*", "1.0.*", "*", "1.0*1",
+	/* missing trailing components */
+	"1", "1.0.0", "1.0.0.0", "1.0.1", "1.1", "10", "0", "0.0", "",
+	"1.a", "1.0.a", "1.0a0",
+	NULL
+};
+
+static void
+version_key(const char *version, struct sbuf *key)
+{
+	sbuf_clear(key);
+	ATF_REQUIRE_EQ_MSG(EPKG_OK, pkg_version_key(version, key),
+	    "pkg_version_key(\"%s\") failed", version);
+	sbuf_finish(key);
+}
+
+void
+test_version(void)
+{
+	struct sbuf *k1, *k2;
+	int i, j, cmp, keycmp;
+
+	k1 = sbuf_new_auto();
+	k2 = sbuf_new_auto();
+
+	for (i = 0; versions[i] != NULL; i++) {
+		version_key(versions[i], k1);
+		for (j = 0; versions[j] != NULL; j++) {
+			version_key(versions[j], k2);
+			cmp = pkg_version_cmp(versions[i], versions[j]);
+			keycmp = pkg_version_keycmp(sbuf_data(k1),
+			    sbuf_len(k1), sbuf_data(k2), sbuf_len(k2));
+			ATF_CHECK_EQ_MSG(cmp, keycmp,
+			    "\"%s\" vs \"%s\": pkg_version_cmp() %d, "
+			    "pkg_version_keycmp() %d", versions[i], versions[j],
+			    cmp, keycmp);
+		}
+	}
+
+	sbuf_delete(k1);
+	sbuf_delete(k2);
+}